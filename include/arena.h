@@ -5,9 +5,19 @@
 
 struct arena;
 
+// position to roll back to, releasing everything allocated after it
+struct arena_mark {
+    struct arena *block;
+    void *avail;
+};
+
 struct arena *arena_new(void);
 void *arena_alloc(struct arena *arena, const size_t size);
 void arena_clear(struct arena *arena);
+struct arena_mark arena_save(struct arena *arena);
+void arena_restore(struct arena *arena, const struct arena_mark mark);
+size_t arena_used(const struct arena *arena);
+void arena_trim(struct arena *arena, const size_t keep);
 void arena_free(struct arena **p_arena);
 
 #endif
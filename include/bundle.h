@@ -0,0 +1,53 @@
+#ifndef H_BUNDLE
+#define H_BUNDLE
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sized_str.h"
+
+#define BUNDLE_MAGIC "HTTPBNDL"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ETAG_LEN 18 // `"` + 16 hex digits + `"`
+
+// on-disk layout (all offsets from start of file):
+// header | entries[entry_count] | slots[slot_count] | seeds[bucket_count] | paths and bodies
+struct bundle_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t slot_count;
+    uint32_t bucket_count;
+    uint64_t entries_offset;
+    uint64_t slots_offset;
+    uint64_t seeds_offset;
+    uint64_t size;
+};
+
+struct bundle_entry {
+    uint64_t path_offset;
+    uint64_t body_offset;
+    uint64_t body_len;
+    uint64_t gzip_offset;
+    uint64_t gzip_len; // 0 when compression does not shrink the body
+    uint32_t path_len;
+    uint8_t kind; // 'd' or 'f', same as dir_or_file()
+    uint8_t content_type;
+    char etag[BUNDLE_ETAG_LEN + 1];
+    char gzip_etag[BUNDLE_ETAG_LEN + 1];
+};
+
+struct bundle;
+
+uint64_t bundle_hash(const struct sized_str key, const uint32_t seed);
+struct bundle *bundle_open(const char *path);
+void bundle_close(struct bundle **p_bundle);
+uint32_t bundle_entry_count(const struct bundle *bundle);
+int bundle_fd(const struct bundle *bundle);
+off_t bundle_offset(const struct bundle *bundle, const char *ptr);
+const struct bundle_entry *bundle_lookup(const struct bundle *bundle, const struct sized_str path);
+struct sized_str bundle_body(const struct bundle *bundle, const struct bundle_entry *entry, const int gzip);
+struct bundle *bundle_mark_stale(struct bundle *bundle, const struct sized_str *paths, const size_t count);
+int bundle_is_stale(const struct bundle *bundle, struct sized_str path);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef H_CAPTURE
+#define H_CAPTURE
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Traffic capture for offline replay (see src/replay.c). File layout:
+// capture_header | (capture_record | payload[len])...
+// Records are in arrival order; a connection's first DATA record opens it on replay.
+
+#define CAPTURE_MAGIC "HTTPCAP1"
+#define CAPTURE_MAX_PAYLOAD UINT16_MAX
+
+enum capture_type { CAPTURE_DATA, CAPTURE_CLOSE };
+
+struct capture_header {
+    char magic[8];
+    uint64_t start_unix_ns; // wall clock when capture started, record times are relative to it
+};
+
+struct capture_record {
+    uint64_t time_ns;
+    uint32_t conn_id;
+    uint16_t type;
+    uint16_t len;
+};
+
+extern int g_capture_enabled;
+
+int capture_init(const char *path);
+void capture_slow(const uint32_t conn_id, const enum capture_type type, const char *data, const size_t len);
+
+static inline void capture_data(const uint32_t conn_id, const char *data, const size_t len) {
+    if (g_capture_enabled)
+        capture_slow(conn_id, CAPTURE_DATA, data, len);
+}
+
+static inline void capture_close(const uint32_t conn_id) {
+    if (g_capture_enabled)
+        capture_slow(conn_id, CAPTURE_CLOSE, NULL, 0);
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef H_COMPRESS
+#define H_COMPRESS
+
+#include "sized_str.h"
+
+// A body handed to the compression pool. `in` and `out` are malloc'd by the submitter (`out` as large as
+// `in`); `done` runs on the pool thread, owns the job from then on, and finds `out.len` set to the gzip
+// length, with `compressed` clear when gzip did not come out smaller.
+struct compress_job {
+    struct sized_str in;
+    struct sized_str out;
+    int compressed;
+    void (*done)(struct compress_job *job);
+};
+
+int gzip_compress(char *restrict out_buf, struct sized_str str);
+int compress_pool_start(const int thread_count);
+int compress_submit(struct compress_job *job);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef H_CONFIG
+#define H_CONFIG
+
+#define CONFIG_MAX_PROXY_ROUTES 16
+#define CONFIG_MAX_LISTENERS 16
+#define CONFIG_MAX_UPLOAD_ROUTES 16
+
+enum upload_fsync { UPLOAD_FSYNC_NONE, UPLOAD_FSYNC_FILE, UPLOAD_FSYNC_FULL };
+
+struct config {
+    const char *listen_specs[CONFIG_MAX_LISTENERS]; // see listener.h, none: port 80 on every IPv4 address
+    int listen_tls[CONFIG_MAX_LISTENERS]; // --tls-listen: the address speaks HTTPS
+    int listen_count;
+    const char *tls_cert; // PEM certificate chain and private key for the TLS listeners
+    const char *tls_key;
+    int ktls; // hand the record layer to the kernel after the handshake when it supports it
+    int unix_mode; // permissions of Unix socket files, -1: left to the umask
+    const char *unix_group;
+    int tcp_nodelay; // on accepted sockets, inherited from the listener
+    int tcp_cork; // MSG_MORE on headers followed by a file body, so they leave in one segment
+    int defer_accept_s; // TCP_DEFER_ACCEPT: accept once the request arrives, 0: off
+    int fastopen_qlen; // TCP_FASTOPEN queue length, 0: off
+    int sndbuf; // SO_SNDBUF / SO_RCVBUF of accepted sockets, 0: kernel autotuning
+    int rcvbuf;
+    int busy_poll_us; // SO_BUSY_POLL, 0: off
+    int threads; // 0: sized from the CPU topology
+    int threads_per_cpu;
+    int coro_stack_kb; // per coroutine, a guard page comes on top
+    int coro_max; // coroutines alive per worker, beyond it new connections wait in the queue
+    int work_stealing; // idle workers take over processing queued on busy ones
+    int pin_threads;
+    int incoming_cpu; // hand connections to workers on the CPU that received their packets
+    int backlog;
+    int queue_depth; // per socket queue, connections beyond it are answered with 503
+    int max_queue_wait_ms; // shed while the oldest queued connection has waited longer than this
+    int io_timeout_ms; // idle keep-alive and stalled transfers
+    int max_conn_buffer; // bytes of a response copied aside for a slow reader before falling back to blocking
+    int max_request_kb; // headers plus a body read into the receive buffer (uploads stream past it)
+    int min_send_rate; // bytes per second, slower readers are dropped
+    int trace; // per-phase request timing, dumped on SIGUSR1
+    int trace_slow_us; // requests slower than this are also kept in a separate ring
+    int meta_ttl_ms; // how long stat() results are trusted, the watcher invalidates them sooner
+    int negative_ttl_ms; // same for paths that do not exist
+    const char *capture_path; // NULL: no traffic capture
+    int compress_threads;
+    int compress_offload_min; // bodies at least this large are gzipped off the I/O workers
+    const char *proxy_routes[CONFIG_MAX_PROXY_ROUTES]; // "PREFIX=UPSTREAM[,UPSTREAM...]", parsed by proxy_init()
+    int proxy_route_count;
+    int proxy_health_ms;
+    const char *upload_routes[CONFIG_MAX_UPLOAD_ROUTES]; // "PREFIX=DIR", parsed by upload_init()
+    int upload_route_count;
+    int upload_fsync; // enum upload_fsync
+    int max_upload_mb;
+    int upload_splice; // 0: through a user-space buffer instead, for comparison
+    int rate_limit; // requests per second per client, 0: off
+    int rate_burst; // bucket size, 0: one second's worth
+    int max_conns_per_ip; // 0: no limit
+    int rate_prefix4; // bits of the address that identify a client
+    int rate_prefix6;
+};
+
+extern struct config g_config;
+
+void config_parse(int argc, char **argv);
+
+#endif
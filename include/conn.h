@@ -0,0 +1,42 @@
+#ifndef H_CONN
+#define H_CONN
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "out_queue.h"
+#include "recv_buffer.h"
+
+// Per-connection state that outlives a worker's turn with the connection, from a slab and looked up
+// by descriptor. A connection is owned by exactly one party at a time: the worker that dequeued it, or
+// the poller thread while it is parked.
+struct conn {
+    uint32_t id; // unique for the life of the process (capture records)
+    int fd;
+    struct out_queue out;
+    struct recv_buffer *input; // a partial or pipelined request received before the connection was parked
+    int close_after;
+    uint64_t rate_key; // client, for its connection count (see ratelimit.h)
+    int secure; // accepted on a --tls-listen address, the handshake is due while tls is NULL
+    struct tls_conn *tls;
+    struct upload *upload; // request body being streamed to disk when the connection was parked
+
+    // parking (poller thread)
+    int writing;
+    long parked_at_ms;
+    long last_progress_ms;
+    long window_start_ms; // minimum send rate is checked per window
+    size_t window_bytes;
+    struct conn *prev, *next;
+};
+
+int conn_table_init(void);
+struct conn *conn_open(const int fd);
+struct conn *conn_get(const int fd);
+void conn_close(const int fd);
+void conn_save_input(struct conn *conn, const char *buf, const size_t len);
+struct recv_buffer *conn_take_input(struct conn *conn);
+int conn_park(const int fd, const int writing);
+int conn_poller_start(int (*on_readable)(const int fd));
+
+#endif
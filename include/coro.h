@@ -0,0 +1,25 @@
+#ifndef H_CORO
+#define H_CORO
+
+#include <stddef.h>
+
+// Stackful coroutines run by each worker on its own epoll loop. A coroutine is written in blocking
+// style; when a socket is not ready, coro_wait_fd() switches back to the loop, which resumes it once the
+// descriptor is (or the timeout passed). Stacks are --coro-stack KiB with a guard page below, and kept
+// in a per-worker pool. Only the owning worker switches to its coroutines; other workers may run code on
+// behalf of a suspended one with coro_locals_swap() (see worksteal.h).
+struct coro;
+
+int coro_thread_init(void);
+int coro_local(void *address, const size_t size);
+int coro_spawn(void (*fn)(void *), void *arg);
+int coro_live(void);
+int coro_watch(const int fd, void (*on_ready)(void *ctx), void *ctx, const int gated);
+void coro_run(int (*run_tasks)(void *ctx), void *ctx);
+int coro_wait_fd(const int fd, const short events, const int timeout_ms);
+struct coro *coro_self(void);
+void coro_suspend(void);
+void coro_resume(struct coro *coro);
+void coro_locals_swap(struct coro *coro);
+
+#endif
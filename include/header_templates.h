@@ -0,0 +1,18 @@
+#ifndef H_HEADER_TEMPLATES
+#define H_HEADER_TEMPLATES
+
+#include <stdint.h>
+
+#include "sized_str.h"
+
+#define SERVER_NAME "http-server"
+#define HEADER_NO_CONTENT_TYPE -1
+#define U64_DEC_MAX 20 // digits in UINT64_MAX
+
+int header_templates_init(void);
+struct sized_str header_template(const int status, const int content_type, const int gzip);
+struct sized_str header_date(void);
+struct sized_str header_allow(void);
+size_t u64_to_dec(char *restrict out, uint64_t value);
+
+#endif
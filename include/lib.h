@@ -1,15 +1,21 @@
 #ifndef H_LIB
 #define H_LIB
 
+#include <stddef.h>
+#include <sys/stat.h>
+
 #include "arena.h"
 #include "sized_str.h"
 
+extern const char filedir[];
+
 void error_exit(const char *err_msg);
 void print_to_log(const char *restrict fmt, ...);
+char stat_path(const struct sized_str path, struct stat *st_buf, struct arena *arena);
 char dir_or_file(const struct sized_str path, struct arena *arena);
 struct sized_str read_file(const struct sized_str path, struct arena *arena);
+int open_file(const struct sized_str path, size_t *size, struct arena *arena);
 struct sized_str validate_path(struct sized_str path, struct arena *arena);
-int gzip_compress(char *restrict out_buf, struct sized_str str);
 char *set_err_500(char *err_prefix, struct arena *arena);
 
 #endif
@@ -0,0 +1,16 @@
+#ifndef H_LISTENER
+#define H_LISTENER
+
+#include <sys/socket.h>
+
+// A listening socket from a --listen spec: `PORT` or `HOST:PORT` (IPv4), `[ADDR]:PORT` (IPv6, dual-stack
+// when ADDR is `::`), `unix:/path` or `unix:@name` (abstract namespace). Sockets are non-blocking.
+struct listener {
+    int fd;
+    int family;
+    const char *spec;
+};
+
+int listener_open(struct listener *listener, const char *spec);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef H_METACACHE
+#define H_METACACHE
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "arena.h"
+#include "sized_str.h"
+
+struct file_meta {
+    off_t size;
+    time_t mtime;
+    uint8_t content_type; // enum http_content_type, from the extension
+};
+
+// What stat() says about paths under the serve directory, so repeated lookups (directory redirects, HEAD,
+// bots probing paths that do not exist) skip the file system. Bounded: 64 shards of 64 slots, and a path
+// takes over the entry expiring first in its probe window. Found paths live --meta-ttl ms, missing ones
+// --negative-ttl ms, and a change seen by the watcher drops everything at once.
+int metacache_init(void);
+char metacache_stat(const struct sized_str path, struct file_meta *meta, struct arena *arena);
+void metacache_invalidate(void);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef H_OUT_QUEUE
+#define H_OUT_QUEUE
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OUT_QUEUE_MAX_CHUNKS 4 // a reply is headers and at most one body, and only one reply is queued at a time
+
+struct tls_conn;
+
+enum out_chunk_type { OUT_CHUNK_MEM, OUT_CHUNK_FILE };
+
+// MEM chunks are borrowed (valid only while the request is being processed) until made durable; a
+// borrowed chunk may name a file holding the same bytes, so it can become a FILE chunk instead of a copy
+struct out_chunk {
+    enum out_chunk_type type;
+    const char *ptr;
+    size_t len;
+    char *owned; // MEM: malloc'd copy, freed once sent
+    int fd; // FILE: owned descriptor; borrowed MEM: backing file or -1
+    off_t offset;
+};
+
+struct out_queue {
+    struct out_chunk chunks[OUT_QUEUE_MAX_CHUNKS];
+    int head, count;
+    size_t memory_used; // owned bytes, counted against the per-connection cap
+};
+
+int out_queue_push_mem(struct out_queue *queue, const char *ptr, const size_t len, const int backing_fd, const off_t backing_offset);
+int out_queue_push_owned(struct out_queue *queue, char *ptr, const size_t len);
+int out_queue_push_file(struct out_queue *queue, const int fd, const off_t offset, const size_t len);
+int out_queue_flush(struct out_queue *queue, const int socket_fd, struct tls_conn *tls, size_t *bytes_sent);
+int out_queue_make_durable(struct out_queue *queue, const size_t memory_cap);
+void out_queue_clear(struct out_queue *queue);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef H_PROXY
+#define H_PROXY
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "sized_str.h"
+
+struct tls_conn;
+
+// Reverse proxy routes: a path prefix mounted on one or more upstreams (`host:port` or `unix:/path`,
+// `unix:@name` for an abstract socket). Each worker keeps its own pool of idle keep-alive connections
+// per upstream, so picking and returning one takes no lock.
+struct proxy_route;
+
+enum proxy_framing { PROXY_BODY_NONE, PROXY_BODY_LENGTH, PROXY_BODY_CHUNKED, PROXY_BODY_UNTIL_CLOSE };
+
+// one request sent upstream, whose response head has been read and whose body is still in the socket
+struct proxy_exchange {
+    int status;
+    struct sized_str head; // status line and headers as they go to the client (hop-by-hop ones dropped)
+    struct sized_str body_start; // body bytes that came in with the head
+    enum proxy_framing framing;
+    size_t remaining; // LENGTH: body bytes still to come after body_start
+    int keep_alive; // upstream connection can go back to the pool once the body is through
+    int upstream;
+    int fd;
+};
+
+int proxy_init(void);
+const struct proxy_route *proxy_route_for(const struct sized_str path);
+int proxy_request(const struct proxy_route *route, const struct sized_str req_head, const struct sized_str path,
+    const struct sized_str body, const int is_head, struct proxy_exchange *exchange, struct arena *arena);
+int proxy_relay(struct proxy_exchange *exchange, const int client_fd, struct tls_conn *tls);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef H_RATELIMIT
+#define H_RATELIMIT
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Per-client limits, a client being an IPv4 address or IPv6 prefix (--rate-prefix4/6): a token bucket for
+// requests (--rate-limit, --rate-burst) and a cap on open connections (--max-conns-per-ip). Clients live
+// in a fixed-size table, so memory stays bounded and the least recently seen client in a probe window
+// makes room for a new one. Key 0 (limits off, or not an IP client) passes every check.
+int ratelimit_init(void);
+uint64_t ratelimit_key(const struct sockaddr *addr);
+int ratelimit_conn_open(const uint64_t key);
+void ratelimit_conn_close(const uint64_t key);
+int ratelimit_allow(const uint64_t key);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef H_RCU
+#define H_RCU
+
+// Quiescent-state based reclamation: readers only mark when they hold shared pointers, writers swap
+// the pointer and wait out one grace period before freeing the old object.
+
+void rcu_register_thread(void);
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_synchronize(void);
+
+#endif
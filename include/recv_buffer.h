@@ -0,0 +1,23 @@
+#ifndef H_RECV_BUFFER
+#define H_RECV_BUFFER
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECV_BUFFER_SIZE 4096 // read from a socket at a time
+#define RECV_BUFFER_MAX (64 * 1024)
+
+// Receive buffers, pooled in size classes (256 B to 64 KiB) and only attached to a connection while it
+// has bytes not consumed yet, in the smallest class that holds them; an idle connection holds none.
+struct recv_buffer {
+    uint32_t cap;
+    uint32_t len; // unread bytes at the start of data
+    char data[];
+};
+
+int recv_buffer_init(void);
+struct recv_buffer *recv_buffer_fit(struct recv_buffer *buffer, const size_t size);
+void recv_buffer_put(struct recv_buffer **p_buffer);
+long recv_buffer_attached(size_t *bytes);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef H_SLAB
+#define H_SLAB
+
+#include <stddef.h>
+
+// Caches of fixed-size objects carved from large mappings, for state that is created and dropped at a
+// high rate by different threads (a connection is opened by the accept thread and closed by a worker or
+// the poller). Each thread keeps a small magazine of free objects per cache, so most allocations take
+// no lock; the magazines spill to and refill from a shared free list in batches. Memory stays in the
+// cache for reuse, pages are only touched once an object is first handed out.
+struct slab;
+
+struct slab *slab_new(const size_t object_size);
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *object);
+size_t slab_object_size(const struct slab *slab);
+long slab_in_use(const struct slab *slab);
+size_t slab_reserved(const struct slab *slab);
+
+#endif
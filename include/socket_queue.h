@@ -1,7 +1,13 @@
 #ifndef H_SOCKET_QUEUE
 #define H_SOCKET_QUEUE
 
-void enqueue(int socket_fd);
-int dequeue(void);
+struct socket_queue;
+
+struct socket_queue *socket_queue_new(const int capacity);
+void enqueue(struct socket_queue *queue, int socket_fd);
+int try_enqueue(struct socket_queue *queue, int socket_fd);
+int dequeue(struct socket_queue *queue);
+int socket_queue_fd(const struct socket_queue *queue);
+long socket_queue_wait_ms(struct socket_queue *queue);
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef H_TLS
+#define H_TLS
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// HTTPS on the --tls-listen addresses, through OpenSSL (built with `make TLS=1`). The handshake runs in
+// user space; once it is done the record layer moves into the kernel (kTLS) where it can, and the socket
+// then carries plaintext: sendfile(), splice() and MSG_MORE keep working as they do without TLS.
+// Otherwise records are encrypted and decrypted here, a record at a time.
+//
+// Every I/O call takes the connection's TLS state, NULL for a plain connection, and behaves like the
+// syscall it is named after on a non-blocking socket: -1 with EAGAIN when it would block.
+struct tls_conn;
+
+int tls_init(void);
+struct tls_conn *tls_conn_new(const int fd);
+int tls_handshake(struct tls_conn *tls);
+void tls_conn_free(struct tls_conn **p_tls);
+void tls_report(void);
+int tls_pending(const struct tls_conn *tls);
+int tls_kernel_send(const struct tls_conn *tls);
+int tls_kernel_recv(const struct tls_conn *tls);
+ssize_t tls_recv(struct tls_conn *tls, const int fd, void *buf, const size_t len, const int flags);
+ssize_t tls_send(struct tls_conn *tls, const int fd, const void *buf, const size_t len, const int flags);
+ssize_t tls_sendmsg(struct tls_conn *tls, const int fd, const struct msghdr *msg, const int flags);
+ssize_t tls_sendfile(struct tls_conn *tls, const int fd, const int file_fd, off_t *offset, const size_t len);
+int tls_flush(struct tls_conn *tls);
+
+#endif
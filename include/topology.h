@@ -0,0 +1,15 @@
+#ifndef H_TOPOLOGY
+#define H_TOPOLOGY
+
+#define TOPOLOGY_MAX_CPUS 1024
+
+struct cpu_topology {
+    int cpu_count; // online and allowed by our affinity mask
+    int cpus[TOPOLOGY_MAX_CPUS]; // usable CPU ids, grouped by NUMA node
+    int node_of[TOPOLOGY_MAX_CPUS]; // indexed by CPU id
+    int node_count;
+};
+
+int topology_read(struct cpu_topology *topology);
+
+#endif
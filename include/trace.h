@@ -0,0 +1,51 @@
+#ifndef H_TRACE
+#define H_TRACE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sized_str.h"
+
+// Per-phase request timing. Each worker writes its own ring of the most recent requests (and a second
+// one that only keeps requests slower than --trace-slow-us); SIGUSR1 dumps every ring as a Chrome trace
+// (chrome://tracing, Perfetto, speedscope).
+enum trace_phase {
+    TRACE_RECV,
+    TRACE_PARSE,
+    TRACE_ROUTE, // validate_path, dir_or_file, bundle lookup
+    TRACE_READ, // read_file, open_file
+    TRACE_COMPRESS,
+    TRACE_LOG,
+    TRACE_HEADERS,
+    TRACE_SEND,
+    TRACE_PHASE_COUNT
+};
+
+extern int g_trace_enabled;
+
+int trace_init(const char *dump_dir);
+void trace_register_thread(void);
+void *trace_current(size_t *size);
+void trace_begin_slow(void);
+void trace_mark_slow(const enum trace_phase phase);
+void trace_end_slow(const int method, const struct sized_str path, const int status, const size_t arena_bytes);
+
+// a single predictable branch when tracing is off
+static inline void trace_begin(void) {
+    if (g_trace_enabled)
+        trace_begin_slow();
+}
+
+// the time since the previous mark was spent in `phase`
+static inline void trace_mark(const enum trace_phase phase) {
+    if (g_trace_enabled)
+        trace_mark_slow(phase);
+}
+
+// `arena_bytes`: request memory still held when the reply goes out
+static inline void trace_end(const int method, const struct sized_str path, const int status, const size_t arena_bytes) {
+    if (g_trace_enabled)
+        trace_end_slow(method, path, status, arena_bytes);
+}
+
+#endif
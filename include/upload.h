@@ -0,0 +1,31 @@
+#ifndef H_UPLOAD
+#define H_UPLOAD
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "arena.h"
+#include "sized_str.h"
+
+struct tls_conn;
+
+// PUT/POST bodies under an --upload PREFIX=DIR route, streamed into a temporary file in the target's
+// directory and renamed over the target once complete. Body bytes go from the socket to the file through
+// a per-worker pipe with splice(), so they never pass through user space. When the socket runs dry
+// mid-body the upload is left on the connection, and the connection is parked until more arrives. Over
+// TLS the body is decrypted in user space and written out, unless the kernel decrypts it.
+struct upload_route;
+struct upload;
+
+int upload_init(void);
+const struct upload_route *upload_route_for(const struct sized_str path);
+struct upload *upload_begin(const struct upload_route *route, const struct sized_str path, const int method,
+    const size_t content_length, const int chunked, int *status, struct arena *arena);
+ssize_t upload_feed(struct upload *upload, const char *data, const size_t len);
+int upload_pump(struct upload *upload, const int socket_fd, struct tls_conn *tls);
+int upload_finish(struct upload **p_upload);
+void upload_abort(struct upload **p_upload);
+int upload_method(const struct upload *upload);
+struct sized_str upload_path(const struct upload *upload);
+
+#endif
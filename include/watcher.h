@@ -0,0 +1,16 @@
+#ifndef H_WATCHER
+#define H_WATCHER
+
+#include <stddef.h>
+
+#include "sized_str.h"
+
+// Called from the watcher thread with the deduplicated paths (relative to the watched directory, with a
+// leading `/`) that changed during one coalescing window. `paths == NULL` means events were lost and
+// anything under the directory may have changed.
+typedef void (*watcher_callback)(const struct sized_str *paths, size_t count, void *ctx);
+
+int watcher_watch(const char *dir, const int recursive, watcher_callback callback, void *ctx);
+int watcher_start(void);
+
+#endif
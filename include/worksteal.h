@@ -0,0 +1,15 @@
+#ifndef H_WORKSTEAL
+#define H_WORKSTEAL
+
+// Work stealing between workers. A coroutine cannot move (its stack and sockets stay with the worker that
+// accepted it), but the CPU-heavy stages of a request can: worksteal_run() queues a stage on the worker's
+// own Chase-Lev deque and suspends the coroutine. The worker runs its own stages newest first between
+// rounds of events; a worker with nothing to do takes the oldest ones from a busy worker's deque, runs them
+// with the coroutine's thread-locals, and hands the coroutine back to its owner to go on with the reply.
+// Workers pinned to the same CPU do not steal from each other.
+int worksteal_init(const int worker_count, const int cpu_count);
+int worksteal_register(const int cpu);
+int worksteal_run_tasks(void *ctx);
+void worksteal_run(void (*fn)(void *arg), void *arg);
+
+#endif
@@ -73,6 +73,54 @@ void arena_clear(struct arena *a) {
     return;
 }
 
+// Only the last block in use is rolled back exactly, blocks after it are emptied. Small allocations that
+// went to free space in earlier blocks after the save stay until arena_clear().
+struct arena_mark arena_save(struct arena *a) {
+    struct arena *last = a;
+
+    for (; a != NULL; a = a->next)
+        if (a->avail != ALIGNED_PTR(VOIDPTR_ADD(a, sizeof(struct arena))))
+            last = a;
+
+    return (struct arena_mark) { .block = last, .avail = last->avail };
+}
+
+void arena_restore(struct arena *a, const struct arena_mark mark) {
+    while (a != mark.block)
+        a = a->next;
+
+    a->avail = mark.avail;
+
+    for (a = a->next; a != NULL; a = a->next) // later blocks may have been started since
+        a->avail = ALIGNED_PTR(VOIDPTR_ADD(a, sizeof(struct arena)));
+
+    return;
+}
+
+size_t arena_used(const struct arena *a) {
+    size_t used = 0;
+
+    for (; a != NULL; a = a->next)
+        used += (char *) a->avail - (char *) ALIGNED_PTR(VOIDPTR_ADD(a, sizeof(struct arena)));
+
+    return used;
+}
+
+// frees the blocks past the first `keep` bytes, so one large request does not pin its memory in an arena
+// that is kept for reuse
+void arena_trim(struct arena *a, const size_t keep) {
+    size_t kept = (char *) a->limit - (char *) a;
+
+    while (a->next != NULL && kept + ((char *) a->next->limit - (char *) a->next) <= keep) {
+        a = a->next;
+        kept += (char *) a->limit - (char *) a;
+    }
+
+    arena_free(&a->next);
+
+    return;
+}
+
 void arena_free(struct arena **p_a) {
     struct arena *tracker = *p_a;
 
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+#include "../include/http_enums.h" // plain "http_enums.h" resolves to the internal header in lib/
+
+#define STALE_MIN_SLOTS 16
+
+struct bundle {
+    const char *base;
+    size_t size;
+    int fd; // kept open so slow readers can be handed a descriptor instead of a copy
+    int owns_mapping; // moves to the newest copy made by bundle_mark_stale(), along with the descriptor
+    const struct bundle_header *header;
+    const struct bundle_entry *entries;
+    const uint32_t *slots;
+    const uint32_t *seeds;
+    // paths changed on disk since the bundle was built (open addressing, empty slots have .ptr == NULL)
+    size_t stale_count;
+    size_t stale_mask;
+    struct sized_str *stale;
+};
+
+// FNV-1a, seeded, with the murmur3 finalizer to spread the low bits used for the modulo
+uint64_t bundle_hash(const struct sized_str key, const uint32_t seed) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+
+    for (size_t i = 0; i < key.len; i++) {
+        h ^= (unsigned char) key.ptr[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// written so that offsets near UINT64_MAX cannot wrap around
+static int private_in_range(const uint64_t offset, const uint64_t len, const uint64_t size) {
+    return offset <= size && len <= size - offset;
+}
+
+// every path and body must lie inside the file and every kind and content type be known, lookups and
+// replies trust them afterwards (the content type indexes the header templates)
+static int private_entries_valid(const struct bundle_header *header, const struct bundle_entry *entries) {
+    for (uint32_t i = 0; i < header->entry_count; i++)
+        if (!private_in_range(entries[i].path_offset, entries[i].path_len, header->size)
+            || !private_in_range(entries[i].body_offset, entries[i].body_len, header->size)
+            || !private_in_range(entries[i].gzip_offset, entries[i].gzip_len, header->size)
+            || (entries[i].kind != 'd' && entries[i].kind != 'f') || entries[i].content_type >= http_content_type_count)
+            return 0;
+
+    return 1;
+}
+
+struct bundle *bundle_open(const char *path) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st_buf;
+    if (fstat(fd, &st_buf) < 0 || st_buf.st_size < (off_t) sizeof(struct bundle_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *base = mmap(NULL, st_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    const struct bundle_header *header = base;
+
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof header->magic) || header->version != BUNDLE_VERSION
+        || header->size != (uint64_t) st_buf.st_size || !header->slot_count || !header->bucket_count
+        || !private_in_range(header->entries_offset, (uint64_t) header->entry_count * sizeof(struct bundle_entry), header->size)
+        || !private_in_range(header->slots_offset, (uint64_t) header->slot_count * sizeof(uint32_t), header->size)
+        || !private_in_range(header->seeds_offset, (uint64_t) header->bucket_count * sizeof(uint32_t), header->size)
+        || !private_entries_valid(header, (const struct bundle_entry *) ((const char *) base + header->entries_offset))) {
+        munmap(base, st_buf.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    struct bundle *bundle = malloc(sizeof *bundle);
+    if (!bundle) {
+        munmap(base, st_buf.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    *bundle = (struct bundle) {
+        .base = base,
+        .size = st_buf.st_size,
+        .fd = fd,
+        .owns_mapping = 1,
+        .header = header,
+        .entries = (const struct bundle_entry *) ((const char *) base + header->entries_offset),
+        .slots = (const uint32_t *) ((const char *) base + header->slots_offset),
+        .seeds = (const uint32_t *) ((const char *) base + header->seeds_offset)
+    };
+
+    return bundle;
+}
+
+void bundle_close(struct bundle **p_bundle) {
+    if (!*p_bundle)
+        return;
+
+    if ((*p_bundle)->owns_mapping) {
+        munmap((void *) (*p_bundle)->base, (*p_bundle)->size);
+        close((*p_bundle)->fd);
+    }
+
+    free(*p_bundle); // stale set lives in the same allocation
+    *p_bundle = NULL;
+
+    return;
+}
+
+uint32_t bundle_entry_count(const struct bundle *bundle) {
+    return bundle->header->entry_count;
+}
+
+// the bundle file itself, bodies sit at the offsets bundle_body() points into
+int bundle_fd(const struct bundle *bundle) {
+    return bundle->fd;
+}
+
+off_t bundle_offset(const struct bundle *bundle, const char *ptr) {
+    return ptr - bundle->base;
+}
+
+static const struct bundle_entry *private_bundle_find(const struct bundle *bundle, const struct sized_str key) {
+    const uint32_t bucket = bundle_hash(key, 0) % bundle->header->bucket_count;
+    const uint32_t slot = bundle_hash(key, bundle->seeds[bucket]) % bundle->header->slot_count;
+    const uint32_t index = bundle->slots[slot];
+
+    if (index >= bundle->header->entry_count)
+        return NULL;
+
+    const struct bundle_entry *entry = &bundle->entries[index];
+
+    if (entry->path_len != key.len || memcmp(bundle->base + entry->path_offset, key.ptr, key.len))
+        return NULL;
+
+    return entry;
+}
+
+// directories are stored without their trailing slash (except root), like stat() would resolve them
+const struct bundle_entry *bundle_lookup(const struct bundle *bundle, const struct sized_str path) {
+    const struct bundle_entry *entry = private_bundle_find(bundle, path);
+
+    if (!entry && path.len > 1 && path.ptr[path.len-1] == '/') {
+        entry = private_bundle_find(bundle, (struct sized_str) { .ptr = path.ptr, .len = path.len-1 });
+
+        if (entry && entry->kind != 'd')
+            return NULL;
+    }
+
+    return entry;
+}
+
+struct sized_str bundle_body(const struct bundle *bundle, const struct bundle_entry *entry, const int gzip) {
+    if (gzip && entry->gzip_len)
+        return (struct sized_str) { .ptr = (char *) bundle->base + entry->gzip_offset, .len = entry->gzip_len };
+
+    return (struct sized_str) { .ptr = (char *) bundle->base + entry->body_offset, .len = entry->body_len };
+}
+
+static int private_stale_contains(const struct bundle *bundle, const struct sized_str path) {
+    for (size_t i = bundle_hash(path, 0) & bundle->stale_mask; bundle->stale[i].ptr; i = (i + 1) & bundle->stale_mask)
+        if (bundle->stale[i].len == path.len && !memcmp(bundle->stale[i].ptr, path.ptr, path.len))
+            return 1;
+
+    return 0;
+}
+
+static void private_stale_insert(struct bundle *bundle, const struct sized_str path, char **p_storage) {
+    if (private_stale_contains(bundle, path))
+        return;
+
+    size_t i = bundle_hash(path, 0) & bundle->stale_mask;
+    while (bundle->stale[i].ptr)
+        i = (i + 1) & bundle->stale_mask;
+
+    memcpy(*p_storage, path.ptr, path.len);
+    bundle->stale[i] = (struct sized_str) { .ptr = *p_storage, .len = path.len };
+    *p_storage += path.len;
+    bundle->stale_count++;
+
+    return;
+}
+
+// Returns a copy of `bundle` whose stale set also holds `paths`; the copy takes over the mapping, so the
+// caller publishes it and frees the old one with bundle_close() after a grace period.
+struct bundle *bundle_mark_stale(struct bundle *bundle, const struct sized_str *paths, const size_t count) {
+    size_t slot_count = STALE_MIN_SLOTS, storage_len = 0;
+
+    while (slot_count < 2 * (bundle->stale_count + count))
+        slot_count *= 2;
+
+    for (size_t i = 0; i <= bundle->stale_mask && bundle->stale; i++)
+        storage_len += bundle->stale[i].len;
+    for (size_t i = 0; i < count; i++)
+        storage_len += paths[i].len;
+
+    struct bundle *new_bundle = malloc(sizeof *new_bundle + slot_count * sizeof *new_bundle->stale + storage_len);
+    if (!new_bundle)
+        return NULL;
+
+    *new_bundle = *bundle;
+    new_bundle->stale_count = 0;
+    new_bundle->stale_mask = slot_count - 1;
+    new_bundle->stale = (struct sized_str *) (new_bundle + 1);
+    memset(new_bundle->stale, 0, slot_count * sizeof *new_bundle->stale);
+
+    char *storage = (char *) (new_bundle->stale + slot_count);
+
+    for (size_t i = 0; i <= bundle->stale_mask && bundle->stale; i++)
+        if (bundle->stale[i].ptr)
+            private_stale_insert(new_bundle, bundle->stale[i], &storage);
+
+    for (size_t i = 0; i < count; i++)
+        if (paths[i].len)
+            private_stale_insert(new_bundle, paths[i], &storage);
+
+    bundle->owns_mapping = 0;
+
+    return new_bundle;
+}
+
+// a path is stale if it, or any directory above it, changed (covers removed and renamed directories)
+int bundle_is_stale(const struct bundle *bundle, struct sized_str path) {
+    if (!bundle->stale_count)
+        return 0;
+
+    if (path.len > 1 && path.ptr[path.len-1] == '/')
+        path.len--;
+
+    if (private_stale_contains(bundle, (struct sized_str) { .ptr = "/", .len = 1 }))
+        return 1;
+
+    for (size_t i = 1; i <= path.len; i++)
+        if ((i == path.len || path.ptr[i] == '/') && private_stale_contains(bundle, (struct sized_str) { .ptr = path.ptr, .len = i }))
+            return 1;
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "lib.h"
+
+#define CAPTURE_BUFFER_SIZE (4 << 20)
+#define CAPTURE_FLUSH_INTERVAL_MS 100
+
+// Workers append under a short lock into the active buffer; the writer thread swaps in the spare one
+// and does the file I/O without holding it. A full buffer drops records rather than stalling a worker.
+struct capture_buffer {
+    char *data;
+    size_t len;
+};
+
+int g_capture_enabled;
+
+static FILE *g_file;
+static struct timespec g_start;
+static struct capture_buffer g_buffers[2];
+static struct capture_buffer *g_active = &g_buffers[0];
+static unsigned long g_dropped;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_half_full = PTHREAD_COND_INITIALIZER;
+
+void capture_slow(const uint32_t conn_id, const enum capture_type type, const char *data, size_t len) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (len > CAPTURE_MAX_PAYLOAD)
+        len = CAPTURE_MAX_PAYLOAD;
+
+    const struct capture_record record = {
+        .time_ns = (now.tv_sec - g_start.tv_sec) * 1000000000LL + (now.tv_nsec - g_start.tv_nsec),
+        .conn_id = conn_id,
+        .type = type,
+        .len = len
+    };
+
+    pthread_mutex_lock(&g_lock);
+
+    if (g_active->len + sizeof record + len > CAPTURE_BUFFER_SIZE)
+        g_dropped++;
+    else {
+        memcpy(g_active->data + g_active->len, &record, sizeof record);
+        if (len)
+            memcpy(g_active->data + g_active->len + sizeof record, data, len);
+        g_active->len += sizeof record + len;
+
+        if (g_active->len > CAPTURE_BUFFER_SIZE / 2)
+            pthread_cond_signal(&g_half_full);
+    }
+
+    pthread_mutex_unlock(&g_lock);
+
+    return;
+}
+
+static void *writer_thread(void *args) {
+    unsigned long reported_drops = 0;
+
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CAPTURE_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&g_lock);
+
+        pthread_cond_timedwait(&g_half_full, &g_lock, &deadline);
+
+        struct capture_buffer *full = g_active;
+        g_active = full == &g_buffers[0] ? &g_buffers[1] : &g_buffers[0];
+        const unsigned long dropped = g_dropped;
+
+        pthread_mutex_unlock(&g_lock);
+
+        if (full->len && (fwrite(full->data, 1, full->len, g_file) != full->len || fflush(g_file)))
+            perror("\033[1;31merror:\033[0m capture write failed");
+        full->len = 0;
+
+        if (dropped != reported_drops) {
+            print_to_log("\033[1;31mcapture\033[0m writer behind, %lu record(s) dropped so far", dropped);
+            reported_drops = dropped;
+        }
+    }
+
+    return args;
+}
+
+int capture_init(const char *path) {
+    if (!(g_file = fopen(path, "wb")))
+        return -1;
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &g_start);
+
+    struct capture_header header = { .start_unix_ns = wall.tv_sec * 1000000000ULL + wall.tv_nsec };
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof header.magic);
+
+    if (fwrite(&header, sizeof header, 1, g_file) != 1 || fflush(g_file))
+        return -1;
+
+    for (int i = 0; i < 2; i++)
+        if (!(g_buffers[i].data = malloc(CAPTURE_BUFFER_SIZE)))
+            return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer_thread, NULL))
+        return -1;
+
+    pthread_detach(thread);
+
+    g_capture_enabled = 1;
+
+    return 0;
+}
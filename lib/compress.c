@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <zlib.h>
+
+#include "arena.h"
+#include "compress.h"
+#include "lib.h"
+
+#define COMPRESS_QUEUE_DEPTH 64
+#define STATS_REPORT_INTERVAL_S 10
+
+// One deflate stream per thread, kept for the life of the thread and rewound with deflateReset(). Its
+// ~270KB of state comes from a thread-local arena, once, instead of malloc on every call.
+static __thread z_stream t_stream;
+static __thread struct arena *t_zlib_arena;
+static __thread int t_stream_ready;
+
+static struct {
+    atomic_ulong streams;
+    atomic_ulong allocs;
+    atomic_ulong alloc_bytes;
+    atomic_ulong inline_count;
+    atomic_ulong offloaded_count;
+    atomic_ulong in_bytes;
+    atomic_ulong out_bytes;
+    atomic_ulong cpu_ns;
+    atomic_long last_report;
+} g_stats;
+
+static __thread int t_offload_thread;
+
+// bounded job queue for the compression pool
+static struct compress_job *g_jobs[COMPRESS_QUEUE_DEPTH];
+static int g_job_head, g_job_count;
+static int g_pool_started;
+static pthread_mutex_t g_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_jobs_ready = PTHREAD_COND_INITIALIZER;
+
+static voidpf private_zalloc(voidpf opaque, uInt items, uInt size) {
+    (void) opaque;
+
+    atomic_fetch_add_explicit(&g_stats.allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.alloc_bytes, (unsigned long) items * size, memory_order_relaxed);
+
+    return arena_alloc(t_zlib_arena, (size_t) items * size);
+}
+
+static void private_zfree(voidpf opaque, voidpf address) {
+    (void) opaque;
+    (void) address; // the stream is never ended, the arena goes with the thread
+
+    return;
+}
+
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// at most one line every STATS_REPORT_INTERVAL_S, from whichever thread compressed last
+static void private_report(void) {
+    const long now = time(NULL);
+    long last = atomic_load_explicit(&g_stats.last_report, memory_order_relaxed);
+
+    if (!last) {
+        atomic_compare_exchange_strong(&g_stats.last_report, &last, now);
+        return;
+    }
+
+    if (now - last < STATS_REPORT_INTERVAL_S || !atomic_compare_exchange_strong(&g_stats.last_report, &last, now))
+        return;
+
+    print_to_log("compression: %lu inline, %lu offloaded, %lu KB -> %lu KB, %.1f ms CPU; zlib: %lu stream(s), %lu allocations (%lu KB)",
+        atomic_load(&g_stats.inline_count), atomic_load(&g_stats.offloaded_count),
+        atomic_load(&g_stats.in_bytes) / 1024, atomic_load(&g_stats.out_bytes) / 1024, atomic_load(&g_stats.cpu_ns) / 1e6,
+        atomic_load(&g_stats.streams), atomic_load(&g_stats.allocs), atomic_load(&g_stats.alloc_bytes) / 1024);
+
+    return;
+}
+
+// returns the gzip length; a result equal to str.len means it did not fit (not worth sending compressed)
+int gzip_compress(char *restrict out_buf, struct sized_str str) {
+    const uint64_t cpu_start = thread_cpu_ns();
+
+    if (!t_stream_ready) {
+        if (!t_zlib_arena && !(t_zlib_arena = arena_new()))
+            return str.len;
+
+        t_stream = (z_stream) { .zalloc = private_zalloc, .zfree = private_zfree, .opaque = Z_NULL };
+
+        if (deflateInit2(&t_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return str.len;
+
+        t_stream_ready = 1;
+        atomic_fetch_add_explicit(&g_stats.streams, 1, memory_order_relaxed);
+    } else
+        deflateReset(&t_stream);
+
+    t_stream.next_in = (Bytef *) str.ptr;
+    t_stream.avail_in = str.len;
+    t_stream.next_out = (Bytef *) out_buf;
+    t_stream.avail_out = str.len;
+
+    const int status = deflate(&t_stream, Z_FINISH);
+    const int out_len = status == Z_STREAM_END ? (int) t_stream.total_out : (int) str.len;
+
+    atomic_fetch_add_explicit(t_offload_thread ? &g_stats.offloaded_count : &g_stats.inline_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.in_bytes, str.len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.out_bytes, out_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.cpu_ns, thread_cpu_ns() - cpu_start, memory_order_relaxed);
+
+    private_report();
+
+    return out_len;
+}
+
+static void *compress_thread(void *args) {
+    t_offload_thread = 1;
+
+    while (1) {
+        pthread_mutex_lock(&g_jobs_lock);
+
+        while (!g_job_count)
+            pthread_cond_wait(&g_jobs_ready, &g_jobs_lock);
+
+        struct compress_job *job = g_jobs[g_job_head];
+        g_job_head = (g_job_head + 1) % COMPRESS_QUEUE_DEPTH;
+        g_job_count--;
+
+        pthread_mutex_unlock(&g_jobs_lock);
+
+        job->out.len = gzip_compress(job->out.ptr, job->in);
+        job->compressed = job->out.len < job->in.len;
+        job->done(job);
+    }
+
+    return args;
+}
+
+int compress_pool_start(const int thread_count) {
+    for (int i = 0; i < thread_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, compress_thread, NULL))
+            return -1;
+
+        pthread_detach(thread);
+    }
+
+    g_pool_started = 1;
+
+    return 0;
+}
+
+// -1 when the pool is not running or already has COMPRESS_QUEUE_DEPTH jobs waiting (compress inline then)
+int compress_submit(struct compress_job *job) {
+    if (!g_pool_started)
+        return -1;
+
+    pthread_mutex_lock(&g_jobs_lock);
+
+    if (g_job_count == COMPRESS_QUEUE_DEPTH) {
+        pthread_mutex_unlock(&g_jobs_lock);
+        return -1;
+    }
+
+    g_jobs[(g_job_head + g_job_count++) % COMPRESS_QUEUE_DEPTH] = job;
+    pthread_cond_signal(&g_jobs_ready);
+
+    pthread_mutex_unlock(&g_jobs_lock);
+
+    return 0;
+}
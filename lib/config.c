@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/socket.h>
+
+#include "config.h"
+
+#define DEFAULT_THREADS_PER_CPU 1 // connections are coroutines, a worker only blocks on the disk
+#define DEFAULT_CORO_STACK_KB 64
+#define MIN_CORO_STACK_KB 32 // the proxy copies bodies through a 16 KiB stack buffer
+#define DEFAULT_CORO_MAX 1024
+#define DEFAULT_QUEUE_DEPTH 256
+#define DEFAULT_MAX_QUEUE_WAIT_MS 500
+#define DEFAULT_IO_TIMEOUT_MS 10000
+#define DEFAULT_MAX_CONN_BUFFER (256 * 1024)
+#define DEFAULT_MAX_REQUEST_KB 16
+#define MAX_REQUEST_KB 64 // the largest receive buffer
+#define DEFAULT_MIN_SEND_RATE 1024
+#define DEFAULT_TRACE_SLOW_US 10000
+#define DEFAULT_COMPRESS_THREADS 2
+#define DEFAULT_COMPRESS_OFFLOAD_MIN (256 * 1024)
+#define DEFAULT_PROXY_HEALTH_MS 2000
+#define DEFAULT_MAX_UPLOAD_MB 1024
+#define DEFAULT_RATE_PREFIX4 32
+#define DEFAULT_RATE_PREFIX6 64
+#define DEFAULT_DEFER_ACCEPT_S 5
+#define DEFAULT_META_TTL_MS 10000
+#define DEFAULT_NEGATIVE_TTL_MS 1000
+
+struct config g_config = {
+    .listen_count = 0,
+    .tls_cert = NULL,
+    .tls_key = NULL,
+    .ktls = 1,
+    .unix_mode = -1,
+    .unix_group = NULL,
+    .tcp_nodelay = 1,
+    .tcp_cork = 1,
+    .defer_accept_s = DEFAULT_DEFER_ACCEPT_S,
+    .fastopen_qlen = 0,
+    .sndbuf = 0,
+    .rcvbuf = 0,
+    .busy_poll_us = 0,
+    .threads = 0,
+    .threads_per_cpu = DEFAULT_THREADS_PER_CPU,
+    .coro_stack_kb = DEFAULT_CORO_STACK_KB,
+    .coro_max = DEFAULT_CORO_MAX,
+    .work_stealing = 1,
+    .pin_threads = 1,
+    .incoming_cpu = 0,
+    .backlog = SOMAXCONN,
+    .queue_depth = DEFAULT_QUEUE_DEPTH,
+    .max_queue_wait_ms = DEFAULT_MAX_QUEUE_WAIT_MS,
+    .io_timeout_ms = DEFAULT_IO_TIMEOUT_MS,
+    .max_conn_buffer = DEFAULT_MAX_CONN_BUFFER,
+    .max_request_kb = DEFAULT_MAX_REQUEST_KB,
+    .min_send_rate = DEFAULT_MIN_SEND_RATE,
+    .trace = 0,
+    .trace_slow_us = DEFAULT_TRACE_SLOW_US,
+    .meta_ttl_ms = DEFAULT_META_TTL_MS,
+    .negative_ttl_ms = DEFAULT_NEGATIVE_TTL_MS,
+    .capture_path = NULL,
+    .compress_threads = DEFAULT_COMPRESS_THREADS,
+    .compress_offload_min = DEFAULT_COMPRESS_OFFLOAD_MIN,
+    .proxy_route_count = 0,
+    .proxy_health_ms = DEFAULT_PROXY_HEALTH_MS,
+    .upload_route_count = 0,
+    .upload_fsync = UPLOAD_FSYNC_FILE,
+    .max_upload_mb = DEFAULT_MAX_UPLOAD_MB,
+    .upload_splice = 1,
+    .rate_limit = 0,
+    .rate_burst = 0,
+    .max_conns_per_ip = 0,
+    .rate_prefix4 = DEFAULT_RATE_PREFIX4,
+    .rate_prefix6 = DEFAULT_RATE_PREFIX6
+};
+
+static void print_usage(const char *prog) {
+    printf("usage: %s [options]\n"
+        "  --listen ADDR         PORT, HOST:PORT, [IPV6]:PORT ([::] is dual-stack), unix:/path or unix:@abstract;\n"
+        "                        repeatable (default: port 80 on every IPv4 address)\n"
+        "  --tls-listen ADDR     same, for HTTPS (repeatable, needs a build with `make TLS=1`)\n"
+        "  --tls-cert FILE       PEM certificate chain for the TLS listeners\n"
+        "  --tls-key FILE        PEM private key for the TLS listeners\n"
+        "  --no-ktls             keep TLS records in user space instead of handing them to the kernel\n"
+        "  --unix-mode MODE      octal permissions of Unix socket files (default: from the umask)\n"
+        "  --unix-group NAME     group owning Unix socket files\n"
+        "  --no-nodelay          leave Nagle's algorithm on for client sockets\n"
+        "  --no-cork             send response headers without MSG_MORE when a file body follows\n"
+        "  --defer-accept S      wake the accept thread only once a request arrived, up to S seconds (default %d)\n"
+        "  --no-defer-accept     accept connections as soon as the handshake completes\n"
+        "  --fastopen N          TCP Fast Open with N pending requests (needs net.ipv4.tcp_fastopen & 2, default off)\n"
+        "  --sndbuf N            SO_SNDBUF of client sockets (default: kernel autotuning)\n"
+        "  --rcvbuf N            SO_RCVBUF of client sockets (default: kernel autotuning)\n"
+        "  --busy-poll US        SO_BUSY_POLL on client sockets, trading CPU for latency (default off)\n"
+        "  --threads N           worker count (default: threads-per-cpu x usable CPUs)\n"
+        "  --threads-per-cpu N   workers per usable CPU when --threads is not given (default %d)\n"
+        "  --coro-stack KB       stack size of each connection's coroutine, at least %d (default %d)\n"
+        "  --coro-max N          connections in progress per worker, more wait in the queue (default %d)\n"
+        "  --no-steal            keep each request's processing on the worker that read it\n"
+        "  --no-pin              let the scheduler move workers between CPUs\n"
+        "  --incoming-cpu        hand each connection to a worker on the CPU that received it (SO_INCOMING_CPU)\n"
+        "  --backlog N           listen() backlog, capped by net.core.somaxconn (default %d)\n"
+        "  --queue-depth N       accepted connections waiting for a worker before shedding with 503 (default %d)\n"
+        "  --max-queue-wait MS   shed with 503 while a queued connection has waited longer than this (default %d)\n"
+        "  --timeout MS          drop idle or stalled connections after this (default %d)\n"
+        "  --max-conn-buffer N   response bytes buffered per connection for a slow reader (default %d)\n"
+        "  --max-request-kb KB   largest request headers and buffered body, at most %d (default %d)\n"
+        "  --min-send-rate N     drop readers slower than this many bytes per second (default %d)\n"
+        "  --trace               time each request phase, SIGUSR1 writes a Chrome trace to build/\n"
+        "  --trace-slow-us N     also keep requests slower than this in a separate ring (default %d)\n"
+        "  --meta-ttl MS         cache file metadata for this long (default %d)\n"
+        "  --negative-ttl MS     cache missing paths for this long (default %d)\n"
+        "  --capture FILE        record incoming request bytes for bin/replay\n"
+        "  --compress-threads N  threads gzipping large bodies off the I/O workers (default %d)\n"
+        "  --compress-offload N  bodies of at least this many bytes go to those threads (default %d)\n"
+        "  --proxy PREFIX=UP[,UP...]  forward requests under PREFIX to upstreams host:port or unix:/path (repeatable)\n"
+        "  --proxy-health-ms MS  interval between upstream health checks (default %d)\n"
+        "  --upload PREFIX=DIR   store PUT/POST bodies under PREFIX as files in DIR (repeatable)\n"
+        "  --upload-fsync MODE   none, file (before the rename) or full (file and directory) (default file)\n"
+        "  --max-upload-mb N     largest accepted upload (default %d)\n"
+        "  --no-upload-splice    stream uploads through a user-space buffer instead of splice()\n"
+        "  --rate-limit N        requests per second per client, beyond it answer 429 and close (default off)\n"
+        "  --rate-burst N        requests a client may send at once (default: --rate-limit)\n"
+        "  --max-conns-per-ip N  refuse a client's connections beyond this many at accept (default off)\n"
+        "  --rate-prefix4 N      IPv4 prefix length that counts as one client (default %d)\n"
+        "  --rate-prefix6 N      IPv6 prefix length that counts as one client (default %d)\n"
+        "  --help                show this message\n",
+        prog, DEFAULT_DEFER_ACCEPT_S, DEFAULT_THREADS_PER_CPU, MIN_CORO_STACK_KB, DEFAULT_CORO_STACK_KB, DEFAULT_CORO_MAX, SOMAXCONN, DEFAULT_QUEUE_DEPTH, DEFAULT_MAX_QUEUE_WAIT_MS, DEFAULT_IO_TIMEOUT_MS,
+        DEFAULT_MAX_CONN_BUFFER, MAX_REQUEST_KB, DEFAULT_MAX_REQUEST_KB, DEFAULT_MIN_SEND_RATE, DEFAULT_TRACE_SLOW_US, DEFAULT_META_TTL_MS, DEFAULT_NEGATIVE_TTL_MS,
+        DEFAULT_COMPRESS_THREADS, DEFAULT_COMPRESS_OFFLOAD_MIN, DEFAULT_PROXY_HEALTH_MS, DEFAULT_MAX_UPLOAD_MB,
+        DEFAULT_RATE_PREFIX4, DEFAULT_RATE_PREFIX6
+    );
+
+    return;
+}
+
+static int parse_positive(const char *prog, const char *name, const char *arg) {
+    char *end;
+    const long value = strtol(arg, &end, 10);
+
+    if (*end || value <= 0 || value > 1 << 20) {
+        fprintf(stderr, "%s: invalid value for --%s: %s\n", prog, name, arg);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
+void config_parse(int argc, char **argv) {
+    enum {
+        OPT_LISTEN = 256, OPT_TLS_LISTEN, OPT_TLS_CERT, OPT_TLS_KEY, OPT_NO_KTLS, OPT_UNIX_MODE, OPT_UNIX_GROUP, OPT_NO_NODELAY, OPT_NO_CORK, OPT_DEFER_ACCEPT,
+        OPT_NO_DEFER_ACCEPT, OPT_FASTOPEN, OPT_SNDBUF, OPT_RCVBUF, OPT_BUSY_POLL,
+        OPT_THREADS, OPT_THREADS_PER_CPU, OPT_CORO_STACK, OPT_CORO_MAX, OPT_NO_STEAL, OPT_NO_PIN, OPT_INCOMING_CPU,
+        OPT_BACKLOG, OPT_QUEUE_DEPTH, OPT_MAX_QUEUE_WAIT, OPT_TIMEOUT,
+        OPT_MAX_CONN_BUFFER, OPT_MAX_REQUEST_KB, OPT_MIN_SEND_RATE, OPT_TRACE, OPT_TRACE_SLOW_US,
+        OPT_META_TTL, OPT_NEGATIVE_TTL,
+        OPT_CAPTURE, OPT_COMPRESS_THREADS, OPT_COMPRESS_OFFLOAD, OPT_PROXY, OPT_PROXY_HEALTH_MS,
+        OPT_UPLOAD, OPT_UPLOAD_FSYNC, OPT_MAX_UPLOAD_MB, OPT_NO_UPLOAD_SPLICE,
+        OPT_RATE_LIMIT, OPT_RATE_BURST, OPT_MAX_CONNS_PER_IP, OPT_RATE_PREFIX4, OPT_RATE_PREFIX6,
+        OPT_HELP
+    };
+
+    static const struct option options[] = {
+        { "listen", required_argument, NULL, OPT_LISTEN },
+        { "tls-listen", required_argument, NULL, OPT_TLS_LISTEN },
+        { "tls-cert", required_argument, NULL, OPT_TLS_CERT },
+        { "tls-key", required_argument, NULL, OPT_TLS_KEY },
+        { "no-ktls", no_argument, NULL, OPT_NO_KTLS },
+        { "unix-mode", required_argument, NULL, OPT_UNIX_MODE },
+        { "unix-group", required_argument, NULL, OPT_UNIX_GROUP },
+        { "no-nodelay", no_argument, NULL, OPT_NO_NODELAY },
+        { "no-cork", no_argument, NULL, OPT_NO_CORK },
+        { "defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT },
+        { "no-defer-accept", no_argument, NULL, OPT_NO_DEFER_ACCEPT },
+        { "fastopen", required_argument, NULL, OPT_FASTOPEN },
+        { "sndbuf", required_argument, NULL, OPT_SNDBUF },
+        { "rcvbuf", required_argument, NULL, OPT_RCVBUF },
+        { "busy-poll", required_argument, NULL, OPT_BUSY_POLL },
+        { "threads", required_argument, NULL, OPT_THREADS },
+        { "threads-per-cpu", required_argument, NULL, OPT_THREADS_PER_CPU },
+        { "coro-stack", required_argument, NULL, OPT_CORO_STACK },
+        { "coro-max", required_argument, NULL, OPT_CORO_MAX },
+        { "no-steal", no_argument, NULL, OPT_NO_STEAL },
+        { "no-pin", no_argument, NULL, OPT_NO_PIN },
+        { "incoming-cpu", no_argument, NULL, OPT_INCOMING_CPU },
+        { "backlog", required_argument, NULL, OPT_BACKLOG },
+        { "queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH },
+        { "max-queue-wait", required_argument, NULL, OPT_MAX_QUEUE_WAIT },
+        { "timeout", required_argument, NULL, OPT_TIMEOUT },
+        { "max-conn-buffer", required_argument, NULL, OPT_MAX_CONN_BUFFER },
+        { "max-request-kb", required_argument, NULL, OPT_MAX_REQUEST_KB },
+        { "min-send-rate", required_argument, NULL, OPT_MIN_SEND_RATE },
+        { "trace", no_argument, NULL, OPT_TRACE },
+        { "trace-slow-us", required_argument, NULL, OPT_TRACE_SLOW_US },
+        { "meta-ttl", required_argument, NULL, OPT_META_TTL },
+        { "negative-ttl", required_argument, NULL, OPT_NEGATIVE_TTL },
+        { "capture", required_argument, NULL, OPT_CAPTURE },
+        { "compress-threads", required_argument, NULL, OPT_COMPRESS_THREADS },
+        { "compress-offload", required_argument, NULL, OPT_COMPRESS_OFFLOAD },
+        { "proxy", required_argument, NULL, OPT_PROXY },
+        { "proxy-health-ms", required_argument, NULL, OPT_PROXY_HEALTH_MS },
+        { "upload", required_argument, NULL, OPT_UPLOAD },
+        { "upload-fsync", required_argument, NULL, OPT_UPLOAD_FSYNC },
+        { "max-upload-mb", required_argument, NULL, OPT_MAX_UPLOAD_MB },
+        { "no-upload-splice", no_argument, NULL, OPT_NO_UPLOAD_SPLICE },
+        { "rate-limit", required_argument, NULL, OPT_RATE_LIMIT },
+        { "rate-burst", required_argument, NULL, OPT_RATE_BURST },
+        { "max-conns-per-ip", required_argument, NULL, OPT_MAX_CONNS_PER_IP },
+        { "rate-prefix4", required_argument, NULL, OPT_RATE_PREFIX4 },
+        { "rate-prefix6", required_argument, NULL, OPT_RATE_PREFIX6 },
+        { "help", no_argument, NULL, OPT_HELP },
+        { 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_LISTEN:
+            case OPT_TLS_LISTEN:
+                if (g_config.listen_count == CONFIG_MAX_LISTENERS) {
+                    fprintf(stderr, "%s: at most %d --listen and --tls-listen addresses\n", argv[0], CONFIG_MAX_LISTENERS);
+                    exit(EXIT_FAILURE);
+                }
+                g_config.listen_tls[g_config.listen_count] = opt == OPT_TLS_LISTEN;
+                g_config.listen_specs[g_config.listen_count++] = optarg;
+                break;
+            case OPT_TLS_CERT:
+                g_config.tls_cert = optarg;
+                break;
+            case OPT_TLS_KEY:
+                g_config.tls_key = optarg;
+                break;
+            case OPT_NO_KTLS:
+                g_config.ktls = 0;
+                break;
+            case OPT_UNIX_MODE: {
+                char *end;
+                g_config.unix_mode = strtol(optarg, &end, 8);
+                if (*end || g_config.unix_mode < 0 || g_config.unix_mode > 0777) {
+                    fprintf(stderr, "%s: invalid value for --unix-mode: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case OPT_UNIX_GROUP:
+                g_config.unix_group = optarg;
+                break;
+            case OPT_NO_NODELAY:
+                g_config.tcp_nodelay = 0;
+                break;
+            case OPT_NO_CORK:
+                g_config.tcp_cork = 0;
+                break;
+            case OPT_DEFER_ACCEPT:
+                g_config.defer_accept_s = parse_positive(argv[0], "defer-accept", optarg);
+                break;
+            case OPT_NO_DEFER_ACCEPT:
+                g_config.defer_accept_s = 0;
+                break;
+            case OPT_FASTOPEN:
+                g_config.fastopen_qlen = parse_positive(argv[0], "fastopen", optarg);
+                break;
+            case OPT_SNDBUF:
+                g_config.sndbuf = parse_positive(argv[0], "sndbuf", optarg);
+                break;
+            case OPT_RCVBUF:
+                g_config.rcvbuf = parse_positive(argv[0], "rcvbuf", optarg);
+                break;
+            case OPT_BUSY_POLL:
+                g_config.busy_poll_us = parse_positive(argv[0], "busy-poll", optarg);
+                break;
+            case OPT_THREADS:
+                g_config.threads = parse_positive(argv[0], "threads", optarg);
+                break;
+            case OPT_THREADS_PER_CPU:
+                g_config.threads_per_cpu = parse_positive(argv[0], "threads-per-cpu", optarg);
+                break;
+            case OPT_CORO_STACK:
+                g_config.coro_stack_kb = parse_positive(argv[0], "coro-stack", optarg);
+                if (g_config.coro_stack_kb < MIN_CORO_STACK_KB) {
+                    fprintf(stderr, "%s: --coro-stack must be at least %d\n", argv[0], MIN_CORO_STACK_KB);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_CORO_MAX:
+                g_config.coro_max = parse_positive(argv[0], "coro-max", optarg);
+                break;
+            case OPT_NO_STEAL:
+                g_config.work_stealing = 0;
+                break;
+            case OPT_NO_PIN:
+                g_config.pin_threads = 0;
+                break;
+            case OPT_INCOMING_CPU:
+                g_config.incoming_cpu = 1;
+                break;
+            case OPT_BACKLOG:
+                g_config.backlog = parse_positive(argv[0], "backlog", optarg);
+                break;
+            case OPT_QUEUE_DEPTH:
+                g_config.queue_depth = parse_positive(argv[0], "queue-depth", optarg);
+                break;
+            case OPT_MAX_QUEUE_WAIT:
+                g_config.max_queue_wait_ms = parse_positive(argv[0], "max-queue-wait", optarg);
+                break;
+            case OPT_TIMEOUT:
+                g_config.io_timeout_ms = parse_positive(argv[0], "timeout", optarg);
+                break;
+            case OPT_MAX_CONN_BUFFER:
+                g_config.max_conn_buffer = parse_positive(argv[0], "max-conn-buffer", optarg);
+                break;
+            case OPT_MAX_REQUEST_KB:
+                g_config.max_request_kb = parse_positive(argv[0], "max-request-kb", optarg);
+                if (g_config.max_request_kb > MAX_REQUEST_KB) {
+                    fprintf(stderr, "%s: --max-request-kb must be at most %d\n", argv[0], MAX_REQUEST_KB);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MIN_SEND_RATE:
+                g_config.min_send_rate = parse_positive(argv[0], "min-send-rate", optarg);
+                break;
+            case OPT_TRACE:
+                g_config.trace = 1;
+                break;
+            case OPT_TRACE_SLOW_US:
+                g_config.trace_slow_us = parse_positive(argv[0], "trace-slow-us", optarg);
+                break;
+            case OPT_META_TTL:
+                g_config.meta_ttl_ms = parse_positive(argv[0], "meta-ttl", optarg);
+                break;
+            case OPT_NEGATIVE_TTL:
+                g_config.negative_ttl_ms = parse_positive(argv[0], "negative-ttl", optarg);
+                break;
+            case OPT_CAPTURE:
+                g_config.capture_path = optarg;
+                break;
+            case OPT_COMPRESS_THREADS:
+                g_config.compress_threads = parse_positive(argv[0], "compress-threads", optarg);
+                break;
+            case OPT_COMPRESS_OFFLOAD:
+                g_config.compress_offload_min = parse_positive(argv[0], "compress-offload", optarg);
+                break;
+            case OPT_PROXY:
+                if (g_config.proxy_route_count == CONFIG_MAX_PROXY_ROUTES) {
+                    fprintf(stderr, "%s: at most %d --proxy routes\n", argv[0], CONFIG_MAX_PROXY_ROUTES);
+                    exit(EXIT_FAILURE);
+                }
+                g_config.proxy_routes[g_config.proxy_route_count++] = optarg;
+                break;
+            case OPT_PROXY_HEALTH_MS:
+                g_config.proxy_health_ms = parse_positive(argv[0], "proxy-health-ms", optarg);
+                break;
+            case OPT_UPLOAD:
+                if (g_config.upload_route_count == CONFIG_MAX_UPLOAD_ROUTES) {
+                    fprintf(stderr, "%s: at most %d --upload routes\n", argv[0], CONFIG_MAX_UPLOAD_ROUTES);
+                    exit(EXIT_FAILURE);
+                }
+                g_config.upload_routes[g_config.upload_route_count++] = optarg;
+                break;
+            case OPT_UPLOAD_FSYNC:
+                if (!strcmp(optarg, "none"))
+                    g_config.upload_fsync = UPLOAD_FSYNC_NONE;
+                else if (!strcmp(optarg, "file"))
+                    g_config.upload_fsync = UPLOAD_FSYNC_FILE;
+                else if (!strcmp(optarg, "full"))
+                    g_config.upload_fsync = UPLOAD_FSYNC_FULL;
+                else {
+                    fprintf(stderr, "%s: invalid value for --upload-fsync: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MAX_UPLOAD_MB:
+                g_config.max_upload_mb = parse_positive(argv[0], "max-upload-mb", optarg);
+                break;
+            case OPT_NO_UPLOAD_SPLICE:
+                g_config.upload_splice = 0;
+                break;
+            case OPT_RATE_LIMIT:
+                g_config.rate_limit = parse_positive(argv[0], "rate-limit", optarg);
+                break;
+            case OPT_RATE_BURST:
+                g_config.rate_burst = parse_positive(argv[0], "rate-burst", optarg);
+                break;
+            case OPT_MAX_CONNS_PER_IP:
+                g_config.max_conns_per_ip = parse_positive(argv[0], "max-conns-per-ip", optarg);
+                break;
+            case OPT_RATE_PREFIX4:
+                g_config.rate_prefix4 = parse_positive(argv[0], "rate-prefix4", optarg);
+                break;
+            case OPT_RATE_PREFIX6:
+                g_config.rate_prefix6 = parse_positive(argv[0], "rate-prefix6", optarg);
+                break;
+            case OPT_HELP:
+                print_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        fprintf(stderr, "%s: unexpected argument: %s\n", argv[0], argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    return;
+}
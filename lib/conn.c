@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "capture.h"
+#include "config.h"
+#include "conn.h"
+#include "lib.h"
+#include "ratelimit.h"
+#include "recv_buffer.h"
+#include "slab.h"
+#include "tls.h"
+#include "upload.h"
+
+#define CONN_TABLE_MAX (1 << 20)
+#define POLLER_BATCH 64
+#define SWEEP_INTERVAL_MS 1000
+#define RETRY_INTERVAL_MS 10 // hand-off to a full worker queue
+#define SEND_RATE_WINDOW_MS 5000
+#define MEMORY_REPORT_INTERVAL_MS 10000
+
+// by descriptor; the state itself comes from a slab, only for open connections
+static struct conn **g_conns;
+static struct slab *g_conn_slab;
+static int g_conn_count;
+
+static int g_epoll_fd = -1;
+static int (*g_on_readable)(const int fd);
+
+// parked connections, for the timeout sweep (workers insert, the poller thread removes)
+static struct conn g_parked = { .prev = &g_parked, .next = &g_parked };
+static pthread_mutex_t g_parked_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// connections the poller could not hand to a worker yet (poller thread only)
+static struct conn g_retry = { .prev = &g_retry, .next = &g_retry };
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void list_insert(struct conn *head, struct conn *conn) {
+    conn->next = head->next;
+    conn->prev = head;
+    head->next->prev = conn;
+    head->next = conn;
+
+    return;
+}
+
+static void list_remove(struct conn *conn) {
+    if (!conn->next)
+        return;
+
+    conn->prev->next = conn->next;
+    conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+
+    return;
+}
+
+static int conn_fd(const struct conn *conn) {
+    return conn->fd;
+}
+
+int conn_table_init(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+        return -1;
+
+    g_conn_count = limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > CONN_TABLE_MAX ? CONN_TABLE_MAX : (int) limit.rlim_cur;
+
+    // zeroed pages are only backed once a descriptor that high is actually used
+    if (!(g_conns = calloc(g_conn_count, sizeof *g_conns)) || !(g_conn_slab = slab_new(sizeof(struct conn))))
+        return -1;
+
+    return recv_buffer_init();
+}
+
+// NULL when the descriptor is beyond the table (accept thread only)
+struct conn *conn_open(const int fd) {
+    static uint32_t next_id;
+
+    if (fd < 0 || fd >= g_conn_count)
+        return NULL;
+
+    // still there when the previous connection on this descriptor was shed without a worker
+    struct conn *conn = g_conns[fd] ? g_conns[fd] : slab_alloc(g_conn_slab);
+
+    if (!conn)
+        return NULL;
+
+    *conn = (struct conn) { .id = ++next_id, .fd = fd };
+    g_conns[fd] = conn;
+
+    return conn;
+}
+
+struct conn *conn_get(const int fd) {
+    return g_conns[fd];
+}
+
+void conn_close(const int fd) {
+    struct conn *conn = g_conns[fd];
+
+    capture_close(conn->id);
+    ratelimit_conn_close(conn->rate_key);
+    upload_abort(&conn->upload);
+    out_queue_clear(&conn->out);
+    recv_buffer_put(&conn->input);
+    tls_conn_free(&conn->tls);
+    g_conns[fd] = NULL;
+    slab_free(g_conn_slab, conn);
+
+    if (shutdown(fd, SHUT_WR) < 0 && errno != ENOTCONN)
+        perror("\033[1;31merror:\033[0m shutdown() of socket failed");
+
+    close(fd);
+
+    return;
+}
+
+// copied into the smallest receive buffer that holds it, the worker's own goes back to the pool
+void conn_save_input(struct conn *conn, const char *buf, const size_t len) {
+    if (!len || !(conn->input = recv_buffer_fit(NULL, len)))
+        return;
+
+    memcpy(conn->input->data, buf, len);
+    conn->input->len = len;
+
+    return;
+}
+
+// NULL when nothing was left unread
+struct recv_buffer *conn_take_input(struct conn *conn) {
+    struct recv_buffer *input = conn->input;
+
+    conn->input = NULL;
+
+    return input;
+}
+
+static int private_arm(const int fd, const uint32_t events) {
+    struct epoll_event event = { .events = events | EPOLLONESHOT, .data.fd = fd };
+
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        if (errno != ENOENT || epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// `writing`: wait until buffered output can be drained, otherwise wait for the next request
+int conn_park(const int fd, const int writing) {
+    struct conn *conn = g_conns[fd];
+    const long now = now_ms();
+
+    conn->writing = writing;
+    conn->parked_at_ms = conn->last_progress_ms = conn->window_start_ms = now;
+    conn->window_bytes = 0;
+
+    pthread_mutex_lock(&g_parked_lock);
+    list_insert(&g_parked, conn); // before arming, the poller may pick it up right away
+    pthread_mutex_unlock(&g_parked_lock);
+
+    // bytes the TLS library decrypted already do not make the socket readable: come back right away
+    const uint32_t events = writing ? EPOLLOUT : tls_pending(conn->tls) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+
+    if (private_arm(fd, events) < 0) {
+        pthread_mutex_lock(&g_parked_lock);
+        list_remove(conn);
+        pthread_mutex_unlock(&g_parked_lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void private_hand_off(struct conn *conn) {
+    if (g_on_readable(conn_fd(conn)) < 0)
+        list_insert(&g_retry, conn);
+
+    return;
+}
+
+static void private_on_event(const int fd) {
+    struct conn *conn = g_conns[fd];
+
+    pthread_mutex_lock(&g_parked_lock);
+    list_remove(conn);
+    pthread_mutex_unlock(&g_parked_lock);
+
+    if (!conn->writing) {
+        private_hand_off(conn);
+        return;
+    }
+
+    size_t sent = 0;
+    const int status = out_queue_flush(&conn->out, fd, conn->tls, &sent);
+
+    if (status < 0 || (status && conn->close_after)) {
+        conn_close(fd);
+        return;
+    }
+
+    if (!status) { // still backed up, keep the send rate window running
+        const long now = now_ms();
+
+        conn->window_bytes += sent;
+        if (sent)
+            conn->last_progress_ms = now;
+
+        pthread_mutex_lock(&g_parked_lock);
+        list_insert(&g_parked, conn);
+        pthread_mutex_unlock(&g_parked_lock);
+
+        if (private_arm(fd, EPOLLOUT) < 0) {
+            pthread_mutex_lock(&g_parked_lock);
+            list_remove(conn);
+            pthread_mutex_unlock(&g_parked_lock);
+            conn_close(fd);
+        }
+
+        return;
+    }
+
+    if (conn->input) // a pipelined request is already waiting
+        private_hand_off(conn);
+    else if (conn_park(fd, 0) < 0)
+        conn_close(fd);
+
+    return;
+}
+
+// idle connections past the I/O timeout, and slow readers below the minimum send rate, are dropped
+static void private_sweep(void) {
+    const long now = now_ms();
+
+    pthread_mutex_lock(&g_parked_lock);
+
+    for (struct conn *conn = g_parked.next, *next; conn != &g_parked; conn = next) {
+        next = conn->next;
+
+        int drop = now - (conn->writing ? conn->last_progress_ms : conn->parked_at_ms) > g_config.io_timeout_ms;
+
+        if (!drop && conn->writing && now - conn->window_start_ms >= SEND_RATE_WINDOW_MS) {
+            drop = conn->window_bytes * 1000 < (size_t) g_config.min_send_rate * (now - conn->window_start_ms);
+            conn->window_start_ms = now;
+            conn->window_bytes = 0;
+        }
+
+        if (drop) {
+            const struct linger reset = { .l_onoff = 1, .l_linger = 0 }; // discard what is still queued for it
+
+            list_remove(conn);
+            setsockopt(conn_fd(conn), SOL_SOCKET, SO_LINGER, &reset, sizeof reset);
+            conn_close(conn_fd(conn)); // also removes it from the epoll set
+        }
+    }
+
+    pthread_mutex_unlock(&g_parked_lock);
+
+    return;
+}
+
+// what open connections cost in user space, when it changed: the state of each, and the receive
+// buffers held by connections parked with unread bytes or being read by a worker
+static void private_report(void) {
+    static long last_count = -1, last_buffers = -1;
+    size_t buffer_bytes;
+    const long count = slab_in_use(g_conn_slab), buffers = recv_buffer_attached(&buffer_bytes);
+
+    if (count == last_count && buffers == last_buffers)
+        return;
+
+    last_count = count;
+    last_buffers = buffers;
+
+    print_to_log("memory: %ld connection(s), %zu B of state each (%zu KiB mapped), %ld receive buffer(s) attached (%zu KiB)",
+        count, slab_object_size(g_conn_slab) + sizeof *g_conns, slab_reserved(g_conn_slab) / 1024, buffers, buffer_bytes / 1024);
+
+    return;
+}
+
+static void *poller_thread(void *args) {
+    (void) args;
+
+    struct epoll_event events[POLLER_BATCH];
+    long last_sweep = now_ms(), last_report = last_sweep;
+
+    while (1) {
+        const int timeout = g_retry.next != &g_retry ? RETRY_INTERVAL_MS : SWEEP_INTERVAL_MS;
+        const int event_count = epoll_wait(g_epoll_fd, events, POLLER_BATCH, timeout);
+
+        if (event_count < 0 && errno != EINTR) {
+            perror("\033[1;31merror:\033[0m epoll_wait() failed in poller");
+            continue;
+        }
+
+        for (int i = 0; i < event_count; i++)
+            private_on_event(events[i].data.fd);
+
+        for (struct conn *conn = g_retry.next, *next; conn != &g_retry; conn = next) {
+            next = conn->next;
+            list_remove(conn);
+            private_hand_off(conn);
+            if (conn->next) // still no room, try again next round
+                break;
+        }
+
+        if (now_ms() - last_sweep >= SWEEP_INTERVAL_MS) {
+            private_sweep();
+            last_sweep = now_ms();
+        }
+
+        if (last_sweep - last_report >= MEMORY_REPORT_INTERVAL_MS) {
+            private_report();
+            tls_report();
+            last_report = last_sweep;
+        }
+    }
+
+    return NULL;
+}
+
+// `on_readable` hands a parked connection back to a worker, -1 when it has no room right now
+int conn_poller_start(int (*on_readable)(const int fd)) {
+    g_on_readable = on_readable;
+
+    if ((g_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, poller_thread, NULL))
+        return -1;
+
+    pthread_detach(thread);
+
+    return 0;
+}
@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "config.h"
+#include "coro.h"
+
+#define CORO_POOL_KEEP 64 // idle stacks kept mapped per worker, the rest go back to the kernel
+#define CORO_MAX_LOCALS 4
+#define CORO_LOCALS_SIZE 256 // bytes of thread-local state carried by each coroutine
+#define CORO_EVENT_BATCH 64
+#define CORO_MAX_WATCHES 4
+
+struct coro {
+#if defined(__x86_64__)
+    void *sp; // while switched out, the callee-saved registers are on top of its stack
+#else
+    ucontext_t context;
+#endif
+    void (*fn)(void *);
+    void *arg;
+    char *mapping; // guard page, then the stack, with this struct at its very top
+    int fd; // waited on
+    int timer_index; // in the scheduler's heap, -1 when not waiting with a timeout
+    long deadline_ms;
+    int timed_out;
+    int done;
+    struct coro *next_free;
+    char locals[CORO_LOCALS_SIZE];
+};
+
+struct coro_local { void *address; size_t size; };
+
+struct coro_watch {
+    int fd;
+    void (*on_ready)(void *ctx);
+    void *ctx;
+    int gated; // only watched while the worker is below --coro-max
+    int watching;
+    int ready;
+};
+
+struct scheduler {
+    int epoll_fd;
+#if defined(__x86_64__)
+    void *sp;
+#else
+    ucontext_t context;
+#endif
+    struct coro *current; // NULL while the loop itself runs
+    int live;
+    struct coro *free; // stack pool
+    int free_count;
+    size_t mapping_size;
+    struct coro **timers; // min-heap on deadline_ms, at most one entry per live coroutine
+    int timer_count;
+    struct coro_local locals[CORO_MAX_LOCALS];
+    int local_count;
+    size_t locals_size;
+    struct coro_watch watches[CORO_MAX_WATCHES]; // epoll data: index + 1, never a coroutine's address
+    int watch_count;
+};
+
+static __thread struct scheduler *t_sched;
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#if defined(__x86_64__)
+// Pushes the callee-saved registers, stores the stack pointer in *from, loads `to` and pops the registers
+// saved there; `ret` then continues wherever that stack last switched out. Everything else is
+// caller-saved under the System V ABI, so this is the whole switch: no signal mask, no FPU state.
+void coro_switch(void **from, void *to);
+
+__asm__(
+    ".pushsection .text\n"
+    ".globl coro_switch\n"
+    ".hidden coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch, .-coro_switch\n"
+    ".popsection\n"
+);
+#endif
+
+static void private_switch_in(struct coro *coro) {
+#if defined(__x86_64__)
+    coro_switch(&t_sched->sp, coro->sp);
+#else
+    swapcontext(&t_sched->context, &coro->context);
+#endif
+
+    return;
+}
+
+static void private_switch_out(struct coro *coro) {
+#if defined(__x86_64__)
+    coro_switch(&coro->sp, t_sched->sp);
+#else
+    swapcontext(&coro->context, &t_sched->context);
+#endif
+
+    return;
+}
+
+// first code on a fresh stack; never returns, the loop releases the stack once it has switched away
+static void coro_main(void) {
+    struct coro *coro = t_sched->current;
+
+    for (int i = 0; i < t_sched->local_count; i++) // coroutine-local state starts out zeroed, as in a new thread
+        memset(t_sched->locals[i].address, 0, t_sched->locals[i].size);
+
+    coro->fn(coro->arg);
+    coro->done = 1;
+    private_switch_out(coro);
+
+    __builtin_unreachable();
+}
+
+static void private_prepare(struct coro *coro) {
+#if defined(__x86_64__)
+    // laid out as if coro_switch() had been called from just before coro_main(): six zeroed registers,
+    // then coro_main as the return address; rsp ends up 8 off 16-byte alignment, like after a call
+    void **sp = (void **) (((uintptr_t) coro & ~(uintptr_t) 15) - 8 * sizeof (void *));
+
+    memset(sp, 0, 8 * sizeof (void *));
+    sp[6] = (void *) coro_main; // sp[7] is its return address, 0: returning would fault
+    coro->sp = sp;
+#else
+    char *stack = coro->mapping + sysconf(_SC_PAGESIZE);
+
+    getcontext(&coro->context);
+    coro->context.uc_stack.ss_sp = stack;
+    coro->context.uc_stack.ss_size = ((uintptr_t) coro & ~(uintptr_t) 15) - (uintptr_t) stack;
+    coro->context.uc_link = NULL;
+    makecontext(&coro->context, coro_main, 0);
+#endif
+
+    return;
+}
+
+static struct coro *private_alloc(void) {
+    struct coro *coro = t_sched->free;
+
+    if (coro) {
+        t_sched->free = coro->next_free;
+        t_sched->free_count--;
+        return coro;
+    }
+
+    // pages are only backed once touched, a request rarely gets past the first few
+    char *mapping = mmap(NULL, t_sched->mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    if (mprotect(mapping, sysconf(_SC_PAGESIZE), PROT_NONE) < 0) { // an overflow faults instead of corrupting the next stack
+        munmap(mapping, t_sched->mapping_size);
+        return NULL;
+    }
+
+    coro = (struct coro *) (((uintptr_t) mapping + t_sched->mapping_size - sizeof *coro) & ~(uintptr_t) 63);
+    coro->mapping = mapping;
+
+    return coro;
+}
+
+static void private_release(struct coro *coro) {
+    if (t_sched->free_count == CORO_POOL_KEEP) {
+        munmap(coro->mapping, t_sched->mapping_size);
+        return;
+    }
+
+    coro->next_free = t_sched->free;
+    t_sched->free = coro;
+    t_sched->free_count++;
+
+    return;
+}
+
+static void private_resume(struct coro *coro) {
+    t_sched->current = coro;
+    private_switch_in(coro);
+    t_sched->current = NULL;
+
+    if (coro->done) {
+        t_sched->live--;
+        private_release(coro);
+    }
+
+    return;
+}
+
+static void private_timer_swap(const int a, const int b) {
+    struct coro *coro = t_sched->timers[a];
+
+    t_sched->timers[a] = t_sched->timers[b];
+    t_sched->timers[b] = coro;
+    t_sched->timers[a]->timer_index = a;
+    t_sched->timers[b]->timer_index = b;
+
+    return;
+}
+
+static void private_timer_sift(int index) {
+    struct coro **timers = t_sched->timers;
+
+    while (index && timers[index]->deadline_ms < timers[(index-1) / 2]->deadline_ms) {
+        private_timer_swap(index, (index-1) / 2);
+        index = (index-1) / 2;
+    }
+
+    while (1) {
+        const int left = 2*index + 1, right = left + 1;
+        int smallest = index;
+
+        if (left < t_sched->timer_count && timers[left]->deadline_ms < timers[smallest]->deadline_ms)
+            smallest = left;
+        if (right < t_sched->timer_count && timers[right]->deadline_ms < timers[smallest]->deadline_ms)
+            smallest = right;
+        if (smallest == index)
+            break;
+
+        private_timer_swap(index, smallest);
+        index = smallest;
+    }
+
+    return;
+}
+
+static void private_timer_add(struct coro *coro) {
+    coro->timer_index = t_sched->timer_count++;
+    t_sched->timers[coro->timer_index] = coro;
+    private_timer_sift(coro->timer_index);
+
+    return;
+}
+
+static void private_timer_remove(struct coro *coro) {
+    const int index = coro->timer_index;
+
+    if (index < 0)
+        return;
+
+    coro->timer_index = -1;
+
+    if (index == --t_sched->timer_count)
+        return;
+
+    t_sched->timers[index] = t_sched->timers[t_sched->timer_count];
+    t_sched->timers[index]->timer_index = index;
+    private_timer_sift(index);
+
+    return;
+}
+
+int coro_thread_init(void) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t stack_size = ((size_t) g_config.coro_stack_kb * 1024 + page - 1) & ~(page - 1);
+
+    if (!(t_sched = calloc(1, sizeof *t_sched)) || !(t_sched->timers = calloc(g_config.coro_max, sizeof *t_sched->timers)))
+        return -1;
+
+    t_sched->mapping_size = page + stack_size;
+
+    if ((t_sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+
+    return 0;
+}
+
+// `size` bytes at `address` (a thread-local of this worker) are switched with each coroutine, so
+// per-request state kept in thread-locals stays with the request across waits
+int coro_local(void *address, const size_t size) {
+    if (t_sched->local_count == CORO_MAX_LOCALS || t_sched->locals_size + size > CORO_LOCALS_SIZE) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    t_sched->locals[t_sched->local_count++] = (struct coro_local) { .address = address, .size = size };
+    t_sched->locals_size += size;
+
+    return 0;
+}
+
+// from the loop only (on_wake): starts `fn` right away and returns once it first waits or is done
+int coro_spawn(void (*fn)(void *), void *arg) {
+    struct coro *coro = private_alloc();
+
+    if (!coro)
+        return -1;
+
+    coro->fn = fn;
+    coro->arg = arg;
+    coro->timer_index = -1;
+    coro->done = 0;
+    private_prepare(coro);
+
+    t_sched->live++;
+    private_resume(coro);
+
+    return 0;
+}
+
+int coro_live(void) {
+    return t_sched->live;
+}
+
+// Calls `on_ready` from the loop whenever `fd` is readable. A `gated` descriptor (new work) is only
+// watched while fewer than --coro-max coroutines are alive, so other workers take it meanwhile. Several
+// workers may watch one descriptor, only one of them is woken per event.
+int coro_watch(const int fd, void (*on_ready)(void *ctx), void *ctx, const int gated) {
+    if (t_sched->watch_count == CORO_MAX_WATCHES) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    t_sched->watches[t_sched->watch_count++] = (struct coro_watch) { .fd = fd, .on_ready = on_ready, .ctx = ctx, .gated = gated };
+
+    return 0;
+}
+
+// The worker's loop, never returns. `run_tasks` (may be NULL) runs work queued outside of coroutines
+// between rounds of events, and returns nonzero while more is pending, so the loop does not sleep.
+void coro_run(int (*run_tasks)(void *ctx), void *ctx) {
+    struct epoll_event events[CORO_EVENT_BATCH];
+
+    while (1) {
+        const int below_max = t_sched->live < g_config.coro_max;
+
+        for (int i = 0; i < t_sched->watch_count; i++) {
+            struct coro_watch *watch = &t_sched->watches[i];
+            const int want = !watch->gated || below_max;
+            struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.u64 = i + 1 };
+
+            if (want != watch->watching && !epoll_ctl(t_sched->epoll_fd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, watch->fd, &event))
+                watch->watching = want;
+        }
+
+        const int pending = run_tasks && run_tasks(ctx);
+        long timeout = pending ? 0 : -1;
+
+        if (!pending && t_sched->timer_count) {
+            timeout = t_sched->timers[0]->deadline_ms - now_ms();
+            timeout = timeout < 0 ? 0 : timeout;
+        }
+
+        const int event_count = epoll_wait(t_sched->epoll_fd, events, CORO_EVENT_BATCH, timeout);
+
+        if (event_count < 0 && errno != EINTR)
+            perror("\033[1;31merror:\033[0m epoll_wait() failed in worker");
+
+        for (int i = 0; i < event_count; i++) {
+            if (events[i].data.u64 <= CORO_MAX_WATCHES) {
+                t_sched->watches[events[i].data.u64 - 1].ready = 1;
+                continue;
+            }
+
+            struct coro *coro = events[i].data.ptr;
+
+            private_timer_remove(coro);
+            private_resume(coro);
+        }
+
+        const long now = now_ms();
+
+        while (t_sched->timer_count && t_sched->timers[0]->deadline_ms <= now) {
+            struct coro *coro = t_sched->timers[0];
+
+            private_timer_remove(coro);
+            epoll_ctl(t_sched->epoll_fd, EPOLL_CTL_DEL, coro->fd, NULL); // no late event for a coroutine that moved on
+            coro->timed_out = 1;
+            private_resume(coro);
+        }
+
+        for (int i = 0; i < t_sched->watch_count; i++) {
+            struct coro_watch *watch = &t_sched->watches[i];
+
+            if (watch->ready) {
+                watch->ready = 0;
+                watch->on_ready(watch->ctx);
+            }
+        }
+    }
+}
+
+// NULL outside of a coroutine
+struct coro *coro_self(void) {
+    return t_sched ? t_sched->current : NULL;
+}
+
+static void private_save_locals(struct coro *coro) {
+    size_t offset = 0;
+
+    for (int i = 0; i < t_sched->local_count; offset += t_sched->locals[i++].size)
+        memcpy(coro->locals + offset, t_sched->locals[i].address, t_sched->locals[i].size);
+
+    return;
+}
+
+static void private_restore_locals(const struct coro *coro) {
+    size_t offset = 0;
+
+    for (int i = 0; i < t_sched->local_count; offset += t_sched->locals[i++].size)
+        memcpy(t_sched->locals[i].address, coro->locals + offset, t_sched->locals[i].size);
+
+    return;
+}
+
+// switches back to the loop until someone calls coro_resume()
+void coro_suspend(void) {
+    struct coro *coro = t_sched->current;
+
+    private_save_locals(coro);
+    private_switch_out(coro);
+    private_restore_locals(coro);
+
+    return;
+}
+
+// from the loop only, on the worker that runs `coro`
+void coro_resume(struct coro *coro) {
+    private_resume(coro);
+
+    return;
+}
+
+// Exchanges the thread-locals of a suspended coroutine with this thread's, on any worker: code running
+// on its behalf between two calls sees (and updates) the coroutine's values. Workers register the same
+// locals in the same order, so the layout matches.
+void coro_locals_swap(struct coro *coro) {
+    char saved[CORO_LOCALS_SIZE];
+    size_t offset = 0;
+
+    for (int i = 0; i < t_sched->local_count; offset += t_sched->locals[i++].size) {
+        memcpy(saved, t_sched->locals[i].address, t_sched->locals[i].size);
+        memcpy(t_sched->locals[i].address, coro->locals + offset, t_sched->locals[i].size);
+        memcpy(coro->locals + offset, saved, t_sched->locals[i].size);
+    }
+
+    return;
+}
+
+// Waits until `fd` is ready for `events` (POLLIN, POLLOUT), at most `timeout_ms` (-1: no limit).
+// Inside a coroutine the worker runs others meanwhile; anywhere else this is a plain poll().
+int coro_wait_fd(const int fd, const short events, const int timeout_ms) {
+    struct coro *coro = t_sched ? t_sched->current : NULL;
+
+    if (!coro) {
+        struct pollfd pfd = { .fd = fd, .events = events };
+        int retval;
+
+        while ((retval = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR)
+            ;
+
+        if (!retval)
+            errno = ETIMEDOUT;
+
+        return retval > 0 ? 0 : -1;
+    }
+
+    // one-shot: fires once, then stays registered but disarmed until the next wait on this descriptor
+    struct epoll_event event = {
+        .events = (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0) | EPOLLONESHOT,
+        .data.ptr = coro
+    };
+
+    if (epoll_ctl(t_sched->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0
+        && (errno != ENOENT || epoll_ctl(t_sched->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0))
+        return -1;
+
+    coro->fd = fd;
+    coro->timed_out = 0;
+
+    if (timeout_ms >= 0) {
+        coro->deadline_ms = now_ms() + timeout_ms;
+        private_timer_add(coro);
+    }
+
+    private_save_locals(coro);
+    private_switch_out(coro);
+    private_restore_locals(coro);
+
+    if (coro->timed_out) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return 0;
+}
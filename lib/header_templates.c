@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "arena.h"
+#include "header_templates.h"
+#include "../include/http_enums.h" // plain "http_enums.h" resolves to the internal header in lib/
+
+#define DATE_LINE_MAX 128
+
+// status line + Content-Type + Content-Encoding, for every (status, content type, encoding) combination;
+// content type index `http_content_type_count` stands for "no Content-Type"
+static struct sized_str *g_templates;
+static int *g_status_index; // status code -> row in g_templates, -1 if the status has no reason phrase
+static struct sized_str g_allow;
+static struct arena *g_arena;
+
+// Date and Server lines, double-buffered: the clock thread renders into the idle copy, then flips
+static char g_date_lines[2][DATE_LINE_MAX];
+static size_t g_date_lens[2];
+static _Atomic int g_date_current;
+
+static struct sized_str render(const char *restrict fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    const int length = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    struct sized_str retval = { .ptr = arena_alloc(g_arena, length + 1), .len = length };
+
+    va_start(args, fmt);
+    vsnprintf(retval.ptr, length + 1, fmt, args);
+    va_end(args);
+
+    return retval;
+}
+
+static void render_date(const int index) {
+    const time_t now = time(NULL);
+    struct tm tm_buf;
+
+    gmtime_r(&now, &tm_buf);
+    g_date_lens[index] = strftime(g_date_lines[index], DATE_LINE_MAX,
+        "Date: %a, %d %b %Y %H:%M:%S GMT\r\nServer: " SERVER_NAME "\r\n", &tm_buf);
+
+    return;
+}
+
+static void *clock_thread(void *args) {
+    (void) args;
+
+    while (1) {
+        struct timespec next;
+        clock_gettime(CLOCK_REALTIME, &next);
+        next = (struct timespec) { .tv_sec = next.tv_sec + 1 };
+
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL))
+            ;
+
+        const int idle = !atomic_load_explicit(&g_date_current, memory_order_relaxed);
+        render_date(idle);
+        atomic_store_explicit(&g_date_current, idle, memory_order_release);
+    }
+
+    return NULL;
+}
+
+int header_templates_init(void) {
+    if (!(g_arena = arena_new()))
+        return -1;
+
+    int status_count = 0;
+
+    g_status_index = arena_alloc(g_arena, http_status_codes_count * sizeof *g_status_index);
+    for (int status = 0; status < http_status_codes_count; status++)
+        g_status_index[status] = http_status_codes_str[status] ? status_count++ : -1;
+
+    const int row_len = (http_content_type_count + 1) * 2;
+    g_templates = arena_alloc(g_arena, status_count * row_len * sizeof *g_templates);
+
+    for (int status = 0; status < http_status_codes_count; status++) {
+        if (g_status_index[status] < 0)
+            continue;
+
+        struct sized_str *row = g_templates + g_status_index[status] * row_len;
+
+        for (int content_type = 0; content_type <= http_content_type_count; content_type++) {
+            if (content_type == http_content_type_count) {
+                row[2*content_type] = row[2*content_type + 1] = render("HTTP/1.1 %d %s\r\n", status, http_status_codes_str[status]);
+                continue;
+            }
+
+            for (int gzip = 0; gzip < 2; gzip++)
+                row[2*content_type + gzip] = render("HTTP/1.1 %d %s\r\nContent-Type: %s\r\n%s",
+                    status, http_status_codes_str[status], http_content_type_str[content_type],
+                    gzip ? "Content-Encoding: gzip\r\n" : "");
+        }
+    }
+
+    g_allow = render("Allow: %s, %s\r\n", http_methods_str[GET], http_methods_str[HEAD]);
+
+    render_date(0);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, clock_thread, NULL))
+        return -1;
+
+    pthread_detach(thread);
+
+    return 0;
+}
+
+struct sized_str header_template(const int status, const int content_type, const int gzip) {
+    if (status < 0 || status >= http_status_codes_count || g_status_index[status] < 0)
+        return (struct sized_str) { 0 };
+
+    const int column = content_type == HEADER_NO_CONTENT_TYPE ? http_content_type_count : content_type;
+
+    return g_templates[(g_status_index[status] * (http_content_type_count + 1) + column) * 2 + !!gzip];
+}
+
+// valid until the clock flips twice, copy it right away
+struct sized_str header_date(void) {
+    const int current = atomic_load_explicit(&g_date_current, memory_order_acquire);
+
+    return (struct sized_str) { .ptr = g_date_lines[current], .len = g_date_lens[current] };
+}
+
+struct sized_str header_allow(void) {
+    return g_allow;
+}
+
+size_t u64_to_dec(char *restrict out, uint64_t value) {
+    static const char digit_pairs[201] =
+        "00010203040506070809" "10111213141516171819" "20212223242526272829" "30313233343536373839"
+        "40414243444546474849" "50515253545556575859" "60616263646566676869" "70717273747576777879"
+        "80818283848586878889" "90919293949596979899";
+
+    char temp[U64_DEC_MAX];
+    char *ptr = temp + U64_DEC_MAX;
+
+    while (value >= 100) {
+        const unsigned pair = (value % 100) * 2;
+        value /= 100;
+        *--ptr = digit_pairs[pair + 1];
+        *--ptr = digit_pairs[pair];
+    }
+
+    if (value >= 10) {
+        *--ptr = digit_pairs[value * 2 + 1];
+        *--ptr = digit_pairs[value * 2];
+    } else
+        *--ptr = '0' + value;
+
+    const size_t len = temp + U64_DEC_MAX - ptr;
+    memcpy(out, ptr, len);
+
+    return len;
+}
@@ -6,14 +6,25 @@
 
 const char *http_status_codes_str[] = {
     [200] = "OK",
+    [201] = "Created",
     [204] = "No Content",
     [301] = "Moved Permanently",
+    [304] = "Not Modified",
     [308] = "Permanent Redirect",
     [400] = "Bad Request",
     [404] = "Not Found",
     [405] = "Method Not Allowed",
-    [500] = "Internal Server Error"
+    [409] = "Conflict",
+    [411] = "Length Required",
+    [413] = "Content Too Large",
+    [429] = "Too Many Requests",
+    [500] = "Internal Server Error",
+    [502] = "Bad Gateway",
+    [503] = "Service Unavailable",
+    [504] = "Gateway Timeout",
+    [507] = "Insufficient Storage"
 };
+const int http_status_codes_count = sizeof http_status_codes_str / sizeof *http_status_codes_str;
 
 const char *http_methods_str[] = { FOREACH_HTTP_METHOD(GENERATE_STRING) };
 
@@ -28,6 +39,7 @@ enum http_methods method_enumify(const struct sized_str str) {
 const char *http_headers_str[] = { FOREACH_HTTP_HEADER(HEADER_STRINGIFY) };
 
 const char *http_content_type_str[] = { FOREACH_HTTP_CONTENT_TYPE(HTTP_CONTENT_TYPE_STRINGIFY) };
+const int http_content_type_count = sizeof http_content_type_str / sizeof *http_content_type_str;
 
 #define RET_IF(str, retval) do { if (is_same_string(file_extension, str)) return retval; } while (0)
 
@@ -10,6 +10,7 @@
 
 
 extern const char *http_status_codes_str[];
+extern const int http_status_codes_count;
 
 
 
@@ -62,6 +63,9 @@ enum http_methods method_enumify(const struct sized_str str);
 #define FOREACH_HTTP_HEADER(macro) \
     macro(accept, encoding) \
     macro(content, length) \
+    macro(expect) \
+    macro(if, none, match) \
+    macro(transfer, encoding) \
     macro(user, agent) \
 	macro(count)
 
@@ -92,6 +96,7 @@ extern const char *http_headers_str[];
 
 enum http_content_type { FOREACH_HTTP_CONTENT_TYPE(HTTP_CONTENT_TYPE_ENUMIFY) };
 extern const char *http_content_type_str[];
+extern const int http_content_type_count;
 enum http_content_type get_file_type(const struct sized_str path);
 
 
@@ -5,13 +5,13 @@
 #include <stdarg.h>
 #include <sys/stat.h>
 #include <errno.h>
-
-#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "lib.h"
 
-static const char filedir[] = "serve";
-extern __thread char *g_err_500_msg;
+const char filedir[] = "serve";
+__thread char *g_err_500_msg;
 
 void error_exit(const char *err_msg) {
     perror(err_msg);
@@ -41,14 +41,14 @@ void print_to_log(const char *restrict fmt, ...) {
     return;
 }
 
-char dir_or_file(const struct sized_str path, struct arena *arena) {
+// dir_or_file(), also handing back what stat() found
+char stat_path(const struct sized_str path, struct stat *st_buf, struct arena *arena) {
     char c_path[strlen(filedir)+path.len+1];
     memcpy(c_path, filedir, strlen(filedir));
     memcpy(c_path+strlen(filedir), path.ptr, path.len);
     c_path[strlen(filedir)+path.len] = '\0';
 
-    struct stat st_buf;
-    const int stat_retval = stat(c_path, &st_buf);
+    const int stat_retval = stat(c_path, st_buf);
 
     if (stat_retval == -1) {
         if (errno == ENOENT || errno == ENOTDIR)
@@ -57,16 +57,21 @@ char dir_or_file(const struct sized_str path, struct arena *arena) {
         return 'e';
     }
 
-    if (S_ISDIR(st_buf.st_mode))
+    if (S_ISDIR(st_buf->st_mode))
         return 'd';
     
-    if (S_ISREG(st_buf.st_mode))
+    if (S_ISREG(st_buf->st_mode))
         return 'f';
 
     set_err_500("given path exists, but is neither file nor directory!", arena);
     return 'e';
 }
 
+char dir_or_file(const struct sized_str path, struct arena *arena) {
+    struct stat st_buf;
+    return stat_path(path, &st_buf, arena);
+}
+
 struct sized_str read_file(const struct sized_str path, struct arena *arena) {
     char complete_filepath[strlen(filedir)+path.len+1];
     memcpy(complete_filepath, filedir, strlen(filedir));
@@ -89,6 +94,7 @@ struct sized_str read_file(const struct sized_str path, struct arena *arena) {
     struct sized_str retval = { .ptr = arena_alloc(arena, file_size), .len = file_size };
 
     const int bytes_read = fread(retval.ptr, 1, file_size, f);
+    fclose(f);
 
     if (bytes_read != file_size) {
         set_err_500("failure to read file", arena);
@@ -98,76 +104,98 @@ struct sized_str read_file(const struct sized_str path, struct arena *arena) {
     return retval;
 }
 
-struct sized_str validate_path(struct sized_str path, struct arena *arena) {
-    if (!path.len)
-        return (struct sized_str) { 0 };
+// descriptor for sendfile() instead of reading the file in, -1 when missing or on error (err_500 set)
+int open_file(const struct sized_str path, size_t *size, struct arena *arena) {
+    char complete_filepath[strlen(filedir)+path.len+1];
+    memcpy(complete_filepath, filedir, strlen(filedir));
+    memcpy(complete_filepath+strlen(filedir), path.ptr, path.len);
+    complete_filepath[strlen(filedir)+path.len] = '\0';
 
-    char *temp_buf = arena_alloc(arena, path.len+1); // TODO: scratch?
-    memcpy(temp_buf, path.ptr, path.len);
-    temp_buf[path.len] = '\0';
+    const int fd = open(complete_filepath, O_RDONLY | O_CLOEXEC);
 
-    char **tok_stack = arena_alloc(arena, sizeof(*tok_stack) * path.len);
-    memset(tok_stack, 0, sizeof(*tok_stack) * path.len);
-    int valid_tok_count = 0;
+    if (fd < 0) {
+        if (errno != ENOENT && errno != ENOTDIR)
+            set_err_500("file exists, but failed to open", arena);
+        return -1;
+    }
 
-    char *saveptr;
+    struct stat st_buf;
+    if (fstat(fd, &st_buf) < 0) {
+        set_err_500("failure to stat opened file", arena);
+        close(fd);
+        return -1;
+    }
 
-    int total_tok_count;
-    for (total_tok_count = 0; ; temp_buf = NULL, total_tok_count++) {
-        char *tok = strtok_r(temp_buf, "/", &saveptr);
+    *size = st_buf.st_size;
 
-        if (!tok)
-            break;
+    return fd;
+}
 
-        int is_dir_up = !strcmp(tok, "..");
+// one path segment starting at `*i` (leading slashes skipped), `*i` ends up past it
+static struct sized_str private_next_segment(const struct sized_str path, size_t *i) {
+    while (*i < path.len && path.ptr[*i] == '/')
+        (*i)++;
 
-        if (!strcmp(tok, "."))
-            continue;
+    const size_t start = *i;
 
-        if (is_dir_up) {
-            if (!valid_tok_count)
-                return (struct sized_str) { 0 };
+    while (*i < path.len && path.ptr[*i] != '/')
+        (*i)++;
+
+    return (struct sized_str) { .ptr = path.ptr + start, .len = *i - start };
+}
+
+// Resolves `.` and `..` segments; empty result when `..` would climb above the serve directory. Paths
+// without dot segments, nearly all of them, are returned as they are (still a view into the request);
+// the others are copied into `arena`.
+struct sized_str validate_path(struct sized_str path, struct arena *arena) {
+    if (!path.len)
+        return (struct sized_str) { 0 };
+
+    int has_dot_segment = 0;
 
-            tok_stack[--valid_tok_count] = NULL;
-        } else
-            tok_stack[valid_tok_count++] = tok;
+    for (size_t i = 0; i < path.len && !has_dot_segment; ) {
+        const struct sized_str segment = private_next_segment(path, &i);
+        has_dot_segment = is_same_string(segment, ".") || is_same_string(segment, "..");
     }
-    // validated
 
-    if (total_tok_count == valid_tok_count) // no `..` present in url
+    if (!has_dot_segment)
         return path;
 
-    if (!valid_tok_count)
-        return (struct sized_str) { .ptr = "/", .len = 1 };
+    // rebuilt in a new arena buffer (the request bytes stay untouched, the result is a view into the
+    // arena from here on): every kept segment is "/name", `..` truncates back to the previous slash
+    char *new_path = arena_alloc(arena, path.len + 1); // +1 for a leading slash the request left out
+    size_t new_length = 0;
+    int depth = 0;
 
-    // rebuild
-    const int new_length = path.len - 3*(total_tok_count - valid_tok_count);
-    char *new_path = arena_alloc(arena, new_length);
+    for (size_t i = 0; i < path.len; ) {
+        const struct sized_str segment = private_next_segment(path, &i);
 
-    int offset = 0;
-    for (int index = 0; offset < new_length && index < valid_tok_count; offset += strlen(tok_stack[index++])) {
-        new_path[offset++] = '/';
-        memcpy(new_path+offset, tok_stack[index], strlen(tok_stack[index]));
-    }
+        if (!segment.len || is_same_string(segment, "."))
+            continue;
 
-    if (path.ptr[path.len-1] == '/') // preserve trailing slash
-        new_path[offset++] = '/';
+        if (is_same_string(segment, "..")) {
+            if (!depth--)
+                return (struct sized_str) { 0 };
 
-    return (struct sized_str) { .ptr = new_path, .len = offset };
-}
+            while (new_length && new_path[--new_length] != '/')
+                ;
+
+            continue;
+        }
 
-int gzip_compress(char *restrict out_buf, struct sized_str str) {
-	z_stream zs = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL,
-		.avail_in = str.len, .next_in = (Bytef *) str.ptr,
-		.avail_out = str.len, .next_out = (Bytef *) out_buf
-	};
+        new_path[new_length++] = '/';
+        memcpy(new_path + new_length, segment.ptr, segment.len);
+        new_length += segment.len;
+        depth++;
+    }
 
-	// TODO: error checking???
-	deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
-	deflate(&zs, Z_FINISH);
-	deflateEnd(&zs);
+    if (!depth)
+        return (struct sized_str) { .ptr = "/", .len = 1 };
+
+    if (path.ptr[path.len-1] == '/') // preserve trailing slash
+        new_path[new_length++] = '/';
 
-	return zs.total_out; // success
+    return (struct sized_str) { .ptr = new_path, .len = new_length };
 }
 
 char *set_err_500(char *err_prefix, struct arena *arena) {
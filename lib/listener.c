@@ -0,0 +1,192 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <grp.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "listener.h"
+
+static int private_parse_inet(const char *spec, struct sockaddr_storage *addr, socklen_t *addr_len) {
+    const char *colon = strrchr(spec, ':');
+    char *end;
+    const long port = strtol(colon ? colon + 1 : spec, &end, 10);
+
+    if (*end || port <= 0 || port > 65535)
+        return -1;
+
+    char host[INET6_ADDRSTRLEN];
+    const size_t host_len = colon ? (size_t) (colon - spec) : 0;
+
+    if (host_len >= sizeof host)
+        return -1;
+
+    memcpy(host, spec, host_len);
+    host[host_len] = '\0';
+
+    if (host[0] == '[') { // [ADDR]:PORT
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+
+        if (host_len < 3 || host[host_len-1] != ']')
+            return -1;
+
+        host[host_len-1] = '\0';
+        *in6 = (struct sockaddr_in6) { .sin6_family = AF_INET6, .sin6_port = htons(port) };
+        *addr_len = sizeof *in6;
+
+        return inet_pton(AF_INET6, host + 1, &in6->sin6_addr) == 1 ? 0 : -1;
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *) addr;
+
+    *in = (struct sockaddr_in) { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+    *addr_len = sizeof *in;
+
+    return !host_len || inet_pton(AF_INET, host, &in->sin_addr) == 1 ? 0 : -1;
+}
+
+static int private_parse_unix(const char *path, struct sockaddr_storage *addr, socklen_t *addr_len) {
+    struct sockaddr_un *un = (struct sockaddr_un *) addr;
+    const size_t len = strlen(path);
+
+    if (len < 2 || len >= sizeof un->sun_path)
+        return -1;
+
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path, len);
+
+    if (path[0] == '@') // abstract namespace: no file, no permissions, gone with the process
+        un->sun_path[0] = '\0';
+
+    *addr_len = offsetof(struct sockaddr_un, sun_path) + len + (path[0] != '@');
+
+    return 0;
+}
+
+// the socket file gets --unix-mode and --unix-group, so only the intended peers can connect
+static int private_set_permissions(const char *path) {
+    if (g_config.unix_mode >= 0 && chmod(path, g_config.unix_mode) < 0)
+        return -1;
+
+    if (g_config.unix_group) {
+        const struct group *group = getgrnam(g_config.unix_group);
+
+        if (!group) {
+            fprintf(stderr, "unknown group: %s\n", g_config.unix_group);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (chown(path, -1, group->gr_gid) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// a socket file whose server is gone refuses connections, a live one accepts them (or has a full backlog)
+static int private_unix_in_use(const struct sockaddr_storage *addr, const socklen_t addr_len) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return 1;
+
+    const int in_use = !connect(fd, (const struct sockaddr *) addr, addr_len) || (errno != ECONNREFUSED && errno != ENOENT);
+    close(fd);
+
+    return in_use;
+}
+
+static void private_setsockopt(const struct listener *listener, const int level, const int name, const int value, const char *what) {
+    if (setsockopt(listener->fd, level, name, &value, sizeof value) < 0)
+        fprintf(stderr, "\033[1;31merror:\033[0m %s not set on %s: %s\n", what, listener->spec, strerror(errno));
+
+    return;
+}
+
+// Accepted sockets inherit these from the listener, so they cost nothing per connection. A failure only
+// loses the optimization (e.g. --busy-poll beyond net.core.busy_poll needs CAP_NET_ADMIN), so it is
+// reported and the listener kept.
+static void private_tune(const struct listener *listener) {
+    if (g_config.sndbuf)
+        private_setsockopt(listener, SOL_SOCKET, SO_SNDBUF, g_config.sndbuf, "--sndbuf");
+
+    if (g_config.rcvbuf) // before listen(), the window scale is negotiated in the handshake
+        private_setsockopt(listener, SOL_SOCKET, SO_RCVBUF, g_config.rcvbuf, "--rcvbuf");
+
+    if (listener->family == AF_UNIX)
+        return;
+
+    if (g_config.tcp_nodelay)
+        private_setsockopt(listener, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+
+    if (g_config.defer_accept_s)
+        private_setsockopt(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, g_config.defer_accept_s, "--defer-accept");
+
+    if (g_config.fastopen_qlen)
+        private_setsockopt(listener, IPPROTO_TCP, TCP_FASTOPEN, g_config.fastopen_qlen, "--fastopen");
+
+    if (g_config.busy_poll_us)
+        private_setsockopt(listener, SOL_SOCKET, SO_BUSY_POLL, g_config.busy_poll_us, "--busy-poll");
+
+    return;
+}
+
+int listener_open(struct listener *listener, const char *spec) {
+    struct sockaddr_storage addr = { 0 };
+    socklen_t addr_len;
+    const int is_unix = !strncmp(spec, "unix:", 5);
+
+    if ((is_unix ? private_parse_unix(spec + 5, &addr, &addr_len) : private_parse_inet(spec, &addr, &addr_len)) < 0) {
+        fprintf(stderr, "invalid --listen address: %s\n", spec);
+        errno = EINVAL;
+        return -1;
+    }
+
+    *listener = (struct listener) { .family = addr.ss_family, .spec = spec };
+
+    if ((listener->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    const int yes = 1, no = 0;
+
+    if (!is_unix && setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) < 0)
+        return -1;
+
+    // IPv4 clients arrive as v4-mapped addresses on the same socket
+    if (addr.ss_family == AF_INET6 && setsockopt(listener->fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof no) < 0)
+        return -1;
+
+    const char *path = ((struct sockaddr_un *) &addr)->sun_path;
+    struct stat st;
+
+    if (is_unix && path[0] && !lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+        if (private_unix_in_use(&addr, addr_len)) {
+            fprintf(stderr, "%s is in use by a running server\n", spec);
+            errno = EADDRINUSE;
+            return -1;
+        }
+
+        unlink(path); // left behind by a previous run
+    }
+
+    private_tune(listener);
+
+    if (bind(listener->fd, (const struct sockaddr *) &addr, addr_len) < 0)
+        return -1;
+
+    if (is_unix && path[0] && private_set_permissions(path) < 0)
+        return -1;
+
+    if (listen(listener->fd, g_config.backlog) < 0)
+        return -1;
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "lib.h"
+#include "metacache.h"
+#include "../include/http_enums.h" // plain "http_enums.h" resolves to the internal header in lib/
+
+#define METACACHE_SHARDS 64 // picked by the top bits of the hash
+#define METACACHE_SHARD_SLOTS 64
+#define METACACHE_PROBE 4 // slots looked at per lookup, the eviction window
+#define METACACHE_PATH_MAX 96 // longer paths always go to stat()
+
+struct entry {
+    uint64_t hash; // 0: free slot
+    uint32_t generation; // g_generation when the path was looked up, older entries are dead
+    uint32_t expires; // ms since metacache_init, wrapping
+    struct file_meta meta;
+    char kind; // as returned by dir_or_file(), '\0' for a missing path
+    uint8_t path_len;
+    char path[METACACHE_PATH_MAX];
+};
+
+struct shard {
+    pthread_mutex_t lock;
+    struct entry entries[METACACHE_SHARD_SLOTS];
+};
+
+static struct shard *g_shards;
+static atomic_uint g_generation;
+static struct timespec g_start;
+
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (ts.tv_sec - g_start.tv_sec) * 1000 + (ts.tv_nsec - g_start.tv_nsec) / 1000000;
+}
+
+// FNV-1a, then a splitmix64 finalizer so the shard bits depend on every byte
+static uint64_t private_hash(const struct sized_str path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < path.len; i++)
+        hash = (hash ^ (unsigned char) path.ptr[i]) * 0x100000001b3ULL;
+
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+
+    return hash ? hash : 1;
+}
+
+static char private_stat(const struct sized_str path, struct file_meta *meta, struct arena *arena) {
+    struct stat st_buf;
+    const char kind = stat_path(path, &st_buf, arena);
+
+    if (kind == 'f' || kind == 'd')
+        *meta = (struct file_meta) {
+            .size = st_buf.st_size,
+            .mtime = st_buf.st_mtime,
+            .content_type = kind == 'f' ? get_file_type(path) : http_content_type_text_html
+        };
+
+    return kind;
+}
+
+int metacache_init(void) {
+    if (!(g_shards = calloc(METACACHE_SHARDS, sizeof *g_shards)))
+        return -1;
+
+    for (int i = 0; i < METACACHE_SHARDS; i++)
+        pthread_mutex_init(&g_shards[i].lock, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &g_start);
+
+    return 0;
+}
+
+// the kind of `path` like dir_or_file(), with `meta` filled in for files and directories
+char metacache_stat(const struct sized_str path, struct file_meta *meta, struct arena *arena) {
+    if (!g_shards || path.len > METACACHE_PATH_MAX)
+        return private_stat(path, meta, arena);
+
+    const uint64_t hash = private_hash(path);
+    struct shard *shard = &g_shards[hash >> 58];
+    const unsigned int start = hash & (METACACHE_SHARD_SLOTS - 1);
+    // read before stat(), so a change that lands in between leaves a dead entry rather than a stale one
+    const uint32_t generation = atomic_load_explicit(&g_generation, memory_order_acquire);
+    uint32_t now = now_ms();
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (int i = 0; i < METACACHE_PROBE; i++) {
+        const struct entry *entry = &shard->entries[(start + i) & (METACACHE_SHARD_SLOTS - 1)];
+
+        if (entry->hash == hash && entry->generation == generation && (int32_t) (entry->expires - now) > 0
+            && entry->path_len == path.len && !memcmp(entry->path, path.ptr, path.len)) {
+            const char kind = entry->kind;
+            *meta = entry->meta;
+            pthread_mutex_unlock(&shard->lock);
+            return kind;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    const char kind = private_stat(path, meta, arena);
+
+    if (kind == 'e') // never cached, the next request tries again
+        return kind;
+
+    now = now_ms();
+    const uint32_t expires = now + (kind ? g_config.meta_ttl_ms : g_config.negative_ttl_ms);
+
+    pthread_mutex_lock(&shard->lock);
+
+    // a dead or expired slot if there is one, the one expiring first otherwise
+    struct entry *victim = NULL;
+
+    for (int i = 0; i < METACACHE_PROBE; i++) {
+        struct entry *entry = &shard->entries[(start + i) & (METACACHE_SHARD_SLOTS - 1)];
+
+        if (!entry->hash || entry->generation != generation || (int32_t) (entry->expires - now) <= 0
+            || (entry->hash == hash && entry->path_len == path.len && !memcmp(entry->path, path.ptr, path.len))) {
+            victim = entry;
+            break;
+        }
+
+        if (!victim || (int32_t) (entry->expires - victim->expires) < 0)
+            victim = entry;
+    }
+
+    *victim = (struct entry) { .hash = hash, .generation = generation, .expires = expires, .kind = kind, .path_len = path.len };
+    if (kind)
+        victim->meta = *meta;
+    memcpy(victim->path, path.ptr, path.len);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return kind;
+}
+
+// something under the serve directory changed (watcher thread): every entry is dead from now on
+void metacache_invalidate(void) {
+    atomic_fetch_add_explicit(&g_generation, 1, memory_order_release);
+
+    return;
+}
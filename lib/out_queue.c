@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "out_queue.h"
+#include "tls.h"
+
+#define SENDFILE_MAX (1 << 20) // per call, keeps one large file from monopolizing a flush
+
+static void private_release(struct out_queue *queue, struct out_chunk *chunk) {
+    if (chunk->type == OUT_CHUNK_FILE)
+        close(chunk->fd);
+    else if (chunk->owned) {
+        queue->memory_used -= chunk->len + (chunk->ptr - chunk->owned);
+        free(chunk->owned);
+    }
+
+    *chunk = (struct out_chunk) { .fd = -1 };
+
+    return;
+}
+
+static void private_push(struct out_queue *queue, const struct out_chunk chunk) {
+    if (queue->head == queue->count)
+        queue->head = queue->count = 0;
+
+    queue->chunks[queue->count++] = chunk;
+
+    return;
+}
+
+// -1 (ENOBUFS) when the queue has no chunk left: the reply cannot go out whole, close the connection
+int out_queue_push_mem(struct out_queue *queue, const char *ptr, const size_t len, const int backing_fd, const off_t backing_offset) {
+    if (!len)
+        return 0;
+
+    if (queue->count == OUT_QUEUE_MAX_CHUNKS) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    private_push(queue, (struct out_chunk) { .type = OUT_CHUNK_MEM, .ptr = ptr, .len = len, .fd = backing_fd, .offset = backing_offset });
+
+    return 0;
+}
+
+// takes ownership of malloc'd `ptr`, also on failure
+int out_queue_push_owned(struct out_queue *queue, char *ptr, const size_t len) {
+    if (!len || queue->count == OUT_QUEUE_MAX_CHUNKS) {
+        free(ptr);
+        if (!len)
+            return 0;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    private_push(queue, (struct out_chunk) { .type = OUT_CHUNK_MEM, .ptr = ptr, .len = len, .owned = ptr, .fd = -1 });
+    queue->memory_used += len;
+
+    return 0;
+}
+
+// takes ownership of `fd`, also on failure
+int out_queue_push_file(struct out_queue *queue, const int fd, const off_t offset, const size_t len) {
+    if (!len || queue->count == OUT_QUEUE_MAX_CHUNKS) {
+        close(fd);
+        if (!len)
+            return 0;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    private_push(queue, (struct out_chunk) { .type = OUT_CHUNK_FILE, .fd = fd, .offset = offset, .len = len });
+
+    return 0;
+}
+
+static void private_consume_mem(struct out_queue *queue, size_t sent) {
+    while (queue->head < queue->count && queue->chunks[queue->head].type == OUT_CHUNK_MEM) {
+        struct out_chunk *chunk = &queue->chunks[queue->head];
+
+        if (sent < chunk->len) {
+            chunk->ptr += sent;
+            chunk->len -= sent;
+            chunk->offset += sent;
+            return;
+        }
+
+        sent -= chunk->len;
+        private_release(queue, chunk);
+        queue->head++;
+    }
+
+    return;
+}
+
+// 1: everything sent, 0: socket buffer full (wait for POLLOUT), -1: error; `tls` is NULL for a plain connection
+int out_queue_flush(struct out_queue *queue, const int socket_fd, struct tls_conn *tls, size_t *bytes_sent) {
+    while (queue->head < queue->count) {
+        struct out_chunk *chunk = &queue->chunks[queue->head];
+        ssize_t sent;
+
+        if (chunk->type == OUT_CHUNK_MEM) { // gather every consecutive memory chunk into one call
+            struct iovec iov[OUT_QUEUE_MAX_CHUNKS];
+            int iov_count = 0;
+
+            for (int i = queue->head; i < queue->count && queue->chunks[i].type == OUT_CHUNK_MEM; i++)
+                iov[iov_count++] = (struct iovec) { .iov_base = (void *) queue->chunks[i].ptr, .iov_len = queue->chunks[i].len };
+
+            // a file follows: hold the partial segment so the headers leave together with the body's start
+            const int more = g_config.tcp_cork && queue->head + iov_count < queue->count ? MSG_MORE : 0;
+
+            const struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iov_count };
+            sent = tls_sendmsg(tls, socket_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | more);
+        } else
+            sent = tls_sendfile(tls, socket_fd, chunk->fd, &chunk->offset, chunk->len > SENDFILE_MAX ? SENDFILE_MAX : chunk->len);
+
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        if (!sent && chunk->type == OUT_CHUNK_FILE) { // file shrank underneath us
+            errno = EIO;
+            return -1;
+        }
+
+        if (bytes_sent)
+            *bytes_sent += sent;
+
+        if (chunk->type == OUT_CHUNK_MEM)
+            private_consume_mem(queue, sent);
+        else if (!(chunk->len -= sent)) { // sendfile() already advanced the offset
+            private_release(queue, chunk);
+            queue->head++;
+        }
+    }
+
+    queue->head = queue->count = 0;
+
+    // the last record may still sit in the TLS library's buffer
+    if (tls_flush(tls) < 0)
+        return errno == EAGAIN ? 0 : -1;
+
+    return 1;
+}
+
+// Borrowed chunks are about to outlive the request: switch them to their backing file, or copy them.
+// -1 when copying would go over `memory_cap`; chunks converted so far stay valid.
+int out_queue_make_durable(struct out_queue *queue, const size_t memory_cap) {
+    for (int i = queue->head; i < queue->count; i++) {
+        struct out_chunk *chunk = &queue->chunks[i];
+
+        if (chunk->type != OUT_CHUNK_MEM || chunk->owned)
+            continue;
+
+        if (chunk->fd >= 0) {
+            const int fd = fcntl(chunk->fd, F_DUPFD_CLOEXEC, 0);
+
+            if (fd >= 0) {
+                *chunk = (struct out_chunk) { .type = OUT_CHUNK_FILE, .fd = fd, .offset = chunk->offset, .len = chunk->len };
+                continue;
+            }
+        }
+
+        if (queue->memory_used + chunk->len > memory_cap || !(chunk->owned = malloc(chunk->len)))
+            return -1;
+
+        memcpy(chunk->owned, chunk->ptr, chunk->len);
+        chunk->ptr = chunk->owned;
+        chunk->fd = -1;
+        queue->memory_used += chunk->len;
+    }
+
+    return 0;
+}
+
+void out_queue_clear(struct out_queue *queue) {
+    for (int i = queue->head; i < queue->count; i++)
+        private_release(queue, &queue->chunks[i]);
+
+    queue->head = queue->count = 0;
+    queue->memory_used = 0;
+
+    return;
+}
@@ -0,0 +1,822 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "coro.h"
+#include "lib.h"
+#include "proxy.h"
+#include "tls.h"
+
+#define PROXY_MAX_UPSTREAMS 64 // in total, a route's upstreams fit in one bitmask
+#define PROXY_POOL_SIZE 32 // idle connections kept per upstream, per worker
+#define PROXY_HEAD_MAX 8192
+#define PROXY_PIPE_SIZE (64 * 1024)
+#define PROXY_COPY_BUFFER (16 * 1024)
+#define PROXY_HEALTH_TIMEOUT_MS 1000
+
+struct upstream {
+    const char *name; // as given on the command line
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    atomic_int outstanding; // requests sent and not yet relayed, over every worker
+    atomic_int healthy;
+};
+
+struct proxy_route {
+    struct sized_str prefix; // no trailing slash, except for "/" itself
+    int first, count; // slice of g_upstreams
+};
+
+struct chunk_parser {
+    enum { CHUNK_SIZE, CHUNK_EXTENSION, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER_START, CHUNK_TRAILER, CHUNK_DONE } state;
+    size_t remaining;
+    int overrun; // bytes past the end of the response, the connection cannot be reused
+};
+
+static struct upstream g_upstreams[PROXY_MAX_UPSTREAMS];
+static int g_upstream_count;
+static struct proxy_route g_routes[CONFIG_MAX_PROXY_ROUTES];
+static int g_route_count;
+
+// per worker: idle keep-alive connections, and a spare pipe for splicing bodies (taken while in use, as
+// another coroutine of the same worker may relay meanwhile)
+static __thread struct upstream_pool { int fds[PROXY_POOL_SIZE]; int count; } *t_pools;
+static __thread int t_pipe[2] = { -1, -1 };
+static __thread unsigned int t_next_pick;
+
+// hop-by-hop: about one connection only, never forwarded in either direction
+static const char *const g_hop_headers[] = { "connection:", "keep-alive:", "proxy-connection:", "te:", "upgrade:", "expect:" };
+
+// both buffers in one sendmsg(), a second small write would sit out Nagle against the peer's delayed ACK;
+// `tls` is the client's, NULL toward an upstream
+static int private_send_two(const int fd, struct tls_conn *tls, const struct sized_str first, const struct sized_str second) {
+    struct iovec iov[2] = { { first.ptr, first.len }, { second.ptr, second.len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+    while (msg.msg_iovlen) {
+        ssize_t sent = tls_sendmsg(tls, fd, &msg, MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            if (errno != EINTR && ((errno != EAGAIN && errno != EWOULDBLOCK) || coro_wait_fd(fd, POLLOUT, g_config.io_timeout_ms) < 0))
+                return -1;
+            continue;
+        }
+
+        while (msg.msg_iovlen && (size_t) sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    while (tls_flush(tls) < 0)
+        if (errno != EINTR && ((errno != EAGAIN && errno != EWOULDBLOCK) || coro_wait_fd(fd, POLLOUT, g_config.io_timeout_ms) < 0))
+            return -1;
+
+    return 0;
+}
+
+static int private_send_all(const int fd, struct tls_conn *tls, const char *buf, const size_t len) {
+    return private_send_two(fd, tls, (struct sized_str) { .ptr = (char *) buf, .len = len }, (struct sized_str) { 0 });
+}
+
+static ssize_t private_recv(const int fd, char *buf, const size_t len) {
+    while (1) {
+        const ssize_t bytes_recvd = recv(fd, buf, len, 0);
+
+        if (bytes_recvd >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return bytes_recvd;
+
+        if (errno != EINTR && coro_wait_fd(fd, POLLIN, g_config.io_timeout_ms) < 0)
+            return -1;
+    }
+}
+
+static int private_connect(const struct upstream *upstream, const int timeout_ms) {
+    const int fd = socket(upstream->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int error = 0;
+    socklen_t error_len = sizeof error;
+
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (const struct sockaddr *) &upstream->addr, upstream->addr_len) < 0
+        && (errno != EINPROGRESS || coro_wait_fd(fd, POLLOUT, timeout_ms) < 0
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || (errno = error))) {
+        error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    if (upstream->addr.ss_family != AF_UNIX) {
+        const int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+    }
+
+    return fd;
+}
+
+static void private_set_health(struct upstream *upstream, const int healthy, const int error) {
+    if (atomic_exchange(&upstream->healthy, healthy) == healthy)
+        return;
+
+    char buf[128];
+
+    if (healthy)
+        print_to_log("upstream %s back in rotation", upstream->name);
+    else
+        print_to_log("\033[1;31mupstream\033[0m %s ejected: %s", upstream->name, strerror_r(error, buf, sizeof buf));
+
+    return;
+}
+
+// Connects to every upstream on an interval: ejects the ones that refuse, readmits the ones that answer
+// again. Workers also eject an upstream as soon as a connection to it fails.
+static void *health_thread(void *args) {
+    const struct timespec interval = { .tv_sec = g_config.proxy_health_ms / 1000, .tv_nsec = g_config.proxy_health_ms % 1000 * 1000000L };
+
+    while (1) {
+        for (int i = 0; i < g_upstream_count; i++) {
+            const int fd = private_connect(&g_upstreams[i], PROXY_HEALTH_TIMEOUT_MS);
+
+            if (fd >= 0)
+                close(fd);
+
+            private_set_health(&g_upstreams[i], fd >= 0, errno);
+        }
+
+        nanosleep(&interval, NULL);
+    }
+
+    return args;
+}
+
+static int private_parse_upstream(struct upstream *upstream, const char *spec) {
+    upstream->name = spec;
+    atomic_init(&upstream->healthy, 1);
+
+    if (!strncmp(spec, "unix:", 5)) {
+        struct sockaddr_un *addr = (struct sockaddr_un *) &upstream->addr;
+        const char *path = spec + 5;
+        const size_t len = strlen(path);
+
+        if (len < 2 || len >= sizeof addr->sun_path)
+            return -1;
+
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path, len);
+        if (path[0] == '@') // abstract namespace, the name is not NUL-terminated
+            addr->sun_path[0] = '\0';
+
+        upstream->addr_len = offsetof(struct sockaddr_un, sun_path) + len + (path[0] != '@');
+
+        return 0;
+    }
+
+    char *host = strdup(spec);
+    char *port = host ? strrchr(host, ':') : NULL;
+
+    if (!port || port == host) {
+        free(host);
+        return -1;
+    }
+
+    *port++ = '\0';
+
+    char *name = host;
+    if (name[0] == '[' && port[-2] == ']') { // [::1]:8080
+        name++;
+        port[-2] = '\0';
+    }
+
+    const struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *result;
+    const int gai_error = getaddrinfo(name, port, &hints, &result);
+
+    if (gai_error) {
+        fprintf(stderr, "%s: %s\n", spec, gai_strerror(gai_error));
+        free(host);
+        return -1;
+    }
+
+    memcpy(&upstream->addr, result->ai_addr, result->ai_addrlen);
+    upstream->addr_len = result->ai_addrlen;
+
+    freeaddrinfo(result);
+    free(host);
+
+    return 0;
+}
+
+// "PREFIX=UPSTREAM[,UPSTREAM...]" from --proxy
+static int private_parse_route(const char *spec) {
+    char *copy = strdup(spec);
+    char *upstreams = copy ? strchr(copy, '=') : NULL;
+
+    if (!upstreams || copy[0] != '/')
+        goto invalid;
+
+    *upstreams++ = '\0';
+
+    struct proxy_route *route = &g_routes[g_route_count++];
+    route->prefix = (struct sized_str) { .ptr = copy, .len = strlen(copy) };
+    if (route->prefix.len > 1 && copy[route->prefix.len-1] == '/')
+        route->prefix.len--;
+    route->first = g_upstream_count;
+
+    char *saveptr;
+    for (char *upstream = strtok_r(upstreams, ",", &saveptr); upstream; upstream = strtok_r(NULL, ",", &saveptr)) {
+        if (g_upstream_count == PROXY_MAX_UPSTREAMS || private_parse_upstream(&g_upstreams[g_upstream_count], upstream) < 0)
+            goto invalid;
+
+        g_upstream_count++;
+        route->count++;
+    }
+
+    if (!route->count)
+        goto invalid;
+
+    return 0;
+
+invalid:
+    fprintf(stderr, "invalid --proxy route: %s\n", spec);
+    errno = EINVAL;
+    return -1;
+}
+
+int proxy_init(void) {
+    for (int i = 0; i < g_config.proxy_route_count; i++) {
+        if (private_parse_route(g_config.proxy_routes[i]) < 0)
+            return -1;
+
+        const struct proxy_route *route = &g_routes[i];
+        printf("Proxying %.*s to %d upstream(s)\n", (int) route->prefix.len, route->prefix.ptr, route->count);
+    }
+
+    if (!g_route_count)
+        return 0;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, health_thread, NULL))
+        return -1;
+
+    pthread_detach(thread);
+
+    return 0;
+}
+
+// longest mounted prefix that `path` is under, NULL when none
+const struct proxy_route *proxy_route_for(const struct sized_str path) {
+    const struct proxy_route *match = NULL;
+
+    for (int i = 0; i < g_route_count; i++) {
+        const struct proxy_route *route = &g_routes[i];
+
+        if (path.len < route->prefix.len || memcmp(path.ptr, route->prefix.ptr, route->prefix.len)
+            || (match && match->prefix.len >= route->prefix.len))
+            continue;
+
+        if (route->prefix.len == 1 || path.len == route->prefix.len
+            || path.ptr[route->prefix.len] == '/' || path.ptr[route->prefix.len] == '?')
+            match = route;
+    }
+
+    return match;
+}
+
+// least outstanding requests among the healthy upstreams not tried yet, ties rotate; -1 when none is left
+static int private_pick(const struct proxy_route *route, const unsigned long long tried) {
+    const unsigned int start = t_next_pick++;
+    int best = -1, best_outstanding = INT_MAX;
+
+    for (int i = 0; i < route->count; i++) {
+        const int slot = (start + i) % route->count;
+        const struct upstream *upstream = &g_upstreams[route->first + slot];
+
+        if (tried >> slot & 1 || !atomic_load_explicit(&upstream->healthy, memory_order_relaxed))
+            continue;
+
+        const int outstanding = atomic_load_explicit(&upstream->outstanding, memory_order_relaxed);
+        if (outstanding < best_outstanding) {
+            best = slot;
+            best_outstanding = outstanding;
+        }
+    }
+
+    return best;
+}
+
+static int private_pool_take(const int upstream) {
+    struct upstream_pool *pool = &t_pools[upstream];
+
+    while (pool->count) {
+        const int fd = pool->fds[--pool->count];
+        char byte;
+
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return fd; // still open, and quiet
+
+        close(fd); // closed by the upstream in the meantime
+    }
+
+    return -1;
+}
+
+static void private_release(struct proxy_exchange *exchange, const int reusable) {
+    struct upstream_pool *pool = &t_pools[exchange->upstream];
+
+    if (reusable && exchange->keep_alive && pool->count < PROXY_POOL_SIZE)
+        pool->fds[pool->count++] = exchange->fd;
+    else
+        close(exchange->fd);
+
+    atomic_fetch_sub_explicit(&g_upstreams[exchange->upstream].outstanding, 1, memory_order_relaxed);
+    exchange->fd = -1;
+
+    return;
+}
+
+static int private_is_hop_header(const char *line, const size_t len) {
+    for (size_t i = 0; i < sizeof g_hop_headers / sizeof *g_hop_headers; i++) {
+        const size_t name_len = strlen(g_hop_headers[i]);
+
+        if (len >= name_len && !strncasecmp(line, g_hop_headers[i], name_len))
+            return 1;
+    }
+
+    return 0;
+}
+
+// value of header `line` if it is `name` (lowercase, with the colon), else an empty string
+static struct sized_str private_header_value(const char *line, const size_t len, const char *name) {
+    const size_t name_len = strlen(name);
+
+    if (len < name_len || strncasecmp(line, name, name_len))
+        return (struct sized_str) { 0 };
+
+    size_t start = name_len;
+    while (start < len && (line[start] == ' ' || line[start] == '\t'))
+        start++;
+
+    return (struct sized_str) { .ptr = (char *) line + start, .len = len - start };
+}
+
+static int private_contains_token(const struct sized_str value, const char *token) {
+    const size_t token_len = strlen(token);
+
+    for (size_t i = 0; i + token_len <= value.len; i++)
+        if (!strncasecmp(value.ptr + i, token, token_len))
+            return 1;
+
+    return 0;
+}
+
+// request line with the sanitized path, the client's headers minus hop-by-hop ones, and the body; the
+// client's framing is replaced by a Content-Length for the body actually forwarded (chunked requests are
+// refused before they get here, their body is never read)
+static struct sized_str private_build_request(const struct sized_str req_head, const struct sized_str path,
+    const struct sized_str body, struct arena *arena) {
+    const char *method_end = memchr(req_head.ptr, ' ', req_head.len);
+    const char *line = memchr(req_head.ptr, '\n', req_head.len);
+    const char *end = req_head.ptr + req_head.len;
+    int had_framing = 0;
+
+    char *out = arena_alloc(arena, req_head.len + path.len + body.len + sizeof " HTTP/1.1\r\n"
+        + sizeof "Content-Length: 18446744073709551615\r\n");
+    size_t len = method_end - req_head.ptr;
+
+    memcpy(out, req_head.ptr, len);
+    out[len++] = ' ';
+    memcpy(out + len, path.ptr, path.len);
+    len += path.len;
+    memcpy(out + len, " HTTP/1.1\r\n", 11);
+    len += 11;
+
+    for (line++; line < end; ) {
+        const char *line_end = memchr(line, '\n', end - line);
+        const size_t line_len = line_end ? (size_t) (line_end + 1 - line) : (size_t) (end - line);
+
+        if (line_len <= 2) // blank line, end of the headers
+            break;
+
+        if (private_header_value(line, line_len, "content-length:").ptr || private_header_value(line, line_len, "transfer-encoding:").ptr)
+            had_framing = 1;
+        else if (!private_is_hop_header(line, line_len)) {
+            memcpy(out + len, line, line_len);
+            len += line_len;
+        }
+
+        line += line_len;
+    }
+
+    if (body.len || had_framing) // an empty POST keeps its explicit zero
+        len += sprintf(out + len, "Content-Length: %zu\r\n", body.len);
+
+    memcpy(out + len, "\r\n", 2);
+    len += 2;
+    memcpy(out + len, body.ptr, body.len);
+    len += body.len;
+
+    return (struct sized_str) { .ptr = out, .len = len };
+}
+
+// 0 with the head parsed into `exchange`, 1 when the upstream closed before answering, -1 on error
+static int private_read_head(struct proxy_exchange *exchange, const int is_head, struct arena *arena) {
+    char *buf = arena_alloc(arena, PROXY_HEAD_MAX);
+    size_t len = 0, head_len;
+    const char *head_end;
+
+    while (1) { // informational responses (100 Continue, 103 Early Hints) are skipped
+        while (!(head_end = memmem(buf, len, "\r\n\r\n", 4))) {
+            if (len == PROXY_HEAD_MAX) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+
+            const ssize_t bytes_recvd = private_recv(exchange->fd, buf + len, PROXY_HEAD_MAX - len);
+            if (bytes_recvd <= 0) {
+                if (!bytes_recvd)
+                    errno = ECONNRESET;
+                return !bytes_recvd && !len ? 1 : -1;
+            }
+
+            len += bytes_recvd;
+        }
+
+        head_len = head_end + 4 - buf;
+
+        if (len < 12 || strncmp(buf, "HTTP/1.", 7) || buf[8] != ' ' || sscanf(buf + 9, "%3d", &exchange->status) != 1
+            || exchange->status < 100 || exchange->status > 999) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        if (exchange->status >= 200 || exchange->status == 101)
+            break;
+
+        memmove(buf, buf + head_len, len - head_len);
+        len -= head_len;
+    }
+
+    if (exchange->status == 101) { // Upgrade is never forwarded, so this was not asked for
+        errno = EPROTO;
+        return -1;
+    }
+
+    char *head = arena_alloc(arena, head_len + sizeof "Connection: close\r\n");
+    const char *line = memchr(buf, '\n', head_len) + 1;
+    size_t out_len = line - buf;
+    size_t content_length = 0;
+    int has_length = 0, chunked = 0;
+
+    // the client talks to us: our version and the upstream's status and reason
+    memcpy(head, "HTTP/1.1", 8);
+    memcpy(head + 8, buf + 8, out_len - 8);
+    exchange->keep_alive = buf[7] == '1'; // of the upstream connection, 1.1 unless told otherwise, 1.0 only if asked
+
+    while (line < head_end + 2) {
+        const size_t line_len = (const char *) memchr(line, '\n', head_end + 4 - line) + 1 - line;
+        struct sized_str value;
+
+        if ((value = private_header_value(line, line_len, "content-length:")).len) {
+            content_length = strtoull(value.ptr, NULL, 10);
+            has_length = 1;
+        } else if ((value = private_header_value(line, line_len, "transfer-encoding:")).len)
+            chunked = private_contains_token(value, "chunked");
+        else if ((value = private_header_value(line, line_len, "connection:")).len) {
+            if (private_contains_token(value, "close"))
+                exchange->keep_alive = 0;
+            else if (private_contains_token(value, "keep-alive"))
+                exchange->keep_alive = 1;
+        }
+
+        if (!private_is_hop_header(line, line_len)) {
+            memcpy(head + out_len, line, line_len);
+            out_len += line_len;
+        }
+
+        line += line_len;
+    }
+
+    exchange->body_start = (struct sized_str) { .ptr = buf + head_len, .len = len - head_len };
+
+    if (is_head || exchange->status == 204 || exchange->status == 304)
+        exchange->framing = PROXY_BODY_NONE;
+    else if (chunked)
+        exchange->framing = PROXY_BODY_CHUNKED;
+    else if (has_length)
+        exchange->framing = PROXY_BODY_LENGTH;
+    else {
+        exchange->framing = PROXY_BODY_UNTIL_CLOSE; // the client can only tell where it ends the same way
+        exchange->keep_alive = 0;
+        memcpy(head + out_len, "Connection: close\r\n", 19);
+        out_len += 19;
+    }
+
+    if (exchange->framing == PROXY_BODY_NONE && exchange->body_start.len) {
+        exchange->body_start.len = 0;
+        exchange->keep_alive = 0;
+    } else if (exchange->framing == PROXY_BODY_LENGTH) {
+        if (exchange->body_start.len > content_length) {
+            exchange->body_start.len = content_length;
+            exchange->keep_alive = 0;
+        }
+        exchange->remaining = content_length - exchange->body_start.len;
+    }
+
+    memcpy(head + out_len, "\r\n", 2);
+    exchange->head = (struct sized_str) { .ptr = head, .len = out_len + 2 };
+
+    return 0;
+}
+
+// Sends the request to the least busy healthy upstream of `route` and reads the response head. A pooled
+// connection the upstream closed meanwhile is retried on a fresh one; a failed connect ejects the upstream
+// and moves on to the next. 0 when `exchange` is ready for proxy_relay(), else the status to answer with
+// (`exchange->head` then holds the reason).
+int proxy_request(const struct proxy_route *route, const struct sized_str req_head, const struct sized_str path,
+    const struct sized_str body, const int is_head, struct proxy_exchange *exchange, struct arena *arena) {
+    if (!t_pools && !(t_pools = calloc(g_upstream_count, sizeof *t_pools)))
+        goto failed;
+
+    const struct sized_str request = private_build_request(req_head, path, body, arena);
+    unsigned long long tried = 0;
+    int slot, attempts = 0;
+
+    while ((slot = private_pick(route, tried)) >= 0 && attempts++ <= route->count) {
+        struct upstream *upstream = &g_upstreams[route->first + slot];
+
+        *exchange = (struct proxy_exchange) { .upstream = route->first + slot, .fd = private_pool_take(route->first + slot) };
+        const int reused = exchange->fd >= 0;
+
+        if (!reused && (exchange->fd = private_connect(upstream, g_config.io_timeout_ms)) < 0) {
+            private_set_health(upstream, 0, errno);
+            tried |= 1ULL << slot;
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&upstream->outstanding, 1, memory_order_relaxed);
+
+        int status = private_send_all(exchange->fd, NULL, request.ptr, request.len);
+        if (!status)
+            status = private_read_head(exchange, is_head, arena);
+
+        if (!status)
+            return 0;
+
+        const int error = errno;
+        private_release(exchange, 0);
+
+        if (reused && (status > 0 || error == EPIPE || error == ECONNRESET))
+            continue; // went stale in the pool, not the upstream's fault
+
+        *exchange = (struct proxy_exchange) {
+            .head = error == ETIMEDOUT ? (struct sized_str) { .ptr = "upstream timed out", .len = 18 }
+                : status > 0 ? (struct sized_str) { .ptr = "upstream closed the connection", .len = 30 }
+                : (struct sized_str) { .ptr = "invalid response from upstream", .len = 30 }
+        };
+
+        return error == ETIMEDOUT ? 504 : 502;
+    }
+
+    if (attempts) {
+        *exchange = (struct proxy_exchange) { .head = (struct sized_str) { .ptr = "upstream unreachable", .len = 20 } };
+        return 502;
+    }
+
+failed:
+    *exchange = (struct proxy_exchange) { .head = (struct sized_str) { .ptr = "no healthy upstream", .len = 19 } };
+    return 503;
+}
+
+// 1 once the last chunk and its trailers went by, -1 on a malformed size; chunk data is never looked at
+static int private_chunked_advance(struct chunk_parser *parser, const char *data, const size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        const char c = data[i];
+
+        if (parser->state == CHUNK_DONE) {
+            parser->overrun = 1;
+            break;
+        }
+
+        switch (parser->state) {
+            case CHUNK_SIZE:
+                if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
+                    if (parser->remaining >> (sizeof parser->remaining * 8 - 4))
+                        return -1;
+                    parser->remaining = parser->remaining * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+                    break;
+                }
+
+                parser->state = CHUNK_EXTENSION;
+                // fallthrough
+            case CHUNK_EXTENSION:
+                if (c == '\n')
+                    parser->state = parser->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+                break;
+            case CHUNK_DATA: {
+                const size_t skipped = len - i < parser->remaining ? len - i : parser->remaining;
+
+                i += skipped - 1;
+                if (!(parser->remaining -= skipped))
+                    parser->state = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (c == '\n')
+                    parser->state = CHUNK_SIZE;
+                break;
+            case CHUNK_TRAILER_START:
+                if (c == '\n')
+                    parser->state = CHUNK_DONE;
+                else if (c != '\r')
+                    parser->state = CHUNK_TRAILER;
+                break;
+            case CHUNK_TRAILER:
+                if (c == '\n')
+                    parser->state = CHUNK_TRAILER_START;
+                break;
+            case CHUNK_DONE:
+                break;
+        }
+    }
+
+    return parser->state == CHUNK_DONE;
+}
+
+// through a user-space buffer: chunked bodies, whose framing has to be followed, and splice() fallback
+static int private_relay_copy(struct proxy_exchange *exchange, const int client_fd, struct tls_conn *tls, struct chunk_parser *parser) {
+    char buf[PROXY_COPY_BUFFER];
+
+    while (exchange->framing != PROXY_BODY_LENGTH || exchange->remaining) {
+        const size_t wanted = exchange->framing == PROXY_BODY_LENGTH && exchange->remaining < sizeof buf ? exchange->remaining : sizeof buf;
+        const ssize_t bytes_recvd = private_recv(exchange->fd, buf, wanted);
+
+        if (!bytes_recvd && exchange->framing == PROXY_BODY_UNTIL_CLOSE)
+            return 0;
+
+        if (bytes_recvd <= 0) {
+            if (!bytes_recvd)
+                errno = ECONNRESET; // body cut short
+            return -1;
+        }
+
+        int done = 0;
+
+        if (exchange->framing == PROXY_BODY_LENGTH)
+            exchange->remaining -= bytes_recvd;
+        else if (exchange->framing == PROXY_BODY_CHUNKED && (done = private_chunked_advance(parser, buf, bytes_recvd)) < 0) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        if (private_send_all(client_fd, tls, buf, bytes_recvd) < 0)
+            return -1;
+
+        if (done)
+            return 0;
+    }
+
+    return 0;
+}
+
+// an empty pipe back as the worker's spare, unless another coroutine put one there meanwhile
+static void private_pipe_give(int pipe_fds[2]) {
+    if (t_pipe[0] < 0) {
+        t_pipe[0] = pipe_fds[0];
+        t_pipe[1] = pipe_fds[1];
+        return;
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    return;
+}
+
+// Upstream socket -> this worker's pipe -> client socket, the body never enters user space. 1 when
+// splice() is not supported for this pair of sockets and nothing was moved yet.
+static int private_relay_splice(struct proxy_exchange *exchange, const int client_fd) {
+    int pipe_fds[2] = { t_pipe[0], t_pipe[1] };
+
+    t_pipe[0] = t_pipe[1] = -1;
+
+    if (pipe_fds[0] < 0) {
+        if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0)
+            return 1;
+
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+    }
+
+    int moved = 0;
+
+    while (exchange->framing == PROXY_BODY_UNTIL_CLOSE || exchange->remaining) {
+        const size_t wanted = exchange->framing == PROXY_BODY_LENGTH && exchange->remaining < PROXY_PIPE_SIZE ? exchange->remaining : PROXY_PIPE_SIZE;
+        ssize_t in_pipe = splice(exchange->fd, NULL, pipe_fds[1], NULL, wanted, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (in_pipe < 0) {
+            if (errno == EINVAL && !moved)
+                goto unsupported;
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && !coro_wait_fd(exchange->fd, POLLIN, g_config.io_timeout_ms)))
+                continue;
+            goto failed;
+        }
+
+        if (!in_pipe) {
+            if (exchange->framing == PROXY_BODY_UNTIL_CLOSE)
+                break;
+
+            errno = ECONNRESET; // body cut short
+            goto failed;
+        }
+
+        moved = 1;
+        if (exchange->framing == PROXY_BODY_LENGTH)
+            exchange->remaining -= in_pipe;
+
+        while (in_pipe) {
+            const ssize_t out_of_pipe = splice(pipe_fds[0], NULL, client_fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (out_of_pipe < 0) {
+                if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && !coro_wait_fd(client_fd, POLLOUT, g_config.io_timeout_ms)))
+                    continue;
+                goto failed;
+            }
+
+            in_pipe -= out_of_pipe;
+        }
+    }
+
+    private_pipe_give(pipe_fds);
+
+    return 0;
+
+unsupported:
+    private_pipe_give(pipe_fds);
+
+    return 1;
+
+failed:
+    // may still hold part of this body, a fresh pipe for the next one
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    return -1;
+}
+
+// Streams the response to the client: head, the body bytes read along with it, then the rest straight
+// from the upstream socket. The upstream connection goes back to this worker's pool when the response
+// ended cleanly. -1 when either side failed, the client connection has to be dropped then. Over TLS the
+// body can only be spliced when the kernel encrypts it.
+int proxy_relay(struct proxy_exchange *exchange, const int client_fd, struct tls_conn *tls) {
+    struct chunk_parser parser = { .state = CHUNK_SIZE };
+    int done = exchange->framing == PROXY_BODY_NONE || (exchange->framing == PROXY_BODY_LENGTH && !exchange->remaining);
+    int status = -1;
+
+    if (exchange->framing == PROXY_BODY_CHUNKED && (done = private_chunked_advance(&parser, exchange->body_start.ptr, exchange->body_start.len)) < 0) {
+        errno = EPROTO;
+        goto finished;
+    }
+
+    // the rest of the body follows in separate writes, which must not wait on the client's delayed ACK
+    const int nodelay = 1;
+    if (!g_config.tcp_nodelay) // otherwise inherited from the listener
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+
+    if (private_send_two(client_fd, tls, exchange->head, exchange->body_start) < 0)
+        goto finished;
+
+    if (done)
+        status = 0;
+    else if (exchange->framing == PROXY_BODY_CHUNKED || !tls_kernel_send(tls) || (status = private_relay_splice(exchange, client_fd)) > 0)
+        status = private_relay_copy(exchange, client_fd, tls, &parser);
+
+finished:
+    private_release(exchange, !status && !parser.overrun);
+
+    return status;
+}
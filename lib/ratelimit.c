@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+
+#include "config.h"
+#include "lib.h"
+#include "ratelimit.h"
+
+#define RATELIMIT_SHARDS 64 // picked by the top bits of the key
+#define RATELIMIT_SHARD_SLOTS 1024 // 64 x 1024 x 32 bytes: 2 MiB for the whole table
+#define RATELIMIT_PROBE 8 // slots looked at per lookup, the eviction window
+#define STATS_REPORT_INTERVAL_S 10
+
+// `state` packs the bucket, so refilling and taking a token is a single CAS: milli-tokens in the upper
+// half, the last refill (ms since ratelimit_init, wrapping) in the lower half, which also serves as the
+// last time the client was seen.
+struct client {
+    _Atomic uint64_t key; // 0: free slot (slots are only ever reused, never emptied)
+    _Atomic uint64_t state;
+    atomic_uint conns;
+    char padding[12]; // two per cache line
+};
+
+static struct client (*g_shards)[RATELIMIT_SHARD_SLOTS];
+static uint64_t g_seed;
+static uint64_t g_burst_milli;
+static struct timespec g_start;
+
+static struct {
+    atomic_ulong limited;
+    atomic_ulong refused;
+    atomic_ulong evicted;
+    atomic_long last_report;
+} g_stats;
+
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (ts.tv_sec - g_start.tv_sec) * 1000 + (ts.tv_nsec - g_start.tv_nsec) / 1000000;
+}
+
+// splitmix64 finalizer, keyed with a random seed so clients cannot aim for one probe window
+static uint64_t mix(uint64_t value) {
+    value ^= g_seed;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+static void private_report(void) {
+    const long now = time(NULL);
+    long last = atomic_load_explicit(&g_stats.last_report, memory_order_relaxed);
+
+    if (now - last < STATS_REPORT_INTERVAL_S || !atomic_compare_exchange_strong(&g_stats.last_report, &last, now))
+        return;
+
+    print_to_log("\033[1;35mrate limit\033[0m %lu request(s) answered 429, %lu connection(s) refused, %lu client(s) evicted so far",
+        atomic_load(&g_stats.limited), atomic_load(&g_stats.refused), atomic_load(&g_stats.evicted));
+
+    return;
+}
+
+int ratelimit_init(void) {
+    if (!g_config.rate_limit && !g_config.max_conns_per_ip)
+        return 0;
+
+    if (g_config.rate_prefix4 > 32 || g_config.rate_prefix6 > 128) {
+        fprintf(stderr, "--rate-prefix4 is at most 32, --rate-prefix6 at most 128\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (getrandom(&g_seed, sizeof g_seed, 0) != sizeof g_seed)
+        return -1;
+
+    // zeroed pages are only backed once a client hashes there
+    if (!(g_shards = calloc(RATELIMIT_SHARDS, sizeof *g_shards)))
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &g_start);
+    g_burst_milli = (uint64_t) (g_config.rate_burst ? g_config.rate_burst : g_config.rate_limit) * 1000;
+
+    return 0;
+}
+
+// the client `addr` belongs to, 0 when limits are off or it is not an IP peer
+uint64_t ratelimit_key(const struct sockaddr *addr) {
+    uint64_t prefix;
+
+    if (!g_shards)
+        return 0;
+
+    if (addr->sa_family == AF_INET) {
+        const uint32_t ip = ntohl(((const struct sockaddr_in *) addr)->sin_addr.s_addr);
+        prefix = g_config.rate_prefix4 ? ip & ~0U << (32 - g_config.rate_prefix4) : 0;
+    } else if (addr->sa_family == AF_INET6) {
+        const uint8_t *bytes = ((const struct sockaddr_in6 *) addr)->sin6_addr.s6_addr;
+        uint64_t high = 0, low = 0;
+
+        for (int i = 0; i < 8; i++) {
+            high = high << 8 | bytes[i];
+            low = low << 8 | bytes[i + 8];
+        }
+
+        if (!high && low >> 32 == 0xffff) // v4-mapped, from a dual-stack listener
+            prefix = g_config.rate_prefix4 ? (uint32_t) low & ~0U << (32 - g_config.rate_prefix4) : 0;
+        else {
+            const int bits = g_config.rate_prefix6;
+            high &= bits >= 64 ? ~0ULL : bits ? ~0ULL << (64 - bits) : 0;
+            low &= bits <= 64 ? 0 : bits == 128 ? ~0ULL : ~0ULL << (128 - bits);
+            prefix = mix(high) ^ low;
+        }
+    } else
+        return 0;
+
+    const uint64_t key = mix(prefix);
+
+    return key ? key : 1;
+}
+
+// the client's slot, claiming one for it when `create`; NULL when not found
+static struct client *private_find(const uint64_t key, const int create) {
+    struct client *shard = g_shards[key >> 58];
+    const unsigned int start = key & (RATELIMIT_SHARD_SLOTS - 1);
+
+    for (int i = 0; i < RATELIMIT_PROBE; i++) {
+        struct client *client = &shard[(start + i) & (RATELIMIT_SHARD_SLOTS - 1)];
+        uint64_t current = atomic_load_explicit(&client->key, memory_order_acquire);
+
+        if (current == key)
+            return client;
+
+        if (current)
+            continue;
+
+        if (!create)
+            return NULL; // slots never go back to free, it would have been here
+
+        if (atomic_compare_exchange_strong(&client->key, &current, key)) {
+            atomic_store_explicit(&client->state, g_burst_milli << 32 | now_ms(), memory_order_relaxed);
+            return client;
+        }
+
+        if (current == key) // claimed by another thread just now
+            return client;
+    }
+
+    if (!create)
+        return NULL;
+
+    // window full: take over the client seen least recently that has no connection open
+    const uint32_t now = now_ms();
+    struct client *victim = NULL;
+    uint32_t victim_idle = 0;
+
+    for (int i = 0; i < RATELIMIT_PROBE; i++) {
+        struct client *client = &shard[(start + i) & (RATELIMIT_SHARD_SLOTS - 1)];
+        const uint32_t idle = now - (uint32_t) atomic_load_explicit(&client->state, memory_order_relaxed);
+
+        if (!atomic_load_explicit(&client->conns, memory_order_relaxed) && (!victim || idle > victim_idle)) {
+            victim = client;
+            victim_idle = idle;
+        }
+    }
+
+    if (!victim)
+        return NULL; // every client here holds connections, let this one through unaccounted
+
+    uint64_t current = atomic_load_explicit(&victim->key, memory_order_relaxed);
+    if (!atomic_compare_exchange_strong(&victim->key, &current, key))
+        return current == key ? victim : NULL;
+
+    atomic_store_explicit(&victim->state, g_burst_milli << 32 | now, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.evicted, 1, memory_order_relaxed);
+
+    return victim;
+}
+
+// -1 when the client already has --max-conns-per-ip connections open (accept thread)
+int ratelimit_conn_open(const uint64_t key) {
+    if (!key || !g_config.max_conns_per_ip)
+        return 0;
+
+    struct client *client = private_find(key, 1);
+
+    if (!client)
+        return 0;
+
+    if (atomic_fetch_add_explicit(&client->conns, 1, memory_order_relaxed) >= (unsigned int) g_config.max_conns_per_ip) {
+        atomic_fetch_sub_explicit(&client->conns, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_stats.refused, 1, memory_order_relaxed);
+        private_report();
+        return -1;
+    }
+
+    // the eviction clock; with --rate-limit each request moves it, along with the refill it also stands for
+    if (!g_config.rate_limit)
+        atomic_store_explicit(&client->state, now_ms(), memory_order_relaxed);
+
+    return 0;
+}
+
+void ratelimit_conn_close(const uint64_t key) {
+    if (!key || !g_config.max_conns_per_ip)
+        return;
+
+    struct client *client = private_find(key, 0);
+    unsigned int conns = client ? atomic_load_explicit(&client->conns, memory_order_relaxed) : 0;
+
+    while (conns && !atomic_compare_exchange_weak_explicit(&client->conns, &conns, conns - 1, memory_order_relaxed, memory_order_relaxed))
+        ;
+
+    return;
+}
+
+// takes a token from the client's bucket, 0 when it is empty (answer 429)
+int ratelimit_allow(const uint64_t key) {
+    if (!key || !g_config.rate_limit)
+        return 1;
+
+    struct client *client = private_find(key, 1);
+
+    if (!client)
+        return 1;
+
+    const uint32_t now = now_ms();
+    uint64_t state = atomic_load_explicit(&client->state, memory_order_relaxed);
+    uint64_t refilled, next;
+
+    do {
+        // milli-tokens per ms is tokens per second
+        refilled = (state >> 32) + (uint64_t) (uint32_t) (now - (uint32_t) state) * g_config.rate_limit;
+        if (refilled > g_burst_milli)
+            refilled = g_burst_milli;
+
+        next = (refilled >= 1000 ? refilled - 1000 : refilled) << 32 | now;
+    } while (!atomic_compare_exchange_weak_explicit(&client->state, &state, next, memory_order_relaxed, memory_order_relaxed));
+
+    if (refilled >= 1000)
+        return 1;
+
+    atomic_fetch_add_explicit(&g_stats.limited, 1, memory_order_relaxed);
+    private_report();
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "rcu.h"
+
+#define RCU_MAX_THREADS 1024
+
+// odd while inside a read-side critical section, padded so readers never share a cache line
+struct rcu_reader {
+    _Alignas(64) _Atomic uint64_t state;
+};
+
+static struct rcu_reader g_readers[RCU_MAX_THREADS];
+static _Atomic int g_reader_count;
+static __thread _Atomic uint64_t *t_state;
+static __thread int t_depth; // read sections open on this thread, from every coroutine it runs
+
+void rcu_register_thread(void) {
+    const int index = atomic_fetch_add(&g_reader_count, 1);
+
+    if (index >= RCU_MAX_THREADS) {
+        fprintf(stderr, "\033[1;31merror:\033[0m rcu: too many reader threads, reclamation will not wait for this one\n");
+        atomic_fetch_sub(&g_reader_count, 1);
+        return;
+    }
+
+    t_state = &g_readers[index].state;
+
+    return;
+}
+
+// Coroutines of one worker can be inside their read sections at the same time, so only the first one
+// marks the thread busy and only the last one out marks it quiescent again.
+void rcu_read_lock(void) {
+    if (!t_state || t_depth++)
+        return;
+
+    // seq_cst: the state change must be visible before any protected pointer is loaded
+    atomic_store(t_state, atomic_load_explicit(t_state, memory_order_relaxed) + 1);
+
+    return;
+}
+
+void rcu_read_unlock(void) {
+    if (!t_state || --t_depth)
+        return;
+
+    atomic_store_explicit(t_state, atomic_load_explicit(t_state, memory_order_relaxed) + 1, memory_order_release);
+
+    return;
+}
+
+void rcu_synchronize(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+
+    const int reader_count = atomic_load(&g_reader_count);
+    const struct timespec backoff = { .tv_nsec = 1000000 };
+
+    for (int i = 0; i < reader_count && i < RCU_MAX_THREADS; i++) {
+        const uint64_t snapshot = atomic_load(&g_readers[i].state);
+
+        if (!(snapshot & 1)) // quiescent, cannot hold the old pointer
+            continue;
+
+        while (atomic_load(&g_readers[i].state) == snapshot)
+            nanosleep(&backoff, NULL);
+    }
+
+    return;
+}
@@ -0,0 +1,80 @@
+#include <string.h>
+
+#include "recv_buffer.h"
+#include "slab.h"
+
+#define CLASS_COUNT 5
+
+static const uint32_t g_class_caps[CLASS_COUNT] = { 256, 1024, RECV_BUFFER_SIZE, 16 * 1024, RECV_BUFFER_MAX };
+static struct slab *g_classes[CLASS_COUNT];
+
+int recv_buffer_init(void) {
+    for (int i = 0; i < CLASS_COUNT; i++)
+        if (!(g_classes[i] = slab_new(sizeof(struct recv_buffer) + g_class_caps[i])))
+            return -1;
+
+    return 0;
+}
+
+static int private_class(const size_t size) {
+    for (int i = 0; i < CLASS_COUNT; i++)
+        if (size <= g_class_caps[i])
+            return i;
+
+    return -1;
+}
+
+// Moves the unread bytes into the smallest class holding them and at least `size` bytes; `buffer` may
+// be NULL for a new empty one. Returns NULL (the old buffer untouched) beyond RECV_BUFFER_MAX or when out of
+// memory, the same buffer when it already is of that class.
+struct recv_buffer *recv_buffer_fit(struct recv_buffer *buffer, const size_t size) {
+    const size_t len = buffer ? buffer->len : 0;
+    const int class = private_class(size > len ? size : len);
+
+    if (class < 0)
+        return NULL;
+
+    if (buffer && buffer->cap == g_class_caps[class])
+        return buffer;
+
+    struct recv_buffer *fitted = slab_alloc(g_classes[class]);
+
+    if (!fitted)
+        return NULL;
+
+    fitted->cap = g_class_caps[class];
+    fitted->len = len;
+
+    if (buffer) {
+        memcpy(fitted->data, buffer->data, len);
+        recv_buffer_put(&buffer);
+    }
+
+    return fitted;
+}
+
+void recv_buffer_put(struct recv_buffer **p_buffer) {
+    if (!*p_buffer)
+        return;
+
+    slab_free(g_classes[private_class((*p_buffer)->cap)], *p_buffer);
+    *p_buffer = NULL;
+
+    return;
+}
+
+// buffers in use, by connections and by the workers reading into them
+long recv_buffer_attached(size_t *bytes) {
+    long count = 0;
+
+    *bytes = 0;
+
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        const long in_use = slab_in_use(g_classes[i]);
+
+        count += in_use;
+        *bytes += in_use * slab_object_size(g_classes[i]);
+    }
+
+    return count;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+#define SLAB_MAX_CACHES 8
+#define SLAB_CHUNK_SIZE (256 * 1024) // mapped at a time, at least 16 objects
+#define MAGAZINE_SIZE 32 // free objects a thread keeps per cache, half of them move at once
+
+struct slab {
+    size_t object_size;
+    size_t chunk_size;
+    int index; // of this thread's magazine
+
+    pthread_mutex_t lock;
+    void *free; // shared free list, linked through the first word of each object
+    char *carve, *carve_end; // never handed out yet, in the newest chunk
+
+    atomic_long in_use;
+    atomic_size_t reserved;
+};
+
+static __thread struct magazine {
+    int count;
+    void *objects[MAGAZINE_SIZE];
+} t_magazines[SLAB_MAX_CACHES];
+
+static atomic_int g_slab_count;
+
+struct slab *slab_new(const size_t object_size) {
+    const int index = atomic_fetch_add(&g_slab_count, 1);
+    struct slab *slab;
+
+    if (index >= SLAB_MAX_CACHES || !(slab = malloc(sizeof *slab)))
+        return NULL;
+
+    const size_t size = (object_size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    const size_t chunk_size = 16 * size > SLAB_CHUNK_SIZE ? 16 * size : SLAB_CHUNK_SIZE;
+
+    *slab = (struct slab) {
+        .object_size = size,
+        .chunk_size = chunk_size,
+        .index = index,
+        .lock = PTHREAD_MUTEX_INITIALIZER
+    };
+
+    return slab;
+}
+
+// with the lock held; NULL when out of memory
+static void *private_take(struct slab *slab) {
+    void *object = slab->free;
+
+    if (object) {
+        slab->free = *(void **) object;
+        return object;
+    }
+
+    if (slab->carve == slab->carve_end) {
+        void *chunk = mmap(NULL, slab->chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (chunk == MAP_FAILED)
+            return NULL;
+
+        slab->carve = chunk;
+        slab->carve_end = slab->carve + slab->chunk_size / slab->object_size * slab->object_size;
+        atomic_fetch_add_explicit(&slab->reserved, slab->chunk_size, memory_order_relaxed);
+    }
+
+    object = slab->carve;
+    slab->carve += slab->object_size;
+
+    return object;
+}
+
+void *slab_alloc(struct slab *slab) {
+    struct magazine *magazine = &t_magazines[slab->index];
+
+    if (!magazine->count) {
+        pthread_mutex_lock(&slab->lock);
+
+        void *object;
+        while (magazine->count < MAGAZINE_SIZE / 2 && (object = private_take(slab)))
+            magazine->objects[magazine->count++] = object;
+
+        pthread_mutex_unlock(&slab->lock);
+
+        if (!magazine->count)
+            return NULL;
+    }
+
+    atomic_fetch_add_explicit(&slab->in_use, 1, memory_order_relaxed);
+
+    return magazine->objects[--magazine->count];
+}
+
+void slab_free(struct slab *slab, void *object) {
+    struct magazine *magazine = &t_magazines[slab->index];
+
+    if (!object)
+        return;
+
+    if (magazine->count == MAGAZINE_SIZE) {
+        pthread_mutex_lock(&slab->lock);
+
+        while (magazine->count > MAGAZINE_SIZE / 2) {
+            void *spilled = magazine->objects[--magazine->count];
+            *(void **) spilled = slab->free;
+            slab->free = spilled;
+        }
+
+        pthread_mutex_unlock(&slab->lock);
+    }
+
+    magazine->objects[magazine->count++] = object;
+    atomic_fetch_sub_explicit(&slab->in_use, 1, memory_order_relaxed);
+
+    return;
+}
+
+size_t slab_object_size(const struct slab *slab) {
+    return slab->object_size;
+}
+
+long slab_in_use(const struct slab *slab) {
+    return atomic_load_explicit(&slab->in_use, memory_order_relaxed);
+}
+
+// bytes mapped, including free objects and the part of the newest chunk not touched yet
+size_t slab_reserved(const struct slab *slab) {
+    return atomic_load_explicit(&slab->reserved, memory_order_relaxed);
+}
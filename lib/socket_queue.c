@@ -1,42 +1,130 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
-#define QUEUELEN 5
+#include "socket_queue.h"
 
-static int queue_size, q_l, q_r;
-static int socket_queue[QUEUELEN];
+struct queued_socket {
+    int fd;
+    struct timespec enqueued_at;
+};
 
-static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t queue_cond_full = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t queue_cond_empty = PTHREAD_COND_INITIALIZER;
+struct socket_queue {
+    int capacity;
+    int queue_size, q_l, q_r;
 
-void enqueue(int socket_fd) {
-    pthread_mutex_lock(&queue_lock);
+    pthread_mutex_t lock;
+    pthread_cond_t cond_full;
+    int event_fd; // semaphore, one count per queued socket: readable while a worker has something to take
 
-    if (queue_size == QUEUELEN)
-        pthread_cond_wait(&queue_cond_full, &queue_lock);
+    struct queued_socket sockets[];
+};
 
-    socket_queue[q_r] = socket_fd;
-    queue_size++;
-    q_r = (q_r + 1) % QUEUELEN;
+struct socket_queue *socket_queue_new(const int capacity) {
+    struct socket_queue *queue = malloc(sizeof *queue + capacity * sizeof *queue->sockets);
 
-    pthread_cond_signal(&queue_cond_empty);
-    pthread_mutex_unlock(&queue_lock);
+    if (queue == NULL)
+        return NULL;
+
+    *queue = (struct socket_queue) {
+        .capacity = capacity,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond_full = PTHREAD_COND_INITIALIZER,
+        .event_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC)
+    };
+
+    if (queue->event_fd < 0) {
+        free(queue);
+        return NULL;
+    }
+
+    return queue;
+}
+
+// caller holds the lock and has checked there is room; the count is posted after the socket is in, so a
+// worker that takes a count always finds one
+static void private_push(struct socket_queue *queue, int socket_fd) {
+    const uint64_t one = 1;
+
+    queue->sockets[queue->q_r].fd = socket_fd;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &queue->sockets[queue->q_r].enqueued_at);
+    queue->queue_size++;
+    queue->q_r = (queue->q_r + 1) % queue->capacity;
+
+    if (write(queue->event_fd, &one, sizeof one) < 0) // only on counter overflow, far beyond any queue
+        perror("\033[1;31merror:\033[0m eventfd write failed, a queued socket may wait");
 
     return;
 }
 
-int dequeue(void) {
-    pthread_mutex_lock(&queue_lock);
+void enqueue(struct socket_queue *queue, int socket_fd) {
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->queue_size == queue->capacity)
+        pthread_cond_wait(&queue->cond_full, &queue->lock);
+
+    private_push(queue, socket_fd);
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return;
+}
+
+// never blocks the caller, -1 when the queue is full
+int try_enqueue(struct socket_queue *queue, int socket_fd) {
+    pthread_mutex_lock(&queue->lock);
+
+    const int is_full = queue->queue_size == queue->capacity;
+    if (!is_full)
+        private_push(queue, socket_fd);
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return is_full ? -1 : 0;
+}
+
+// never blocks, -1 when another worker was quicker (wait for socket_queue_fd() to be readable)
+int dequeue(struct socket_queue *queue) {
+    uint64_t count;
+
+    if (read(queue->event_fd, &count, sizeof count) != sizeof count)
+        return -1;
+
+    pthread_mutex_lock(&queue->lock);
+
+    const int retval = queue->sockets[queue->q_l].fd;
+    queue->queue_size--;
+    queue->q_l = (queue->q_l + 1) % queue->capacity;
+
+    pthread_cond_signal(&queue->cond_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return retval;
+}
+
+int socket_queue_fd(const struct socket_queue *queue) {
+    return queue->event_fd;
+}
+
+// how long the oldest queued socket has been waiting for a worker (0 when empty)
+long socket_queue_wait_ms(struct socket_queue *queue) {
+    struct timespec now;
+    long retval = 0;
+
+    pthread_mutex_lock(&queue->lock);
 
-    if (!queue_size)
-        pthread_cond_wait(&queue_cond_empty, &queue_lock);
+    if (queue->queue_size) {
+        const struct timespec *oldest = &queue->sockets[queue->q_l].enqueued_at;
 
-    const int retval = socket_queue[q_l];
-    queue_size--;
-    q_l = (q_l + 1) % QUEUELEN;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        retval = (now.tv_sec - oldest->tv_sec) * 1000 + (now.tv_nsec - oldest->tv_nsec) / 1000000;
+    }
 
-    pthread_cond_signal(&queue_cond_full);
-    pthread_mutex_unlock(&queue_lock);
+    pthread_mutex_unlock(&queue->lock);
 
     return retval;
 }
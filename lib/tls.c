@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "lib.h"
+#include "tls.h"
+
+#ifdef HTTP_TLS
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define TLS_RECORD_MAX 16384 // plaintext per record, what one user-space write encrypts
+#define TLS_TICKETS 1 // session tickets sent after a full handshake, OpenSSL's default is 2
+
+struct tls_conn {
+    SSL *ssl;
+    int kernel_send; // kTLS took over this direction: the socket carries plaintext
+    int kernel_recv;
+    int unflushed; // bytes of a record already counted as sent, still in OpenSSL's buffer
+    int failed; // no close_notify after a fatal error
+};
+
+static SSL_CTX *g_ctx;
+static atomic_ulong g_handshakes, g_resumed, g_failed, g_kernel_send, g_kernel_recv;
+
+// a record's plaintext, gathered from several buffers or read from a file
+static __thread char t_record[TLS_RECORD_MAX];
+
+// the kernel's tls module refuses a socket that is not connected yet (ENOTCONN), ENOENT means there is none
+static int private_kernel_tls_available(void) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return 0;
+
+    const int available = !setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof "tls") || errno != ENOENT;
+    close(fd);
+
+    return available;
+}
+
+int tls_init(void) {
+    int wanted = 0;
+
+    for (int i = 0; i < g_config.listen_count; i++)
+        wanted |= g_config.listen_tls[i];
+
+    if (!wanted)
+        return 0;
+
+    if (!g_config.tls_cert || !g_config.tls_key) {
+        fprintf(stderr, "--tls-listen needs --tls-cert and --tls-key\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(g_ctx = SSL_CTX_new(TLS_server_method())))
+        goto failed;
+
+    SSL_CTX_set_min_proto_version(g_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(g_ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF | (g_config.ktls ? SSL_OP_ENABLE_KTLS : 0));
+
+    // a write takes at most one record and may be retried from another buffer (see private_write()); the
+    // buffers of an idle connection go back to the allocator
+    SSL_CTX_set_mode(g_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // resumption: stateless tickets for TLS 1.3 and the TLS 1.2 clients that take them, the server-side
+    // session cache for the others; the ticket key lives as long as the process
+    SSL_CTX_set_session_id_context(g_ctx, (const unsigned char *) "http_server", sizeof "http_server" - 1);
+    SSL_CTX_set_session_cache_mode(g_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_num_tickets(g_ctx, TLS_TICKETS);
+
+    if (SSL_CTX_use_certificate_chain_file(g_ctx, g_config.tls_cert) != 1
+        || SSL_CTX_use_PrivateKey_file(g_ctx, g_config.tls_key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(g_ctx) != 1)
+        goto failed;
+
+    if (!g_config.ktls)
+        printf("TLS records are encrypted in user space (--no-ktls)\n");
+    else if (private_kernel_tls_available())
+        printf("TLS records are handed to the kernel after each handshake (kTLS), where the cipher allows\n");
+    else
+        printf("TLS records are encrypted in user space: kernel TLS is not available (modprobe tls)\n");
+
+    return 0;
+
+failed:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(g_ctx);
+    g_ctx = NULL;
+    errno = EINVAL;
+    return -1;
+}
+
+struct tls_conn *tls_conn_new(const int fd) {
+    struct tls_conn *tls = calloc(1, sizeof *tls);
+
+    if (!tls)
+        return NULL;
+
+    if (!(tls->ssl = SSL_new(g_ctx)) || SSL_set_fd(tls->ssl, fd) != 1) {
+        ERR_clear_error();
+        SSL_free(tls->ssl);
+        free(tls);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return tls;
+}
+
+// handshakes so far and how many moved to the kernel, when they changed (poller thread)
+void tls_report(void) {
+    static unsigned long last_handshakes, last_failed;
+    const unsigned long handshakes = atomic_load(&g_handshakes), failed = atomic_load(&g_failed);
+
+    if (handshakes == last_handshakes && failed == last_failed)
+        return;
+
+    last_handshakes = handshakes;
+    last_failed = failed;
+
+    print_to_log("tls: %lu handshake(s), %lu resumed, %lu failed; kernel TLS for %lu send and %lu receive side(s)",
+        handshakes, atomic_load(&g_resumed), failed, atomic_load(&g_kernel_send), atomic_load(&g_kernel_recv));
+
+    return;
+}
+
+// -1 with errno for a failed call; 0 when the peer closed, as recv() has it
+static ssize_t private_failed(struct tls_conn *tls, const int ret) {
+    switch (SSL_get_error(tls->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN: // close_notify, or a plain close (SSL_OP_IGNORE_UNEXPECTED_EOF)
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (!errno)
+                errno = ECONNRESET;
+            break;
+        default:
+            errno = EPROTO;
+    }
+
+    tls->failed = 1;
+    ERR_clear_error();
+
+    return -1;
+}
+
+// 0: done, POLLIN or POLLOUT: call again once the socket is ready, -1: failed
+int tls_handshake(struct tls_conn *tls) {
+    ERR_clear_error();
+
+    const int ret = SSL_accept(tls->ssl);
+
+    if (ret == 1) {
+        tls->kernel_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) > 0;
+        tls->kernel_recv = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) > 0;
+
+        atomic_fetch_add_explicit(&g_handshakes, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_resumed, SSL_session_reused(tls->ssl), memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_kernel_send, tls->kernel_send, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_kernel_recv, tls->kernel_recv, memory_order_relaxed);
+        return 0;
+    }
+
+    switch (SSL_get_error(tls->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return POLLIN;
+        case SSL_ERROR_WANT_WRITE:
+            return POLLOUT;
+    }
+
+    if (!private_failed(tls, ret))
+        errno = ECONNRESET; // closed halfway through
+
+    atomic_fetch_add_explicit(&g_failed, 1, memory_order_relaxed);
+
+    return -1;
+}
+
+// close_notify goes out if the socket takes it right away, nobody waits for the peer's
+void tls_conn_free(struct tls_conn **p_tls) {
+    struct tls_conn *tls = *p_tls;
+
+    if (!tls)
+        return;
+
+    ERR_clear_error();
+    if (!tls->failed && SSL_is_init_finished(tls->ssl))
+        SSL_shutdown(tls->ssl);
+
+    ERR_clear_error();
+    SSL_free(tls->ssl);
+    free(tls);
+    *p_tls = NULL;
+
+    return;
+}
+
+// decrypted bytes the socket's readiness does not tell about
+int tls_pending(const struct tls_conn *tls) {
+    return tls && !tls->kernel_recv && SSL_has_pending(tls->ssl);
+}
+
+// 1 when writes go straight to the socket: no TLS, or kTLS encrypts them
+int tls_kernel_send(const struct tls_conn *tls) {
+    return !tls || tls->kernel_send;
+}
+
+int tls_kernel_recv(const struct tls_conn *tls) {
+    return !tls || tls->kernel_recv;
+}
+
+ssize_t tls_recv(struct tls_conn *tls, const int fd, void *buf, const size_t len, const int flags) {
+    if (tls_kernel_recv(tls))
+        return recv(fd, buf, len, flags);
+
+    ERR_clear_error();
+
+    const int ret = flags & MSG_PEEK ? SSL_peek(tls->ssl, buf, (int) len) : SSL_read(tls->ssl, buf, (int) len);
+
+    return ret > 0 ? ret : private_failed(tls, ret);
+}
+
+// One record. Once OpenSSL has encrypted it the bytes count as sent, even if the socket was full: the
+// record waits in OpenSSL's buffer for tls_flush(), so the caller never has to offer the same bytes again
+// (the out queue may have moved them from memory to a file meanwhile).
+static ssize_t private_write(struct tls_conn *tls, const void *buf, const int len) {
+    ERR_clear_error();
+
+    const int ret = SSL_write(tls->ssl, buf, len);
+
+    if (ret > 0)
+        return ret;
+
+    if (SSL_get_error(tls->ssl, ret) == SSL_ERROR_WANT_WRITE) {
+        tls->unflushed = len;
+        return len;
+    }
+
+    if (!private_failed(tls, ret))
+        errno = EPIPE;
+
+    return -1;
+}
+
+// 0: nothing is left in OpenSSL's buffer, -1: EAGAIN (wait for POLLOUT) or an error
+int tls_flush(struct tls_conn *tls) {
+    if (!tls || !tls->unflushed)
+        return 0;
+
+    ERR_clear_error();
+
+    // the record is encrypted already: only the length is checked (SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER)
+    const int ret = SSL_write(tls->ssl, t_record, tls->unflushed);
+
+    if (ret > 0) {
+        tls->unflushed = 0;
+        return 0;
+    }
+
+    if (!private_failed(tls, ret))
+        errno = EPIPE;
+
+    return -1;
+}
+
+ssize_t tls_send(struct tls_conn *tls, const int fd, const void *buf, const size_t len, const int flags) {
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+    const struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    return tls_sendmsg(tls, fd, &msg, flags);
+}
+
+// in user space: the buffers are gathered into one record, unless the first holds a whole one
+ssize_t tls_sendmsg(struct tls_conn *tls, const int fd, const struct msghdr *msg, const int flags) {
+    if (tls_kernel_send(tls))
+        return sendmsg(fd, msg, flags);
+
+    if (tls_flush(tls) < 0)
+        return -1;
+
+    size_t total = 0;
+
+    for (size_t i = 0; i < msg->msg_iovlen && total < TLS_RECORD_MAX; i++)
+        total += msg->msg_iov[i].iov_len;
+
+    const int len = total < TLS_RECORD_MAX ? (int) total : TLS_RECORD_MAX;
+
+    if (!len)
+        return 0;
+
+    if (msg->msg_iov[0].iov_len >= (size_t) len)
+        return private_write(tls, msg->msg_iov[0].iov_base, len);
+
+    int gathered = 0;
+
+    for (size_t i = 0; gathered < len; i++) {
+        const int take = msg->msg_iov[i].iov_len < (size_t) (len - gathered) ? (int) msg->msg_iov[i].iov_len : len - gathered;
+
+        memcpy(t_record + gathered, msg->msg_iov[i].iov_base, take);
+        gathered += take;
+    }
+
+    return private_write(tls, t_record, len);
+}
+
+// in user space: read a record's worth of the file, encrypt and send it
+ssize_t tls_sendfile(struct tls_conn *tls, const int fd, const int file_fd, off_t *offset, const size_t len) {
+    if (tls_kernel_send(tls))
+        return sendfile(fd, file_fd, offset, len);
+
+    if (tls_flush(tls) < 0)
+        return -1;
+
+    const ssize_t bytes_read = pread(file_fd, t_record, len < TLS_RECORD_MAX ? len : TLS_RECORD_MAX, *offset);
+
+    if (bytes_read <= 0)
+        return bytes_read;
+
+    const ssize_t sent = private_write(tls, t_record, (int) bytes_read);
+
+    if (sent > 0)
+        *offset += sent;
+
+    return sent;
+}
+
+#else
+
+// built without OpenSSL: there are only plain connections, and every call is the bare syscall
+
+int tls_init(void) {
+    for (int i = 0; i < g_config.listen_count; i++)
+        if (g_config.listen_tls[i]) {
+            fprintf(stderr, "--tls-listen needs a build with TLS support: make clean && make TLS=1\n");
+            errno = ENOTSUP;
+            return -1;
+        }
+
+    return 0;
+}
+
+struct tls_conn *tls_conn_new(const int fd) {
+    (void) fd;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int tls_handshake(struct tls_conn *tls) {
+    (void) tls;
+    errno = ENOTSUP;
+    return -1;
+}
+
+void tls_conn_free(struct tls_conn **p_tls) {
+    (void) p_tls;
+    return;
+}
+
+void tls_report(void) {
+    return;
+}
+
+int tls_pending(const struct tls_conn *tls) {
+    return (void) tls, 0;
+}
+
+int tls_kernel_send(const struct tls_conn *tls) {
+    return (void) tls, 1;
+}
+
+int tls_kernel_recv(const struct tls_conn *tls) {
+    return (void) tls, 1;
+}
+
+ssize_t tls_recv(struct tls_conn *tls, const int fd, void *buf, const size_t len, const int flags) {
+    (void) tls;
+    return recv(fd, buf, len, flags);
+}
+
+ssize_t tls_send(struct tls_conn *tls, const int fd, const void *buf, const size_t len, const int flags) {
+    (void) tls;
+    return send(fd, buf, len, flags);
+}
+
+ssize_t tls_sendmsg(struct tls_conn *tls, const int fd, const struct msghdr *msg, const int flags) {
+    (void) tls;
+    return sendmsg(fd, msg, flags);
+}
+
+ssize_t tls_sendfile(struct tls_conn *tls, const int fd, const int file_fd, off_t *offset, const size_t len) {
+    (void) tls;
+    return sendfile(fd, file_fd, offset, len);
+}
+
+int tls_flush(struct tls_conn *tls) {
+    return (void) tls, 0;
+}
+
+#endif
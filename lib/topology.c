@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "topology.h"
+
+#define SYSFS_CPU_ONLINE "/sys/devices/system/cpu/online"
+#define SYSFS_NODE_DIR "/sys/devices/system/node"
+
+// parses the kernel's cpulist format ("0-3,8,10-11") into a membership array
+static int read_cpulist(const char *path, char *restrict member) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    memset(member, 0, TOPOLOGY_MAX_CPUS);
+
+    int first, last, found = 0;
+    char sep;
+
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+
+        if ((sep = fgetc(f)) == '-') {
+            if (fscanf(f, "%d", &last) != 1)
+                break;
+            sep = fgetc(f);
+        }
+
+        for (int cpu = first; cpu <= last && cpu < TOPOLOGY_MAX_CPUS; cpu++)
+            member[cpu] = found = 1;
+
+        if (sep != ',')
+            break;
+    }
+
+    fclose(f);
+
+    return found ? 0 : -1;
+}
+
+static int compare_by_node(const void *a, const void *b, void *node_of) {
+    const int x = *(const int *) a, y = *(const int *) b;
+    const int *nodes = node_of;
+
+    return nodes[x] != nodes[y] ? nodes[x] - nodes[y] : x - y;
+}
+
+int topology_read(struct cpu_topology *topology) {
+    char online[TOPOLOGY_MAX_CPUS];
+
+    *topology = (struct cpu_topology) { .node_count = 1 };
+
+    if (read_cpulist(SYSFS_CPU_ONLINE, online) < 0) { // no sysfs, trust sysconf
+        const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+        memset(online, 0, sizeof online);
+        for (long cpu = 0; cpu < cpu_count && cpu < TOPOLOGY_MAX_CPUS; cpu++)
+            online[cpu] = 1;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) < 0)
+        CPU_ZERO(&allowed);
+
+    for (int cpu = 0; cpu < TOPOLOGY_MAX_CPUS; cpu++)
+        if (online[cpu] && (!CPU_COUNT(&allowed) || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))))
+            topology->cpus[topology->cpu_count++] = cpu;
+
+    DIR *dir = opendir(SYSFS_NODE_DIR);
+    if (dir) {
+        struct dirent *dirent;
+        int max_node = 0;
+
+        while ((dirent = readdir(dir))) {
+            int node;
+            char member[TOPOLOGY_MAX_CPUS];
+            char path[sizeof SYSFS_NODE_DIR + sizeof dirent->d_name + 16];
+
+            if (sscanf(dirent->d_name, "node%d", &node) != 1)
+                continue;
+
+            snprintf(path, sizeof path, "%s/%s/cpulist", SYSFS_NODE_DIR, dirent->d_name);
+            if (read_cpulist(path, member) < 0)
+                continue;
+
+            for (int cpu = 0; cpu < TOPOLOGY_MAX_CPUS; cpu++)
+                if (member[cpu])
+                    topology->node_of[cpu] = node;
+
+            if (node > max_node)
+                max_node = node;
+        }
+
+        closedir(dir);
+        topology->node_count = max_node + 1;
+    }
+
+    qsort_r(topology->cpus, topology->cpu_count, sizeof *topology->cpus, compare_by_node, topology->node_of);
+
+    return topology->cpu_count ? 0 : -1;
+}
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "config.h"
+#include "lib.h"
+#include "trace.h"
+#include "../include/http_enums.h" // lib/ has its own http_enums.h
+
+#define TRACE_MAX_THREADS 1024
+#define TRACE_RING_SIZE 256 // power of two
+#define TRACE_SLOW_RING_SIZE 64 // power of two
+#define TRACE_MAX_MARKS 16
+#define TRACE_PATH_LEN 48
+
+static const char *const phase_names[TRACE_PHASE_COUNT] = {
+    [TRACE_RECV] = "recv",
+    [TRACE_PARSE] = "parse",
+    [TRACE_ROUTE] = "route",
+    [TRACE_READ] = "read",
+    [TRACE_COMPRESS] = "compress",
+    [TRACE_LOG] = "log",
+    [TRACE_HEADERS] = "headers",
+    [TRACE_SEND] = "send"
+};
+
+// seqlock: odd while its worker is writing it, readers retry or skip
+struct trace_record {
+    _Atomic uint32_t seq;
+    uint16_t status;
+    uint8_t method;
+    uint8_t mark_count;
+    uint8_t phases[TRACE_MAX_MARKS];
+    uint32_t arena_bytes;
+    uint64_t start;
+    uint64_t ends[TRACE_MAX_MARKS]; // ticks since start
+    char path[TRACE_PATH_LEN];
+};
+
+struct trace_ring {
+    _Atomic uint64_t head;
+    _Atomic uint64_t slow_head;
+    struct trace_record recent[TRACE_RING_SIZE];
+    struct trace_record slow[TRACE_SLOW_RING_SIZE];
+};
+
+int g_trace_enabled;
+
+static _Atomic(struct trace_ring *) g_rings[TRACE_MAX_THREADS];
+static atomic_int g_ring_count;
+
+static const char *g_dump_dir;
+static uint64_t g_base_ticks;
+static double g_ticks_per_us;
+static uint64_t g_slow_ticks;
+
+// request in progress on this worker, copied into the ring when it ends
+static __thread struct trace_ring *t_ring;
+static __thread struct trace_record t_current;
+
+// the TSC is constant-rate on anything this runs on and costs ~20 cycles, clock_gettime() elsewhere
+static inline uint64_t trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_register_thread(void) {
+    if (!g_trace_enabled)
+        return;
+
+    const int index = atomic_fetch_add(&g_ring_count, 1);
+    if (index >= TRACE_MAX_THREADS)
+        return;
+
+    // allocated by the worker itself, so it lands on the worker's NUMA node
+    if (!(t_ring = calloc(1, sizeof *t_ring)))
+        return;
+
+    atomic_store_explicit(&g_rings[index], t_ring, memory_order_release);
+
+    return;
+}
+
+// the request in progress, which a coroutine carries with it while another one runs (NULL: tracing off)
+void *trace_current(size_t *size) {
+    *size = sizeof t_current;
+
+    return g_trace_enabled ? &t_current : NULL;
+}
+
+void trace_begin_slow(void) {
+    t_current.mark_count = 0;
+    t_current.start = trace_ticks();
+
+    return;
+}
+
+void trace_mark_slow(const enum trace_phase phase) {
+    const uint64_t elapsed = trace_ticks() - t_current.start;
+    const int count = t_current.mark_count;
+
+    if (count && t_current.phases[count-1] == phase) // consecutive marks of one phase are one span
+        t_current.ends[count-1] = elapsed;
+    else if (count < TRACE_MAX_MARKS) {
+        t_current.phases[count] = phase;
+        t_current.ends[count] = elapsed;
+        t_current.mark_count++;
+    }
+
+    return;
+}
+
+static void private_publish(struct trace_record *slot) {
+    const uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->status = t_current.status;
+    slot->method = t_current.method;
+    slot->mark_count = t_current.mark_count;
+    slot->arena_bytes = t_current.arena_bytes;
+    slot->start = t_current.start;
+    memcpy(slot->phases, t_current.phases, sizeof slot->phases);
+    memcpy(slot->ends, t_current.ends, sizeof slot->ends);
+    memcpy(slot->path, t_current.path, sizeof slot->path);
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+
+    return;
+}
+
+void trace_end_slow(const int method, const struct sized_str path, const int status, const size_t arena_bytes) {
+    if (!t_ring || !t_current.mark_count)
+        return;
+
+    const size_t path_len = path.len < TRACE_PATH_LEN - 1 ? path.len : TRACE_PATH_LEN - 1;
+
+    t_current.method = method;
+    t_current.status = status;
+    t_current.arena_bytes = arena_bytes;
+    if (path_len)
+        memcpy(t_current.path, path.ptr, path_len);
+    t_current.path[path_len] = '\0';
+
+    const uint64_t head = atomic_load_explicit(&t_ring->head, memory_order_relaxed);
+    private_publish(&t_ring->recent[head & (TRACE_RING_SIZE - 1)]);
+    atomic_store_explicit(&t_ring->head, head + 1, memory_order_release);
+
+    if (t_current.ends[t_current.mark_count-1] >= g_slow_ticks) {
+        const uint64_t slow_head = atomic_load_explicit(&t_ring->slow_head, memory_order_relaxed);
+        private_publish(&t_ring->slow[slow_head & (TRACE_SLOW_RING_SIZE - 1)]);
+        atomic_store_explicit(&t_ring->slow_head, slow_head + 1, memory_order_release);
+    }
+
+    return;
+}
+
+// consistent copy of a slot, 0 when it is empty or was being overwritten
+static int private_snapshot(struct trace_record *slot, struct trace_record *copy) {
+    const uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (!seq || seq & 1)
+        return 0;
+
+    copy->status = slot->status;
+    copy->method = slot->method;
+    copy->mark_count = slot->mark_count;
+    copy->arena_bytes = slot->arena_bytes;
+    copy->start = slot->start;
+    memcpy(copy->phases, slot->phases, sizeof copy->phases);
+    memcpy(copy->ends, slot->ends, sizeof copy->ends);
+    memcpy(copy->path, slot->path, sizeof copy->path);
+
+    atomic_thread_fence(memory_order_acquire);
+
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq && copy->mark_count <= TRACE_MAX_MARKS;
+}
+
+static void private_write_escaped(FILE *f, const char *str) {
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\' || (unsigned char) *str < 0x20)
+            fprintf(f, "\\u%04x", (unsigned char) *str);
+        else
+            fputc(*str, f);
+    }
+
+    return;
+}
+
+// one complete ("X") event for the request, and one per phase nested under it
+static void private_write_record(FILE *f, const struct trace_record *record, const int pid, const int tid) {
+    const double start_us = (record->start - g_base_ticks) / g_ticks_per_us;
+    const char *method = record->method < METHOD_COUNT ? http_methods_str[record->method] : "-";
+
+    fprintf(f, ",\n{\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"cat\":\"request\",\"name\":\"%s ",
+        pid, tid, start_us, record->ends[record->mark_count-1] / g_ticks_per_us, method);
+    private_write_escaped(f, record->path);
+    fprintf(f, "\",\"args\":{\"status\":%d,\"arena_bytes\":%u}}", record->status, record->arena_bytes);
+
+    uint64_t phase_start = 0;
+
+    for (int i = 0; i < record->mark_count; i++) {
+        fprintf(f, ",\n{\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"cat\":\"phase\",\"name\":\"%s\"}",
+            pid, tid, start_us + phase_start / g_ticks_per_us, (record->ends[i] - phase_start) / g_ticks_per_us,
+            record->phases[i] < TRACE_PHASE_COUNT ? phase_names[record->phases[i]] : "?");
+        phase_start = record->ends[i];
+    }
+
+    return;
+}
+
+static int private_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+
+    const int ring_count = atomic_load(&g_ring_count) < TRACE_MAX_THREADS ? atomic_load(&g_ring_count) : TRACE_MAX_THREADS;
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+
+    // pid 1 holds the most recent requests of every worker, pid 2 only the slow ones
+    for (int pid = 1; pid <= 2; pid++) {
+        fprintf(f, "%s\n{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"%s\"}}",
+            pid == 1 ? "" : ",", pid, pid == 1 ? "recent requests" : "slow requests");
+
+        for (int tid = 0; tid < ring_count; tid++) {
+            struct trace_ring *ring = atomic_load_explicit(&g_rings[tid], memory_order_acquire);
+            if (!ring)
+                continue;
+
+            struct trace_record *slots = pid == 1 ? ring->recent : ring->slow;
+            const int size = pid == 1 ? TRACE_RING_SIZE : TRACE_SLOW_RING_SIZE;
+            struct trace_record copy;
+
+            for (int i = 0; i < size; i++)
+                if (private_snapshot(&slots[i], &copy) && copy.mark_count)
+                    private_write_record(f, &copy, pid, tid);
+        }
+    }
+
+    fputs("\n]}\n", f);
+
+    return fclose(f);
+}
+
+// SIGUSR1 is blocked in every thread (see trace_init()) and taken synchronously here, so dumping is
+// free to allocate and do I/O
+static void *dump_thread(void *args) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    for (int dump_count = 0; ; dump_count++) {
+        int signal_number;
+        if (sigwait(&set, &signal_number))
+            continue;
+
+        char path[4096];
+        snprintf(path, sizeof path, "%s/trace-%d-%d.json", g_dump_dir, (int) getpid(), dump_count);
+
+        if (private_dump(path) < 0)
+            perror("\033[1;31merror:\033[0m trace dump failed");
+        else
+            print_to_log("Trace written to %s", path);
+    }
+
+    return args;
+}
+
+// must run before any other thread is started, so that they all inherit the blocked SIGUSR1
+int trace_init(const char *dump_dir) {
+    if (!g_config.trace)
+        return 0;
+
+    g_dump_dir = dump_dir;
+
+    // ticks per microsecond, measured against the monotonic clock
+    const uint64_t ns_before = monotonic_ns(), ticks_before = trace_ticks();
+    nanosleep(&(struct timespec) { .tv_nsec = 20 * 1000000 }, NULL);
+    const uint64_t ns_after = monotonic_ns(), ticks_after = trace_ticks();
+
+    g_ticks_per_us = (double) (ticks_after - ticks_before) * 1000 / (ns_after - ns_before);
+    g_base_ticks = ticks_before;
+    g_slow_ticks = g_config.trace_slow_us * g_ticks_per_us;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL))
+        return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dump_thread, NULL))
+        return -1;
+
+    pthread_detach(thread);
+
+    g_trace_enabled = 1;
+
+    return 0;
+}
@@ -0,0 +1,526 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "lib.h"
+#include "tls.h"
+#include "upload.h"
+
+#define UPLOAD_PIPE_SIZE (1 << 20)
+#define UPLOAD_COPY_SIZE (64 * 1024) // --no-upload-splice buffer
+#define UPLOAD_TURN_BYTES (8 << 20) // streamed per worker turn, then the connection goes back behind the others
+#define UPLOAD_FRAMING_PEEK 128 // chunk size lines are peeked at, so only they leave the socket through user space
+
+struct upload_route {
+    struct sized_str prefix; // no trailing slash, except for "/" itself
+    const char *dir;
+    int dir_fd;
+};
+
+struct upload {
+    int dir_fd; // the target's directory (owned)
+    int fd; // temporary file
+    int method;
+    int chunked;
+    enum { UPLOAD_CHUNK_SIZE, UPLOAD_CHUNK_EXTENSION, UPLOAD_DATA, UPLOAD_DATA_END, UPLOAD_TRAILER_START, UPLOAD_TRAILER, UPLOAD_DONE } state;
+    size_t remaining; // of the body, or of the current chunk
+    size_t total;
+    int status; // the error to answer once the upload failed
+    char *name; // the target, in dir_fd
+    char *temp_name;
+    struct sized_str path; // request path, for the log line
+};
+
+static struct upload_route g_routes[CONFIG_MAX_UPLOAD_ROUTES];
+static int g_route_count;
+static atomic_ulong g_temp_counter;
+
+static __thread int t_pipe[2] = { -1, -1 };
+static __thread char *t_copy_buf;
+
+static int private_parse_route(const char *spec) {
+    const char *equals = strchr(spec, '=');
+
+    if (!equals || spec[0] != '/' || !equals[1]) {
+        fprintf(stderr, "invalid --upload route (PREFIX=DIR): %s\n", spec);
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct upload_route *route = &g_routes[g_route_count];
+    size_t prefix_len = equals - spec;
+
+    while (prefix_len > 1 && spec[prefix_len-1] == '/')
+        prefix_len--;
+
+    *route = (struct upload_route) { .prefix = (struct sized_str) { .ptr = (char *) spec, .len = prefix_len }, .dir = equals + 1 };
+
+    if ((route->dir_fd = open(route->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "--upload directory %s: %s\n", route->dir, strerror(errno));
+        return -1;
+    }
+
+    g_route_count++;
+
+    return 0;
+}
+
+int upload_init(void) {
+    for (int i = 0; i < g_config.upload_route_count; i++) {
+        if (private_parse_route(g_config.upload_routes[i]) < 0)
+            return -1;
+
+        printf("Accepting uploads under %.*s into %s\n", (int) g_routes[i].prefix.len, g_routes[i].prefix.ptr, g_routes[i].dir);
+    }
+
+    return 0;
+}
+
+static int private_under(const struct upload_route *route, const struct sized_str path) {
+    return path.len >= route->prefix.len && !memcmp(path.ptr, route->prefix.ptr, route->prefix.len)
+        && (route->prefix.len == 1 || path.len == route->prefix.len || path.ptr[route->prefix.len] == '/');
+}
+
+// the longest prefix `path` falls under, NULL when it is no upload location
+const struct upload_route *upload_route_for(const struct sized_str path) {
+    const struct upload_route *match = NULL;
+
+    for (int i = 0; i < g_route_count; i++)
+        if (private_under(&g_routes[i], path) && (!match || g_routes[i].prefix.len > match->prefix.len))
+            match = &g_routes[i];
+
+    return match;
+}
+
+static int private_errno_status(const int errnum) {
+    switch (errnum) {
+        case ENOSPC:
+        case EDQUOT:
+            return 507;
+        case ENOTDIR:
+        case EISDIR:
+        case EEXIST:
+            return 409; // a file where a directory is needed, or the other way around
+        default:
+            return 500;
+    }
+}
+
+// the directory `rel` (a C string of '/'-separated segments, the last one excluded) lives in, created as
+// needed; -1 with `*status` set otherwise
+static int private_open_parent(const int root_fd, char *rel, char **name, int *status) {
+    int dir_fd = dup(root_fd);
+    char *segment = rel;
+    char *slash;
+
+    while (dir_fd >= 0 && (slash = strchr(segment, '/'))) {
+        *slash = '\0';
+
+        if (*segment) {
+            if (mkdirat(dir_fd, segment, 0755) < 0 && errno != EEXIST) {
+                *status = private_errno_status(errno);
+                close(dir_fd);
+                return -1;
+            }
+
+            const int next_fd = openat(dir_fd, segment, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            close(dir_fd);
+            dir_fd = next_fd;
+        }
+
+        segment = slash + 1;
+    }
+
+    if (dir_fd < 0) {
+        *status = private_errno_status(errno == ELOOP ? ENOTDIR : errno);
+        return -1;
+    }
+
+    *name = segment;
+
+    return dir_fd;
+}
+
+// NULL with `*status` set when the body cannot be taken (it is then left unread, close the connection)
+struct upload *upload_begin(const struct upload_route *route, const struct sized_str path, const int method,
+    const size_t content_length, const int chunked, int *status, struct arena *arena) {
+    const struct sized_str clean = validate_path(path, arena);
+
+    *status = 400;
+
+    if (!clean.len || !private_under(route, clean)) // `..` climbed out of the upload location
+        return NULL;
+
+    // what follows the prefix, up to a query string, names the file
+    struct sized_str rel = { .ptr = clean.ptr + route->prefix.len, .len = clean.len - route->prefix.len };
+    const char *query = memchr(rel.ptr, '?', rel.len);
+
+    if (query)
+        rel.len = query - rel.ptr;
+
+    while (rel.len && rel.ptr[0] == '/') {
+        rel.ptr++;
+        rel.len--;
+    }
+
+    if (!rel.len || rel.ptr[rel.len-1] == '/') // a directory
+        return NULL;
+
+    for (size_t i = 0; i < rel.len; i++) // dot files stay out of reach, temporary files among them
+        if (rel.ptr[i] == '.' && (!i || rel.ptr[i-1] == '/'))
+            return NULL;
+
+    if (!chunked && content_length == (size_t) -1) {
+        *status = 411;
+        return NULL;
+    }
+
+    if (!chunked && content_length > (size_t) g_config.max_upload_mb << 20) {
+        *status = 413;
+        return NULL;
+    }
+
+    char *rel_c = arena_alloc(arena, rel.len + 1);
+    memcpy(rel_c, rel.ptr, rel.len);
+    rel_c[rel.len] = '\0';
+
+    char *name;
+    const int dir_fd = private_open_parent(route->dir_fd, rel_c, &name, status);
+
+    if (dir_fd < 0)
+        return NULL;
+
+    const size_t name_len = strlen(name);
+    const size_t temp_cap = name_len + 48;
+    struct upload *upload = malloc(sizeof *upload + name_len + 1 + temp_cap + clean.len);
+
+    if (!upload) {
+        *status = 500;
+        close(dir_fd);
+        return NULL;
+    }
+
+    *upload = (struct upload) {
+        .dir_fd = dir_fd,
+        .fd = -1,
+        .method = method,
+        .chunked = chunked,
+        .state = chunked ? UPLOAD_CHUNK_SIZE : content_length ? UPLOAD_DATA : UPLOAD_DONE,
+        .remaining = chunked ? 0 : content_length,
+        .name = (char *) (upload + 1),
+    };
+    upload->temp_name = upload->name + name_len + 1;
+    upload->path = (struct sized_str) { .ptr = upload->temp_name + temp_cap, .len = clean.len };
+
+    memcpy(upload->name, name, name_len + 1);
+    memcpy(upload->path.ptr, clean.ptr, clean.len);
+
+    // next to the target, so the final rename() never crosses file systems; a name left behind by a
+    // previous run is skipped
+    for (int attempt = 0; upload->fd < 0 && attempt < 8; attempt++) {
+        snprintf(upload->temp_name, temp_cap, ".%s.%d.%lu.part", name, getpid(), atomic_fetch_add(&g_temp_counter, 1));
+        upload->fd = openat(dir_fd, upload->temp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+        if (upload->fd < 0 && errno != EEXIST)
+            break;
+    }
+
+    if (upload->fd < 0) {
+        *status = private_errno_status(errno);
+        close(dir_fd);
+        free(upload);
+        return NULL;
+    }
+
+    // reserve the space up front: less fragmentation, and a full disk is known before the body is read
+    if (!chunked && content_length && fallocate(upload->fd, 0, 0, content_length) < 0 && (errno == ENOSPC || errno == EDQUOT)) {
+        *status = 507;
+        upload_abort(&upload);
+        return NULL;
+    }
+
+    *status = 0;
+
+    return upload;
+}
+
+static void private_data_done(struct upload *upload, const size_t len) {
+    upload->total += len;
+
+    if (!(upload->remaining -= len))
+        upload->state = upload->chunked ? UPLOAD_DATA_END : UPLOAD_DONE;
+
+    return;
+}
+
+// consumes chunk framing up to the next chunk's data or the end of the body; -1 with the status set when
+// it is malformed or the body grows past --max-upload-mb
+static ssize_t private_framing(struct upload *upload, const char *data, const size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        const char c = data[i];
+
+        switch (upload->state) {
+            case UPLOAD_CHUNK_SIZE:
+                if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
+                    if (upload->remaining >> (sizeof upload->remaining * 8 - 4)) {
+                        upload->status = 400;
+                        return -1;
+                    }
+                    upload->remaining = upload->remaining * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+                    break;
+                }
+
+                upload->state = UPLOAD_CHUNK_EXTENSION;
+                // fallthrough
+            case UPLOAD_CHUNK_EXTENSION:
+                if (c != '\n')
+                    break;
+
+                if (upload->total + upload->remaining > (size_t) g_config.max_upload_mb << 20) {
+                    upload->status = 413;
+                    return -1;
+                }
+
+                upload->state = upload->remaining ? UPLOAD_DATA : UPLOAD_TRAILER_START;
+                if (upload->remaining)
+                    return i + 1;
+                break;
+            case UPLOAD_DATA_END:
+                if (c == '\n')
+                    upload->state = UPLOAD_CHUNK_SIZE;
+                break;
+            case UPLOAD_TRAILER_START:
+                if (c == '\n') {
+                    upload->state = UPLOAD_DONE;
+                    return i + 1;
+                }
+                if (c != '\r')
+                    upload->state = UPLOAD_TRAILER;
+                break;
+            case UPLOAD_TRAILER:
+                if (c == '\n')
+                    upload->state = UPLOAD_TRAILER_START;
+                break;
+            case UPLOAD_DATA:
+            case UPLOAD_DONE:
+                return i;
+        }
+    }
+
+    return len;
+}
+
+static int private_write_all(const int fd, const char *data, size_t len) {
+    while (len) {
+        const ssize_t written = write(fd, data, len);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        data += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+// body bytes that arrived along with the headers; how many of `data` belonged to the body (what follows
+// is the next request), -1 with the status set on failure
+ssize_t upload_feed(struct upload *upload, const char *data, const size_t len) {
+    size_t used = 0;
+
+    while (used < len && upload->state != UPLOAD_DONE) {
+        if (upload->state != UPLOAD_DATA) {
+            const ssize_t framing = private_framing(upload, data + used, len - used);
+            if (framing < 0)
+                return -1;
+
+            used += framing;
+            continue;
+        }
+
+        const size_t take = len - used < upload->remaining ? len - used : upload->remaining;
+
+        if (private_write_all(upload->fd, data + used, take) < 0) {
+            upload->status = private_errno_status(errno);
+            return -1;
+        }
+
+        private_data_done(upload, take);
+        used += take;
+    }
+
+    return used;
+}
+
+// socket -> pipe -> file; the pipe is always drained before returning, so it can serve the next upload
+static ssize_t private_splice(struct upload *upload, const int socket_fd) {
+    if (t_pipe[0] < 0) {
+        if (pipe2(t_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            upload->status = 500;
+            return -1;
+        }
+
+        fcntl(t_pipe[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+    }
+
+    const size_t wanted = upload->remaining < UPLOAD_PIPE_SIZE ? upload->remaining : UPLOAD_PIPE_SIZE;
+    const ssize_t in_pipe = splice(socket_fd, NULL, t_pipe[1], NULL, wanted, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    for (ssize_t left = in_pipe; left > 0; ) {
+        const ssize_t out_of_pipe = splice(t_pipe[0], NULL, upload->fd, NULL, left, SPLICE_F_MOVE);
+
+        if (out_of_pipe <= 0) {
+            if (out_of_pipe < 0 && errno == EINTR)
+                continue;
+
+            upload->status = private_errno_status(out_of_pipe < 0 ? errno : EIO);
+            close(t_pipe[0]); // whatever is stuck in it must not end up in another upload
+            close(t_pipe[1]);
+            t_pipe[0] = t_pipe[1] = -1;
+            return -1;
+        }
+
+        left -= out_of_pipe;
+    }
+
+    return in_pipe;
+}
+
+// the plain recv()/write() loop, kept to compare against (--no-upload-splice)
+static ssize_t private_copy(struct upload *upload, const int socket_fd, struct tls_conn *tls) {
+    if (!t_copy_buf && !(t_copy_buf = malloc(UPLOAD_COPY_SIZE))) {
+        upload->status = 500;
+        return -1;
+    }
+
+    const size_t wanted = upload->remaining < UPLOAD_COPY_SIZE ? upload->remaining : UPLOAD_COPY_SIZE;
+    const ssize_t bytes_recvd = tls_recv(tls, socket_fd, t_copy_buf, wanted, MSG_DONTWAIT);
+
+    if (bytes_recvd > 0 && private_write_all(upload->fd, t_copy_buf, bytes_recvd) < 0) {
+        upload->status = private_errno_status(errno);
+        return -1;
+    }
+
+    return bytes_recvd;
+}
+
+// 1: the body is complete, 0: the socket ran dry or this turn is over (park the connection), -1: the
+// client went away, otherwise an error status to answer before closing
+int upload_pump(struct upload *upload, const int socket_fd, struct tls_conn *tls) {
+    size_t turn = 0;
+
+    if (upload->status) // upload_feed() failed
+        return upload->status;
+
+    while (upload->state != UPLOAD_DONE) {
+        if (upload->state != UPLOAD_DATA) { // framing: peek at it, then take exactly what was used
+            char line[UPLOAD_FRAMING_PEEK];
+            const ssize_t peeked = tls_recv(tls, socket_fd, line, sizeof line, MSG_PEEK | MSG_DONTWAIT);
+
+            if (peeked <= 0) {
+                if (peeked < 0 && errno == EINTR)
+                    continue;
+                return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+
+            const ssize_t used = private_framing(upload, line, peeked);
+            if (used < 0)
+                return upload->status;
+
+            if (tls_recv(tls, socket_fd, line, used, MSG_DONTWAIT) != used)
+                return -1;
+
+            continue;
+        }
+
+        if (turn >= UPLOAD_TURN_BYTES)
+            return 0;
+
+        const ssize_t moved = g_config.upload_splice && tls_kernel_recv(tls) ? private_splice(upload, socket_fd) : private_copy(upload, socket_fd, tls);
+
+        if (moved <= 0) {
+            if (upload->status)
+                return upload->status;
+            if (moved < 0 && errno == EINTR)
+                continue;
+            return moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        private_data_done(upload, moved);
+        turn += moved;
+    }
+
+    return 1;
+}
+
+// makes the upload durable as --upload-fsync asks and renames it into place: 201 when the target is new,
+// 204 when it was replaced, an error status otherwise. The upload is gone either way.
+int upload_finish(struct upload **p_upload) {
+    struct upload *upload = *p_upload;
+    struct stat st_buf;
+
+    if (ftruncate(upload->fd, upload->total) < 0) // in case the body came up short of what fallocate() reserved
+        goto failed;
+
+    if (g_config.upload_fsync >= UPLOAD_FSYNC_FILE && fsync(upload->fd) < 0)
+        goto failed;
+
+    const int existed = !fstatat(upload->dir_fd, upload->name, &st_buf, AT_SYMLINK_NOFOLLOW);
+
+    if (renameat(upload->dir_fd, upload->temp_name, upload->dir_fd, upload->name) < 0)
+        goto failed;
+
+    // the rename itself only survives a crash once the directory is on disk too
+    if (g_config.upload_fsync >= UPLOAD_FSYNC_FULL && fsync(upload->dir_fd) < 0)
+        perror("\033[1;31merror:\033[0m fsync() of upload directory failed");
+
+    close(upload->fd);
+    close(upload->dir_fd);
+    free(upload);
+    *p_upload = NULL;
+
+    return existed ? 204 : 201;
+
+failed:
+    {
+        const int status = private_errno_status(errno);
+        upload_abort(p_upload);
+        return status;
+    }
+}
+
+void upload_abort(struct upload **p_upload) {
+    struct upload *upload = *p_upload;
+
+    if (!upload)
+        return;
+
+    close(upload->fd);
+    unlinkat(upload->dir_fd, upload->temp_name, 0);
+    close(upload->dir_fd);
+    free(upload);
+    *p_upload = NULL;
+
+    return;
+}
+
+int upload_method(const struct upload *upload) {
+    return upload->method;
+}
+
+struct sized_str upload_path(const struct upload *upload) {
+    return upload->path;
+}
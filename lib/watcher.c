@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "watcher.h"
+
+#define WATCHER_MAX_ROOTS 8
+#define COALESCE_MS 50 // quiet period that closes a batch
+#define MAX_BATCH_MS 1000 // a steady trickle of writes still gets flushed this often
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct watch_root {
+    const char *dir;
+    int recursive;
+    watcher_callback callback;
+    void *ctx;
+    struct sized_str *batch;
+    size_t batch_count, batch_cap;
+    int overflowed;
+};
+
+struct watch {
+    int root;
+    char *rel_path; // "" for the root itself, NULL once the watch is gone
+};
+
+static int g_inotify_fd = -1;
+static struct watch_root g_roots[WATCHER_MAX_ROOTS];
+static int g_root_count;
+static struct watch *g_watches; // indexed by watch descriptor
+static int g_watch_cap;
+static struct arena *g_arena; // batch paths, cleared after every dispatch
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void batch_push(struct watch_root *root, const char *rel_dir, const char *name) {
+    const size_t dir_len = strlen(rel_dir), name_len = name ? strlen(name) : 0;
+
+    if (root->batch_count == root->batch_cap) {
+        const size_t new_cap = root->batch_cap ? 2 * root->batch_cap : 64;
+        struct sized_str *new_batch = arena_alloc(g_arena, new_cap * sizeof *new_batch);
+
+        if (!new_batch) {
+            root->overflowed = 1;
+            return;
+        }
+
+        if (root->batch_count)
+            memcpy(new_batch, root->batch, root->batch_count * sizeof *new_batch);
+
+        root->batch = new_batch;
+        root->batch_cap = new_cap;
+    }
+
+    struct sized_str path = { .ptr = arena_alloc(g_arena, dir_len + name_len + 2) };
+    if (!path.ptr) {
+        root->overflowed = 1;
+        return;
+    }
+
+    memcpy(path.ptr, rel_dir, dir_len);
+    path.len = dir_len;
+
+    if (name_len) {
+        path.ptr[path.len++] = '/';
+        memcpy(path.ptr + path.len, name, name_len);
+        path.len += name_len;
+    } else if (!path.len)
+        path.ptr[path.len++] = '/';
+
+    root->batch[root->batch_count++] = path;
+
+    return;
+}
+
+// `report` also queues everything found, for directories that appeared after their parent was watched
+static void add_watch_tree(const int root_index, const char *rel_path, const int report) {
+    struct watch_root *root = &g_roots[root_index];
+
+    const size_t full_len = strlen(root->dir) + strlen(rel_path) + 1;
+    char full_path[full_len];
+    snprintf(full_path, full_len, "%s%s", root->dir, rel_path);
+
+    const int wd = inotify_add_watch(g_inotify_fd, full_path, WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        if (errno != ENOENT && errno != ENOTDIR)
+            perror("\033[1;31merror:\033[0m inotify_add_watch() failed");
+        return;
+    }
+
+    if (wd >= g_watch_cap) {
+        const int new_cap = wd * 2 + 16;
+        struct watch *new_watches = realloc(g_watches, new_cap * sizeof *new_watches);
+        if (!new_watches)
+            return;
+
+        memset(new_watches + g_watch_cap, 0, (new_cap - g_watch_cap) * sizeof *new_watches);
+        g_watches = new_watches;
+        g_watch_cap = new_cap;
+    }
+
+    free(g_watches[wd].rel_path);
+    g_watches[wd] = (struct watch) { .root = root_index, .rel_path = strdup(rel_path) };
+
+    if (!root->recursive && !report)
+        return;
+
+    DIR *dir = opendir(full_path);
+    if (!dir)
+        return;
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+            continue;
+
+        if (report)
+            batch_push(root, rel_path, dirent->d_name);
+
+        int is_dir = dirent->d_type == DT_DIR;
+        if (dirent->d_type == DT_UNKNOWN) {
+            struct stat st_buf;
+            char child_path[full_len + strlen(dirent->d_name) + 1];
+            snprintf(child_path, sizeof child_path, "%s/%s", full_path, dirent->d_name);
+            is_dir = !stat(child_path, &st_buf) && S_ISDIR(st_buf.st_mode);
+        }
+
+        if (is_dir && root->recursive) {
+            char child_rel[strlen(rel_path) + strlen(dirent->d_name) + 2];
+            snprintf(child_rel, sizeof child_rel, "%s/%s", rel_path, dirent->d_name);
+            add_watch_tree(root_index, child_rel, report);
+        }
+    }
+
+    closedir(dir);
+
+    return;
+}
+
+static void read_events(void) {
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        const ssize_t len = read(g_inotify_fd, buffer, sizeof buffer);
+        if (len <= 0)
+            return; // EAGAIN, queue drained
+
+        for (const char *ptr = buffer; ptr < buffer + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *) ptr;
+            ptr += sizeof *event + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                for (int i = 0; i < g_root_count; i++)
+                    g_roots[i].overflowed = 1;
+                continue;
+            }
+
+            if (event->wd < 0 || event->wd >= g_watch_cap || !g_watches[event->wd].rel_path)
+                continue;
+
+            struct watch *watch = &g_watches[event->wd];
+
+            if (event->mask & IN_IGNORED) {
+                free(watch->rel_path);
+                watch->rel_path = NULL;
+                continue;
+            }
+
+            struct watch_root *root = &g_roots[watch->root];
+            batch_push(root, watch->rel_path, event->len ? event->name : NULL);
+
+            if (root->recursive && event->len && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                char child_rel[strlen(watch->rel_path) + event->len + 2];
+                snprintf(child_rel, sizeof child_rel, "%s/%s", watch->rel_path, event->name);
+                add_watch_tree(watch->root, child_rel, 1);
+            }
+        }
+    }
+}
+
+static int sized_str_cmp(const void *a, const void *b) {
+    const struct sized_str *x = a, *y = b;
+    const int cmp = memcmp(x->ptr, y->ptr, x->len < y->len ? x->len : y->len);
+    return cmp ? cmp : (x->len > y->len) - (x->len < y->len);
+}
+
+static void dispatch(void) {
+    for (int i = 0; i < g_root_count; i++) {
+        struct watch_root *root = &g_roots[i];
+
+        if (root->overflowed)
+            root->callback(NULL, 0, root->ctx);
+        else if (root->batch_count) {
+            qsort(root->batch, root->batch_count, sizeof *root->batch, sized_str_cmp);
+
+            size_t unique = 1;
+            for (size_t j = 1; j < root->batch_count; j++)
+                if (sized_str_cmp(&root->batch[j], &root->batch[unique-1]))
+                    root->batch[unique++] = root->batch[j];
+
+            root->callback(root->batch, unique, root->ctx);
+        }
+
+        *root = (struct watch_root) { .dir = root->dir, .recursive = root->recursive, .callback = root->callback, .ctx = root->ctx };
+    }
+
+    arena_clear(g_arena);
+
+    return;
+}
+
+static void *watcher_thread(void *args) {
+    (void) args;
+
+    struct pollfd pfd = { .fd = g_inotify_fd, .events = POLLIN };
+
+    while (1) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("\033[1;31merror:\033[0m watcher poll() failed");
+            break;
+        }
+
+        // keep collecting until the directory has been quiet for COALESCE_MS
+        const long batch_start = now_ms();
+        do
+            read_events();
+        while (now_ms() - batch_start < MAX_BATCH_MS && poll(&pfd, 1, COALESCE_MS) > 0);
+
+        dispatch();
+    }
+
+    return NULL;
+}
+
+int watcher_watch(const char *dir, const int recursive, watcher_callback callback, void *ctx) {
+    if (g_root_count == WATCHER_MAX_ROOTS)
+        return -1;
+
+    if (g_inotify_fd < 0 && (g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        return -1;
+
+    if (!g_arena && !(g_arena = arena_new()))
+        return -1;
+
+    g_roots[g_root_count] = (struct watch_root) { .dir = dir, .recursive = recursive, .callback = callback, .ctx = ctx };
+    add_watch_tree(g_root_count++, "", 0);
+
+    return 0;
+}
+
+int watcher_start(void) {
+    if (g_inotify_fd < 0)
+        return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watcher_thread, NULL))
+        return -1;
+
+    pthread_detach(thread);
+
+    return 0;
+}
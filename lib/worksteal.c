@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "config.h"
+#include "coro.h"
+#include "lib.h"
+#include "worksteal.h"
+
+#define DEQUE_SIZE 1024 // a power of two; a coroutine has at most one stage queued, see --coro-max
+#define RUN_BATCH 16 // own stages per round, before looking at events again
+#define STATS_REPORT_INTERVAL_S 10
+
+// a request stage, on the stack of the coroutine waiting for it
+struct stage {
+    void (*fn)(void *arg);
+    void *arg;
+    struct coro *coro;
+    struct worker *owner;
+    struct stage *next; // in the owner's mailbox
+};
+
+// Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models"): the owner
+// pushes and pops at the bottom without atomic read-modify-writes, thieves race for the top with a CAS.
+// Fixed size: when full, the stage simply runs inline.
+struct worker {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    _Alignas(64) _Atomic(struct stage *) mailbox; // stages a thief finished, for the owner to resume
+    int mailbox_fd;
+    int cpu; // pinned to, -1: anywhere
+    int idle;
+    uint32_t random;
+
+    // written by this worker only
+    _Alignas(64) atomic_ulong pushed;
+    atomic_ulong ran;
+    atomic_ulong stolen;
+    atomic_ulong steal_failed;
+    atomic_ulong inline_count;
+
+    _Atomic(struct stage *) stages[DEQUE_SIZE];
+};
+
+static struct worker **g_workers;
+static int g_capacity;
+static int g_enabled; // off with --no-steal, or when all workers share one CPU
+static atomic_int g_worker_count;
+static atomic_int g_idle; // workers about to sleep, worth waking for a stage
+static atomic_int g_steal_signaled;
+static int g_steal_fd; // readable: a busy worker has stages to spare, one idle worker wakes up to steal
+static atomic_long g_last_report;
+
+static __thread struct worker *t_worker;
+
+// returns whether stages are shared at all: with a single CPU a thief could only take turns with the
+// owner, and deferring stages just lets one worker grab a burst of new connections for itself
+int worksteal_init(const int worker_count, const int cpu_count) {
+    if (!(g_workers = calloc(worker_count, sizeof *g_workers)))
+        return -1;
+
+    g_capacity = worker_count;
+    g_enabled = g_config.work_stealing && worker_count > 1 && cpu_count > 1;
+
+    if (!g_enabled)
+        return 0;
+
+    return (g_steal_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ? -1 : 1;
+}
+
+static int private_push(struct worker *worker, struct stage *stage) {
+    const long bottom = atomic_load_explicit(&worker->bottom, memory_order_relaxed);
+    const long top = atomic_load_explicit(&worker->top, memory_order_acquire);
+
+    if (bottom - top >= DEQUE_SIZE)
+        return -1;
+
+    atomic_store_explicit(&worker->stages[bottom & (DEQUE_SIZE - 1)], stage, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+
+    return bottom - top + 1;
+}
+
+static struct stage *private_pop(struct worker *worker) {
+    const long bottom = atomic_load_explicit(&worker->bottom, memory_order_relaxed) - 1;
+
+    atomic_store_explicit(&worker->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    long top = atomic_load_explicit(&worker->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    struct stage *stage = atomic_load_explicit(&worker->stages[bottom & (DEQUE_SIZE - 1)], memory_order_relaxed);
+
+    if (top == bottom) {
+        // the last one, a thief may be after it too
+        if (!atomic_compare_exchange_strong_explicit(&worker->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+            stage = NULL;
+
+        atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+    }
+
+    return stage;
+}
+
+// NULL: empty, or another thief was faster
+static struct stage *private_steal(struct worker *victim) {
+    long top = atomic_load_explicit(&victim->top, memory_order_acquire);
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    const long bottom = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+
+    if (top >= bottom)
+        return NULL;
+
+    struct stage *stage = atomic_load_explicit(&victim->stages[top & (DEQUE_SIZE - 1)], memory_order_relaxed);
+
+    if (!atomic_compare_exchange_strong_explicit(&victim->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+
+    return stage;
+}
+
+static struct stage *private_steal_any(struct worker *self) {
+    const int count = atomic_load_explicit(&g_worker_count, memory_order_acquire);
+
+    // xorshift, so thieves do not all start with the same victim
+    self->random ^= self->random << 13;
+    self->random ^= self->random >> 17;
+    self->random ^= self->random << 5;
+
+    for (int i = 0; i < count; i++) {
+        struct worker *victim = atomic_load_explicit((_Atomic(struct worker *) *) &g_workers[(self->random + i) % count], memory_order_acquire);
+        struct stage *stage;
+
+        // a worker on the same CPU would only take turns with the victim, not run alongside it
+        if (victim && victim != self && (self->cpu < 0 || victim->cpu != self->cpu) && (stage = private_steal(victim)))
+            return stage;
+    }
+
+    return NULL;
+}
+
+static void private_signal_thieves(void) {
+    if (!atomic_load_explicit(&g_idle, memory_order_relaxed) || atomic_exchange(&g_steal_signaled, 1))
+        return;
+
+    if (write(g_steal_fd, &(uint64_t) { 1 }, sizeof(uint64_t)) < 0)
+        perror("\033[1;31merror:\033[0m write() to the steal eventfd failed");
+
+    return;
+}
+
+static void private_on_steal_signal(void *ctx) {
+    uint64_t count;
+
+    // only wakes this worker: the next round of its loop steals
+    atomic_store(&g_steal_signaled, 0);
+
+    if (read(g_steal_fd, &count, sizeof count) < 0 && errno != EAGAIN)
+        perror("\033[1;31merror:\033[0m read() from the steal eventfd failed");
+
+    return (void) ctx;
+}
+
+// resumes the coroutines whose stages other workers finished
+static void private_on_mailbox(void *ctx) {
+    struct worker *worker = ctx;
+    uint64_t count;
+
+    if (read(worker->mailbox_fd, &count, sizeof count) < 0 && errno != EAGAIN)
+        perror("\033[1;31merror:\033[0m read() from the mailbox eventfd failed");
+
+    struct stage *stage = atomic_exchange_explicit(&worker->mailbox, NULL, memory_order_acq_rel), *reversed = NULL;
+
+    // pushed newest first, resume in the order they finished
+    while (stage) {
+        struct stage *next = stage->next;
+        stage->next = reversed;
+        reversed = stage;
+        stage = next;
+    }
+
+    while (reversed) {
+        struct stage *next = reversed->next; // the coroutine's stack goes on without it
+
+        coro_resume(reversed->coro);
+        reversed = next;
+    }
+
+    return;
+}
+
+int worksteal_register(const int cpu) {
+    if (!g_enabled)
+        return 0;
+
+    struct worker *worker = aligned_alloc(64, sizeof *worker);
+
+    if (!worker)
+        return -1;
+
+    *worker = (struct worker) { .mailbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), .cpu = cpu, .random = (uintptr_t) worker >> 6 | 1 };
+
+    if (worker->mailbox_fd < 0 || coro_watch(worker->mailbox_fd, private_on_mailbox, worker, 0) < 0
+        || coro_watch(g_steal_fd, private_on_steal_signal, NULL, 0) < 0)
+        return -1;
+
+    const int index = atomic_fetch_add(&g_worker_count, 1);
+
+    if (index >= g_capacity) {
+        atomic_fetch_sub(&g_worker_count, 1);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    atomic_store_explicit((_Atomic(struct worker *) *) &g_workers[index], worker, memory_order_release);
+    t_worker = worker;
+
+    return 0;
+}
+
+static void private_report(void) {
+    const long now = time(NULL);
+    long last = atomic_load_explicit(&g_last_report, memory_order_relaxed);
+
+    if (!last) {
+        atomic_compare_exchange_strong(&g_last_report, &last, now);
+        return;
+    }
+
+    if (now - last < STATS_REPORT_INTERVAL_S || !atomic_compare_exchange_strong(&g_last_report, &last, now))
+        return;
+
+    const int count = atomic_load(&g_worker_count);
+    unsigned long pushed = 0, stolen = 0, failed = 0, inline_count = 0;
+    char per_worker[1024];
+    int len = 0;
+
+    for (int i = 0; i < count; i++) {
+        const struct worker *worker = atomic_load((_Atomic(struct worker *) *) &g_workers[i]);
+
+        if (!worker)
+            continue;
+
+        pushed += atomic_load_explicit(&worker->pushed, memory_order_relaxed);
+        stolen += atomic_load_explicit(&worker->stolen, memory_order_relaxed);
+        failed += atomic_load_explicit(&worker->steal_failed, memory_order_relaxed);
+        inline_count += atomic_load_explicit(&worker->inline_count, memory_order_relaxed);
+
+        if (len < (int) sizeof per_worker)
+            len += snprintf(per_worker + len, sizeof per_worker - len, " %lu/%lu",
+                atomic_load_explicit(&worker->ran, memory_order_relaxed), atomic_load_explicit(&worker->stolen, memory_order_relaxed));
+    }
+
+    print_to_log("work stealing: %lu stage(s) queued, %lu stolen, %lu empty steal round(s), %lu inline (deque full); ran/stolen per worker:%s",
+        pushed, stolen, failed, inline_count, per_worker);
+
+    return;
+}
+
+static void private_run_stage(struct stage *stage) {
+    struct worker *owner = stage->owner;
+
+    coro_locals_swap(stage->coro);
+    stage->fn(stage->arg);
+    coro_locals_swap(stage->coro);
+
+    if (owner == t_worker) {
+        coro_resume(stage->coro);
+        return;
+    }
+
+    struct stage *head = atomic_load_explicit(&owner->mailbox, memory_order_relaxed);
+
+    do
+        stage->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&owner->mailbox, &head, stage, memory_order_acq_rel, memory_order_relaxed));
+
+    // from here on the stage may be gone, the owner can resume any time
+    if (!head && write(owner->mailbox_fd, &(uint64_t) { 1 }, sizeof(uint64_t)) < 0)
+        perror("\033[1;31merror:\033[0m write() to a mailbox eventfd failed");
+
+    return;
+}
+
+// Between rounds of events (see coro_run()): own stages first, newest first while their data is still in
+// the cache, then at most one stolen from another worker. Nonzero while there is more to do.
+int worksteal_run_tasks(void *ctx) {
+    struct worker *worker = t_worker;
+    struct stage *stage;
+    int ran = 0;
+
+    if (!worker)
+        return 0;
+
+    if (worker->idle) {
+        worker->idle = 0;
+        atomic_fetch_sub(&g_idle, 1);
+    }
+
+    while (ran < RUN_BATCH && (stage = private_pop(worker))) {
+        // busy for a while, let an idle worker take what is left
+        if (atomic_load_explicit(&worker->bottom, memory_order_relaxed) > atomic_load_explicit(&worker->top, memory_order_relaxed))
+            private_signal_thieves();
+
+        atomic_fetch_add_explicit(&worker->ran, 1, memory_order_relaxed);
+        private_run_stage(stage);
+        ran++;
+    }
+
+    if (ran) {
+        private_report();
+        return ran == RUN_BATCH;
+    }
+
+    if (!(stage = private_steal_any(worker))) {
+        // announce idleness first, then look again: a push in between saw the old count
+        worker->idle = 1;
+        atomic_fetch_add(&g_idle, 1);
+
+        if (!(stage = private_steal_any(worker))) {
+            atomic_fetch_add_explicit(&worker->steal_failed, 1, memory_order_relaxed);
+            return 0;
+        }
+    }
+
+    atomic_fetch_add_explicit(&worker->stolen, 1, memory_order_relaxed);
+    private_run_stage(stage);
+    private_report();
+
+    return (void) ctx, 1;
+}
+
+// Runs fn(arg) as a stage of the calling coroutine's request, here or on an idle worker; returns once
+// it is done. Outside a coroutine, or with stealing off, it just calls fn.
+void worksteal_run(void (*fn)(void *arg), void *arg) {
+    struct worker *worker = t_worker;
+    struct coro *coro = coro_self();
+
+    if (!worker || !coro) {
+        fn(arg);
+        return;
+    }
+
+    struct stage stage = { .fn = fn, .arg = arg, .coro = coro, .owner = worker };
+    const int queued = private_push(worker, &stage);
+
+    if (queued < 0) {
+        atomic_fetch_add_explicit(&worker->inline_count, 1, memory_order_relaxed);
+        fn(arg);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&worker->pushed, 1, memory_order_relaxed);
+
+    if (queued > 1)
+        private_signal_thieves();
+
+    coro_suspend(); // resumed by whoever ran it
+
+    return;
+}
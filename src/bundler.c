@@ -0,0 +1,298 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "bundle.h"
+#include "compress.h"
+#include "http_enums.h"
+#include "lib.h"
+#include "sized_str.h"
+
+// Packs a serve directory into a single file that the server can mmap and answer from without touching the
+// file system. Usage: bundler <serve dir> <output file>
+
+#define MAX_SEED (1 << 20)
+#define ALIGN16(x) (((x) + 15) & ~((uint64_t) 15))
+
+struct asset {
+    struct sized_str path;
+    char kind;
+    enum http_content_type content_type;
+    struct sized_str body;
+    struct sized_str gzip;
+};
+
+static struct arena *g_arena;
+static struct asset *g_assets;
+static size_t g_asset_count, g_asset_cap;
+static size_t g_root_len;
+
+static struct sized_str read_whole_file(const char *path, const size_t size) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        error_exit(path);
+
+    struct sized_str retval = { .ptr = arena_alloc(g_arena, size ? size : 1), .len = size };
+
+    if (fread(retval.ptr, 1, size, f) != size)
+        error_exit(path);
+
+    fclose(f);
+
+    return retval;
+}
+
+static int add_asset(const char *fpath, const struct stat *st_buf, int type_flag, struct FTW *ftw_buf) {
+    (void) ftw_buf;
+
+    if (type_flag != FTW_F && type_flag != FTW_D)
+        return 0;
+
+    if (type_flag == FTW_F && !S_ISREG(st_buf->st_mode))
+        return 0;
+
+    if (g_asset_count == g_asset_cap) {
+        g_asset_cap = g_asset_cap ? 2 * g_asset_cap : 256;
+        if (!(g_assets = realloc(g_assets, g_asset_cap * sizeof *g_assets)))
+            error_exit("realloc()");
+    }
+
+    struct asset *asset = &g_assets[g_asset_count++];
+    *asset = (struct asset) { .kind = type_flag == FTW_D ? 'd' : 'f' };
+
+    const char *rel_path = fpath + g_root_len;
+    if (!*rel_path)
+        rel_path = "/";
+
+    asset->path = (struct sized_str) { .ptr = arena_alloc(g_arena, strlen(rel_path)), .len = strlen(rel_path) };
+    memcpy(asset->path.ptr, rel_path, asset->path.len);
+
+    if (asset->kind == 'd')
+        return 0;
+
+    asset->content_type = get_file_type(asset->path);
+    asset->body = read_whole_file(fpath, st_buf->st_size);
+
+    if (asset->body.len) { // same rule as the server: only keep the variant if it is strictly smaller
+        char *temp_buf = arena_alloc(g_arena, asset->body.len);
+        const int gzip_len = gzip_compress(temp_buf, asset->body);
+
+        if (gzip_len < asset->body.len)
+            asset->gzip = (struct sized_str) { .ptr = temp_buf, .len = gzip_len };
+    }
+
+    return 0;
+}
+
+static void format_etag(char *restrict out, const struct sized_str content) {
+    snprintf(out, BUNDLE_ETAG_LEN + 1, "\"%016llx\"", (unsigned long long) bundle_hash(content, 0));
+}
+
+struct bucket_order {
+    uint32_t bucket;
+    uint32_t count;
+};
+
+static int bucket_order_cmp(const void *a, const void *b) {
+    const struct bucket_order *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+// hash-and-displace: each bucket of keys gets the smallest seed that sends all of its keys to free slots
+static int build_perfect_hash(uint32_t *slots, const uint32_t slot_count, uint32_t *seeds, const uint32_t bucket_count) {
+    uint32_t *bucket_of = arena_alloc(g_arena, g_asset_count * sizeof *bucket_of);
+    uint32_t *bucket_start = arena_alloc(g_arena, (bucket_count + 1) * sizeof *bucket_start);
+    uint32_t *members = arena_alloc(g_arena, g_asset_count * sizeof *members);
+    uint32_t *trial = arena_alloc(g_arena, g_asset_count * sizeof *trial);
+    struct bucket_order *order = arena_alloc(g_arena, bucket_count * sizeof *order);
+
+    memset(bucket_start, 0, (bucket_count + 1) * sizeof *bucket_start);
+    for (uint32_t i = 0; i < slot_count; i++)
+        slots[i] = UINT32_MAX;
+
+    for (size_t i = 0; i < g_asset_count; i++) {
+        bucket_of[i] = bundle_hash(g_assets[i].path, 0) % bucket_count;
+        bucket_start[bucket_of[i] + 1]++;
+    }
+
+    for (uint32_t b = 0; b < bucket_count; b++) {
+        order[b] = (struct bucket_order) { .bucket = b, .count = bucket_start[b + 1] };
+        bucket_start[b + 1] += bucket_start[b];
+    }
+
+    {
+        uint32_t fill[bucket_count];
+        memcpy(fill, bucket_start, bucket_count * sizeof *fill);
+        for (size_t i = 0; i < g_asset_count; i++)
+            members[fill[bucket_of[i]]++] = i;
+    }
+
+    qsort(order, bucket_count, sizeof *order, bucket_order_cmp);
+
+    for (uint32_t o = 0; o < bucket_count && order[o].count; o++) {
+        const uint32_t b = order[o].bucket;
+        const uint32_t *keys = members + bucket_start[b];
+        uint32_t seed;
+
+        for (seed = 1; seed < MAX_SEED; seed++) {
+            uint32_t k;
+
+            for (k = 0; k < order[o].count; k++) {
+                trial[k] = bundle_hash(g_assets[keys[k]].path, seed) % slot_count;
+
+                if (slots[trial[k]] != UINT32_MAX)
+                    break;
+
+                int collides = 0;
+                for (uint32_t j = 0; j < k; j++)
+                    collides |= trial[j] == trial[k];
+                if (collides)
+                    break;
+            }
+
+            if (k == order[o].count)
+                break;
+        }
+
+        if (seed == MAX_SEED)
+            return -1;
+
+        seeds[b] = seed;
+        for (uint32_t k = 0; k < order[o].count; k++)
+            slots[trial[k]] = keys[k];
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <serve dir> <output file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    g_arena = arena_new();
+
+    g_root_len = strlen(argv[1]);
+    while (g_root_len > 1 && argv[1][g_root_len-1] == '/')
+        argv[1][--g_root_len] = '\0';
+
+    if (nftw(argv[1], add_asset, 64, 0) < 0)
+        error_exit("nftw()");
+
+    if (!g_asset_count) {
+        fprintf(stderr, "no assets found in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    const uint32_t bucket_count = g_asset_count / 4 + 1;
+    uint32_t slot_count = g_asset_count + g_asset_count / 4 + 1;
+    uint32_t *seeds = arena_alloc(g_arena, bucket_count * sizeof *seeds);
+    uint32_t *slots;
+
+    do { // grow the slot table until every bucket finds a seed (one round is the common case)
+        slots = arena_alloc(g_arena, slot_count * sizeof *slots);
+        memset(seeds, 0, bucket_count * sizeof *seeds);
+    } while (build_perfect_hash(slots, slot_count, seeds, bucket_count) && (slot_count += slot_count / 2));
+
+    struct bundle_header header = {
+        .version = BUNDLE_VERSION,
+        .entry_count = g_asset_count,
+        .slot_count = slot_count,
+        .bucket_count = bucket_count
+    };
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof header.magic);
+
+    header.entries_offset = ALIGN16(sizeof header);
+    header.slots_offset = ALIGN16(header.entries_offset + g_asset_count * sizeof(struct bundle_entry));
+    header.seeds_offset = header.slots_offset + slot_count * sizeof *slots;
+
+    struct bundle_entry *entries = arena_alloc(g_arena, g_asset_count * sizeof *entries);
+    memset(entries, 0, g_asset_count * sizeof *entries);
+
+    uint64_t offset = ALIGN16(header.seeds_offset + bucket_count * sizeof *seeds);
+    for (size_t i = 0; i < g_asset_count; i++) {
+        const struct asset *asset = &g_assets[i];
+
+        entries[i] = (struct bundle_entry) {
+            .kind = asset->kind,
+            .content_type = asset->content_type,
+            .path_len = asset->path.len,
+            .path_offset = offset
+        };
+        offset = ALIGN16(offset + asset->path.len);
+
+        if (asset->kind == 'd')
+            continue;
+
+        entries[i].body_offset = offset;
+        entries[i].body_len = asset->body.len;
+        offset = ALIGN16(offset + asset->body.len);
+        format_etag(entries[i].etag, asset->body);
+
+        if (asset->gzip.len) {
+            entries[i].gzip_offset = offset;
+            entries[i].gzip_len = asset->gzip.len;
+            offset = ALIGN16(offset + asset->gzip.len);
+            format_etag(entries[i].gzip_etag, asset->gzip);
+        }
+    }
+    header.size = offset;
+
+    // write to a temporary file and rename, so a running server never maps a half-written bundle
+    char temp_path[strlen(argv[2]) + 5];
+    snprintf(temp_path, sizeof temp_path, "%s.tmp", argv[2]);
+
+    FILE *out = fopen(temp_path, "wb");
+    if (!out)
+        error_exit(temp_path);
+
+    static const char zeroes[16];
+    uint64_t written = 0;
+
+#define WRITE_AT(off, ptr, len) \
+    do { \
+        fwrite(zeroes, 1, (off) - written, out); \
+        fwrite((ptr), 1, (len), out); \
+        written = (off) + (len); \
+    } while (0)
+
+    WRITE_AT(0, &header, sizeof header);
+    WRITE_AT(header.entries_offset, entries, g_asset_count * sizeof *entries);
+    WRITE_AT(header.slots_offset, slots, slot_count * sizeof *slots);
+    WRITE_AT(header.seeds_offset, seeds, bucket_count * sizeof *seeds);
+
+    for (size_t i = 0; i < g_asset_count; i++) {
+        WRITE_AT(entries[i].path_offset, g_assets[i].path.ptr, g_assets[i].path.len);
+
+        if (entries[i].kind == 'd')
+            continue;
+
+        WRITE_AT(entries[i].body_offset, g_assets[i].body.ptr, g_assets[i].body.len);
+
+        if (entries[i].gzip_len)
+            WRITE_AT(entries[i].gzip_offset, g_assets[i].gzip.ptr, g_assets[i].gzip.len);
+    }
+    fwrite(zeroes, 1, header.size - written, out);
+
+#undef WRITE_AT
+
+    if (ferror(out) | fclose(out))
+        error_exit(temp_path);
+
+    if (rename(temp_path, argv[2]) < 0)
+        error_exit("rename()");
+
+    printf("Bundled %zu entries (%llu bytes) into %s\n", g_asset_count, (unsigned long long) header.size, argv[2]);
+
+    free(g_assets);
+    arena_free(&g_arena);
+
+    return 0;
+}
@@ -1,43 +1,111 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sched.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
 
 #include "arena.h"
+#include "bundle.h"
+#include "capture.h"
+#include "compress.h"
+#include "config.h"
+#include "conn.h"
+#include "coro.h"
+#include "header_templates.h"
 #include "http_enums.h"
 #include "lib.h"
+#include "listener.h"
+#include "metacache.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "rcu.h"
+#include "recv_buffer.h"
 #include "sized_str.h"
 #include "socket_queue.h"
-
-#define DEFAULT_PORT 80
-#define BUFFERSIZE 4096
-#define THREAD_POOL_SIZE 20
+#include "tls.h"
+#include "topology.h"
+#include "trace.h"
+#include "upload.h"
+#include "watcher.h"
+#include "worksteal.h"
+
+#define DEFAULT_LISTEN "80" // without --listen
+#define ACCEPT_BATCH 64 // connections taken from one listener per wakeup
+#define ARENA_POOL_SIZE 64 // per worker
+#define ARENA_KEEP_BYTES (64 * 1024) // of a pooled arena, the blocks a large request added past it are freed
+#define PARTIAL_REQUEST_WAIT_MS 10 // a client paused mid-headers longer than this waits on the poller
+#define SPAWN_BATCH 16 // connections a worker takes from its queue per wakeup
+#define RETRY_AFTER_SECONDS "1"
+#define BUNDLE_DIR "build"
+#define BUNDLE_NAME "/serve.bundle"
+#define BUNDLE_PATH BUNDLE_DIR BUNDLE_NAME // produced by `make bundle`
 
 // NOTE: serve directory defined in lib.c
 
-__thread char *g_err_500_msg;
+extern __thread char *g_err_500_msg;
+// error pages kept in memory with their gzip variant, so a 404 costs no I/O; swapped like the bundle
+struct error_page {
+    struct sized_str body;
+    struct sized_str gzip; // empty when compression does not shrink the page
+};
+
+static _Atomic(struct error_page *) g_page_404; // NULL without serve/404.html
+
+// NULL when serving straight from the file system, swapped by the watcher thread (read under rcu_read_lock)
+static _Atomic(struct bundle *) g_bundle;
 
+// one queue shared by every worker, or one per CPU when steering by SO_INCOMING_CPU
+static struct socket_queue *g_queues[TOPOLOGY_MAX_CPUS];
+static struct socket_queue *g_cpu_queues[TOPOLOGY_MAX_CPUS];
+static int g_queue_count;
+
+// complete responses rendered at startup, sent with a single non-blocking send() right before closing
+static struct sized_str g_res_503, g_res_429;
+
+// every sized_str is a view into the worker's receive buffer, which is left alone until the reply is out
 struct http_req {
     struct sized_str raw_req;
     enum http_methods method;
     struct sized_str url_path;
     struct sized_str user_agent;
+    struct sized_str if_none_match;
     size_t content_length;
     size_t headers_length;
+    int has_content_length;
+    int chunked;
+    int expect_continue;
     int accept_compression;
     struct sized_str body;
+    int body_status; // decided while receiving the body (streamed to disk, see upload.h, or refused), answer with this
 };
 
 struct http_reply {
     int status;
     enum http_content_type content_type;
     int content_encoding;
+    int encoded; // body is already in its final encoding, skip compression
+    int compress_offload; // large body, to be gzipped on the compression pool (see offload_compression)
     struct sized_str location;
+    struct sized_str etag;
     struct sized_str body;
+    enum { BODY_MEMORY, BODY_FILE, BODY_BUNDLE, BODY_UPSTREAM } body_source; // FILE: body.ptr is NULL, body_fd is owned
+    int body_fd; // FILE and BUNDLE: where the body can be sent from without a copy
+    off_t body_offset;
+    struct proxy_exchange *proxied; // UPSTREAM: head read, body still in the upstream socket
+    int close_after; // the body ends where the connection does
 };
 
 void log_req(const struct http_req *restrict req, const struct http_reply *restrict reply) {
@@ -68,7 +136,7 @@ void log_req(const struct http_req *restrict req, const struct http_reply *restr
     flockfile(stderr);
 
     print_to_log("%s %.*s %s%d\033[0m",
-        http_methods_str[req->method],
+        req->method >= 0 && req->method < METHOD_COUNT ? http_methods_str[req->method] : "-",
         (int) req->url_path.len, req->url_path.ptr,
         color, reply->status
     );
@@ -135,12 +203,25 @@ void http_parse_header(const struct sized_str *restrict header_field, struct htt
             scanned_args = sscanf(header_field->ptr + index, "%zu", &req->content_length);
             if (scanned_args != 1) // TODO: send back 400? what if body not necessary?
                 ;
+            req->has_content_length = scanned_args == 1;
+            break;
+
+        case http_header_transfer_encoding:
+            req->chunked = memmem(header_field->ptr + index, header_field->len - index, "chunked", 7) != NULL;
+            break;
+
+        case http_header_expect:
+            req->expect_continue = !strncasecmp(header_field->ptr + index, "100-continue", 12);
             break;
 
         case http_header_user_agent:
             req->user_agent = (struct sized_str) { .ptr = header_field->ptr + index, .len = header_field->len - index };
             break;
 
+        case http_header_if_none_match:
+            req->if_none_match = (struct sized_str) { .ptr = header_field->ptr + index, .len = header_field->len - index };
+            break;
+
         default: // TODO: error condition (server-only headers) ?
             break;
 
@@ -149,10 +230,9 @@ void http_parse_header(const struct sized_str *restrict header_field, struct htt
     return;
 }
 
-struct http_req *http_parse_req_headers(const char *raw_req, const size_t raw_req_len, struct arena *arena) {
+struct http_req *http_parse_req_headers(char *raw_req, const size_t raw_req_len, struct arena *arena) {
     struct http_req *req = arena_alloc(arena, sizeof *req);
-    *req = (struct http_req) { .raw_req = (struct sized_str) { .ptr = arena_alloc(arena, raw_req_len), .len = raw_req_len } };
-    memcpy(req->raw_req.ptr, raw_req, raw_req_len);
+    *req = (struct http_req) { .raw_req = (struct sized_str) { .ptr = raw_req, .len = raw_req_len } };
 
     unsigned int offset = 0;
 
@@ -200,16 +280,120 @@ struct http_req *http_parse_req_headers(const char *raw_req, const size_t raw_re
     return req;
 }
 
+// picks the gzip variant when accepted, and answers 304 if the client already holds that representation
+void http_reply_from_bundle(struct http_reply *reply, const struct bundle *bundle, const struct bundle_entry *entry, const struct http_req *req) {
+    const int gzip = req->accept_compression && entry->gzip_len;
+
+    *reply = (struct http_reply) {
+        .status = 200,
+        .content_type = entry->content_type,
+        .content_encoding = gzip,
+        .encoded = 1,
+        .etag = (struct sized_str) { .ptr = (char *) (gzip ? entry->gzip_etag : entry->etag), .len = BUNDLE_ETAG_LEN },
+        .body = bundle_body(bundle, entry, gzip),
+        .body_source = BODY_BUNDLE,
+        .body_fd = bundle_fd(bundle)
+    };
+
+    reply->body_offset = bundle_offset(bundle, reply->body.ptr);
+
+    if (req->if_none_match.len && (is_same_string(req->if_none_match, "*")
+        || memmem(req->if_none_match.ptr, req->if_none_match.len, reply->etag.ptr, reply->etag.len))) {
+        reply->status = 304;
+        reply->body = (struct sized_str) { 0 };
+    }
+
+    return;
+}
+
+// HEAD of a file from disk, answered from its metadata alone: nothing is opened, read or compressed, so the
+// headers describe the identity encoding (a GET may still come back gzipped)
+void http_reply_from_meta(struct http_reply *reply, const struct file_meta *meta) {
+    *reply = (struct http_reply) {
+        .status = 200,
+        .body = (struct sized_str) { .len = meta->size },
+        .content_type = meta->content_type,
+        .encoded = 1
+    };
+
+    return;
+}
+
+void http_compress_reply(struct http_reply *reply, struct arena *arena) {
+    reply->content_encoding = 1;
+    reply->compress_offload = 0;
+
+    const struct arena_mark mark = arena_save(arena);
+    char *temp_buf = arena_alloc(arena, reply->body.len);
+    const int body_len = gzip_compress(temp_buf, reply->body);
+
+    // if larger when compressed, send uncompressed
+    // (when size is equal, most likely compression did not finish)
+    if (body_len < reply->body.len)
+        reply->body = (struct sized_str) { .ptr = temp_buf, .len = body_len };
+    else {
+        reply->content_encoding = 0;
+        arena_restore(arena, mark);
+    }
+
+    trace_mark(TRACE_COMPRESS);
+
+    return;
+}
+
+// the upstream http_process_req() hands the request to, routed on the path with its dot segments resolved
+// as it does; NULL for everything answered here
+const struct proxy_route *http_proxy_route(const struct http_req *req, struct arena *arena) {
+    const struct sized_str path = validate_path(req->url_path, arena);
+
+    return path.len ? proxy_route_for(path) : NULL;
+}
+
 struct http_reply *http_process_req(struct http_req *req, struct arena *arena) {
     struct http_reply *reply = arena_alloc(arena, sizeof *reply);
+    struct bundle *bundle = NULL; // loaded past the proxy branch, which runs outside the read section
     int index;
 
+    if (g_err_500_msg) // failed before the request could be processed
+        goto server_error;
+
+    if (req->body_status) { // stored (or refused) while the body was being received
+        *reply = (struct http_reply) { .status = req->body_status };
+        return reply;
+    }
+
     struct sized_str sanitized_url_path = validate_path(req->url_path, arena);
 
     if (!sanitized_url_path.len) // log_req has actual url_path
         goto bad_request;
 
     req->url_path = sanitized_url_path;
+    trace_mark(TRACE_ROUTE);
+
+    const struct proxy_route *route;
+
+    if ((route = proxy_route_for(req->url_path))) { // any method, the upstream decides
+        struct proxy_exchange *exchange = arena_alloc(arena, sizeof *exchange);
+        const int status = proxy_request(route, (struct sized_str) { .ptr = req->raw_req.ptr, .len = req->headers_length },
+            req->url_path, req->body, req->method == HEAD, exchange, arena);
+        trace_mark(TRACE_READ);
+
+        if (status) {
+            *reply = (struct http_reply) { .status = status, .body = exchange->head, .content_type = http_content_type_text_plain };
+            return reply;
+        }
+
+        *reply = (struct http_reply) {
+            .status = exchange->status,
+            .encoded = 1,
+            .body_source = BODY_UPSTREAM,
+            .proxied = exchange,
+            .close_after = exchange->framing == PROXY_BODY_UNTIL_CLOSE
+        };
+        return reply;
+    }
+
+    bundle = atomic_load_explicit(&g_bundle, memory_order_acquire);
 
     if ((index = post_prefix_index(req->url_path, "/user-agent")) != -1) {
         if (req->method != GET && req->method != HEAD)
@@ -248,10 +432,21 @@ struct http_reply *http_process_req(struct http_req *req, struct arena *arena) {
         if (req->method != GET && req->method != HEAD)
             goto method_not_allowed;
 
-        const char d_or_f = dir_or_file(req->url_path, arena);
+        const struct bundle_entry *entry = NULL;
+        struct file_meta meta;
+        char d_or_f;
+
+        if (bundle && !bundle_is_stale(bundle, req->url_path)) { // bundle is authoritative, no stat()
+            entry = bundle_lookup(bundle, req->url_path);
+            d_or_f = entry ? entry->kind : '\0';
+        } else
+            d_or_f = metacache_stat(req->url_path, &meta, arena);
+
+        trace_mark(TRACE_ROUTE);
+
         switch (d_or_f) {
             char *temp_buf;
-            struct sized_str file_content;
+            struct sized_str index_path, file_content;
 
             case '\0':
                 goto not_found;
@@ -272,8 +467,32 @@ struct http_reply *http_process_req(struct http_req *req, struct arena *arena) {
                 temp_buf = arena_alloc(arena, req->url_path.len+10); // TODO: scratch?
                 memcpy(temp_buf, req->url_path.ptr, req->url_path.len);
                 memcpy(temp_buf+req->url_path.len, "index.html", 10);
+                index_path = (struct sized_str) { .ptr = temp_buf, .len = req->url_path.len+10 };
+
+                if (entry && !bundle_is_stale(bundle, index_path)) {
+                    if (!(entry = bundle_lookup(bundle, index_path)))
+                        goto not_found;
 
-                file_content = read_file((struct sized_str) { .ptr = temp_buf, .len = req->url_path.len+10 } , arena);
+                    http_reply_from_bundle(reply, bundle, entry, req);
+                    break;
+                }
+
+                switch (metacache_stat(index_path, &meta, arena)) {
+                    case 'f':
+                        break;
+                    case 'e':
+                        goto server_error;
+                    default:
+                        goto not_found;
+                }
+
+                if (req->method == HEAD) {
+                    http_reply_from_meta(reply, &meta);
+                    break;
+                }
+
+                file_content = read_file(index_path, arena);
+                trace_mark(TRACE_READ);
                 if (g_err_500_msg)
                     goto server_error;
                 else if (!file_content.len)
@@ -297,14 +516,47 @@ struct http_reply *http_process_req(struct http_req *req, struct arena *arena) {
                     return reply;
                 }
 
+                if (entry) {
+                    http_reply_from_bundle(reply, bundle, entry, req);
+                    break;
+                }
+
+                if (req->method == HEAD) {
+                    http_reply_from_meta(reply, &meta);
+                    break;
+                }
+
+                if (!req->accept_compression) { // nothing to transform, sendfile() straight from the page cache
+                    size_t file_size;
+                    const int file_fd = open_file(req->url_path, &file_size, arena);
+                    trace_mark(TRACE_READ);
+
+                    if (file_fd < 0) { // file SHOULD exist, verified through dir_or_file
+                        if (!g_err_500_msg)
+                            set_err_500("file removed while being served", arena);
+                        goto server_error;
+                    }
+
+                    *reply = (struct http_reply) {
+                        .status = 200,
+                        .body = (struct sized_str) { .len = file_size },
+                        .content_type = meta.content_type,
+                        .body_source = BODY_FILE,
+                        .body_fd = file_fd
+                    };
+
+                    break;
+                }
+
                 file_content = read_file(req->url_path, arena);
+                trace_mark(TRACE_READ);
                 if (!file_content.len) // file SHOULD exist, verified through dir_or_file (err_500 already set)
                     goto server_error;
 
                 *reply = (struct http_reply) {
                     .status = 200,
                     .body = file_content,
-                    .content_type = get_file_type(req->url_path)
+                    .content_type = meta.content_type
                 };
 
                 break;
@@ -315,18 +567,11 @@ struct http_reply *http_process_req(struct http_req *req, struct arena *arena) {
         }
     }
 
-    if (req->accept_compression && reply->body.len) { // TODO: add br compression? (no deflate)
-        reply->content_encoding = 1;
-
-        char *temp_buf = arena_alloc(arena, reply->body.len); // TODO: scratch arena?
-        const int body_len = gzip_compress(temp_buf, reply->body);
-
-        // if larger when compressed, send uncompressed
-        // (when size is equal, most likely compression did not finish)
-        if (body_len < reply->body.len)
-            reply->body = (struct sized_str) { .ptr = temp_buf, .len = body_len };
+    if (req->accept_compression && reply->body.len && !reply->encoded) { // TODO: add br compression? (no deflate)
+        if (reply->body.len >= (size_t) g_config.compress_offload_min)
+            reply->compress_offload = 1;
         else
-            reply->content_encoding = 0;
+            http_compress_reply(reply, arena);
     }
 
     return reply;
@@ -338,11 +583,28 @@ bad_request:
 not_found:
     *reply = (struct http_reply) { .status = 404 };
 
-    struct sized_str file_content = read_file((struct sized_str) { .ptr = "/404.html", .len = 9 }, arena);
-    if (g_err_500_msg)
-        goto server_error;
-    else if (file_content.len) {
-        reply->body = file_content;
+    if (bundle && !bundle_is_stale(bundle, (struct sized_str) { .ptr = "/404.html", .len = 9 })) {
+        const struct bundle_entry *entry = bundle_lookup(bundle, (struct sized_str) { .ptr = "/404.html", .len = 9 });
+
+        if (entry) {
+            reply->content_encoding = req->accept_compression && entry->gzip_len;
+            reply->encoded = 1;
+            reply->body = bundle_body(bundle, entry, reply->content_encoding);
+            reply->content_type = entry->content_type;
+            reply->body_source = BODY_BUNDLE;
+            reply->body_fd = bundle_fd(bundle);
+            reply->body_offset = bundle_offset(bundle, reply->body.ptr);
+        }
+
+        return reply;
+    }
+
+    const struct error_page *page = atomic_load_explicit(&g_page_404, memory_order_acquire);
+
+    if (page) {
+        reply->content_encoding = req->accept_compression && page->gzip.len;
+        reply->encoded = 1;
+        reply->body = reply->content_encoding ? page->gzip : page->body;
         reply->content_type = http_content_type_text_html;
     }
 
@@ -364,178 +626,931 @@ server_error:
     return reply;
 }
 
-// * could use `## __VA_ARGS__` (gcc/clang extension) instead of `__VA_OPT__(,) __VA_ARGS__`
-#define APPEND_HEADER(fmt_string, ...) \
+#define HEADER_SLACK 64 // "Location: ", "ETag: ", "Content-Length: " with its digits, and the CRLFs
+
+#define APPEND_HEADER(str) \
     do { \
-        msg_len += snprintf(buffer+msg_len, BUFFERSIZE-msg_len, fmt_string __VA_OPT__(,) __VA_ARGS__); \
+        memcpy(buffer+msg_len, (str).ptr, (str).len); \
+        msg_len += (str).len; \
     } while (0)
 
-struct sized_str http_prepare_res(struct http_reply *reply, struct http_req *req, struct arena *arena) {
-    char *buffer = arena_alloc(arena, BUFFERSIZE); // TODO: scratch arena???
+#define APPEND_LITERAL(literal) \
+    do { \
+        memcpy(buffer+msg_len, literal, sizeof literal - 1); \
+        msg_len += sizeof literal - 1; \
+    } while (0)
+
+// only the headers are built here, the body is sent straight from wherever it lives (see send_reply);
+// everything but Location, ETag and Content-Length comes pre-rendered (see lib/header_templates.c)
+struct sized_str http_prepare_res(struct http_reply *reply, struct arena *arena) {
+    if (reply->body_source == BODY_UPSTREAM) // the upstream's own headers, already filtered
+        return reply->proxied->head;
+
+    const int has_content_type = reply->status != 400 && reply->status != 405 && reply->status != 301 && reply->body.len;
+    const struct sized_str head = header_template(reply->status,
+        has_content_type ? (int) reply->content_type : HEADER_NO_CONTENT_TYPE, has_content_type && reply->content_encoding);
+    const struct sized_str date = header_date();
+
+    char *buffer = arena_alloc(arena, head.len + date.len + header_allow().len + reply->location.len + reply->etag.len + HEADER_SLACK);
     size_t msg_len = 0;
 
-    APPEND_HEADER("HTTP/1.1 %d %s\r\n", reply->status, http_status_codes_str[reply->status]);
+    APPEND_HEADER(head);
+    APPEND_HEADER(date);
+
+    if (reply->status == 405)
+        APPEND_HEADER(header_allow());
+    else if (reply->status == 301) {
+        APPEND_LITERAL("Location: ");
+        APPEND_HEADER(reply->location);
+        APPEND_LITERAL("\r\n");
+    }
+
+    if (reply->etag.len) {
+        APPEND_LITERAL("ETag: ");
+        APPEND_HEADER(reply->etag);
+        APPEND_LITERAL("\r\n");
+    }
+
+    if (reply->status >= 200 && reply->status != 204 && reply->status != 304) {
+        APPEND_LITERAL("Content-Length: ");
+        msg_len += u64_to_dec(buffer+msg_len, reply->body.len);
+        APPEND_LITERAL("\r\n");
+    }
+
+    APPEND_LITERAL("\r\n");
+
+    return (struct sized_str) { .ptr = buffer, .len = msg_len };
+}
+
+#undef APPEND_LITERAL
+#undef APPEND_HEADER
 
-    if (reply->status == 400)
-        ; // skip the ladder
-    else if (reply->status == 405)
-        APPEND_HEADER("Allow: %s, %s\r\n", http_methods_str[GET], http_methods_str[HEAD]);
-    else if (reply->status == 301)
-        APPEND_HEADER("Location: %.*s\r\n", (int) reply->location.len, reply->location.ptr);
-    else if (reply->body.len) {
-        APPEND_HEADER("Content-Type: %s\r\n", http_content_type_str[reply->content_type]);
+// client sockets are non-blocking: wait for readiness (the worker runs other connections meanwhile), but
+// never longer than the I/O timeout
+int wait_fd(const int fd, const short events) {
+    return coro_wait_fd(fd, events, g_config.io_timeout_ms);
+}
+
+ssize_t recv_wait(const int fd, struct tls_conn *tls, char *buf, const size_t len) {
+    while (1) {
+        const ssize_t bytes_recvd = tls_recv(tls, fd, buf, len, 0);
 
-        if (reply->content_encoding)
-            APPEND_HEADER("Content-Encoding: gzip\r\n");
+        if (bytes_recvd >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return bytes_recvd;
+
+        if (errno != EINTR && wait_fd(fd, POLLIN) < 0)
+            return -1;
     }
+}
 
-    if (reply->status >= 200 && reply->status != 204 && reply->status != 304)
-        APPEND_HEADER("Content-Length: %zu\r\n", reply->body.len);
+// Receives what is there into the worker's scratch buffer and appends it to the connection's input, moved
+// to a larger size class as it fills up: a connection holds about what it sent, not a full buffer. As
+// recv(), failing with ENOMEM when no buffer is left.
+ssize_t recv_append(const int fd, struct tls_conn *tls, struct recv_buffer **p_input, const size_t limit) {
+    static __thread char scratch[RECV_BUFFER_SIZE];
+    const size_t len = *p_input ? (*p_input)->len : 0;
+    const ssize_t bytes_recvd = tls_recv(tls, fd, scratch, limit - len < sizeof scratch ? limit - len : sizeof scratch, 0);
 
-    APPEND_HEADER("\r\n");
+    if (bytes_recvd <= 0)
+        return bytes_recvd;
 
-    const size_t res_len = msg_len + (req->method == HEAD ? 0 : reply->body.len);
+    struct recv_buffer *input = recv_buffer_fit(*p_input, len + bytes_recvd);
 
-    char *res = arena_alloc(arena, res_len);
-    memcpy(res, buffer, msg_len);
+    if (!input) {
+        errno = ENOMEM;
+        return -1;
+    }
 
-    if (req->method != HEAD)
-        memcpy(res+msg_len, reply->body.ptr, reply->body.len);
+    memcpy(input->data + len, scratch, bytes_recvd);
+    input->len = len + bytes_recvd;
+    *p_input = input;
 
-    return (struct sized_str) { .ptr = res, .len = res_len };
+    return bytes_recvd;
 }
 
-#undef APPEND_HEADER
+// 1: sent, 0: the rest is queued on the connection (park it for writing), -1: error
+// Whatever does not fit in the socket buffer is switched to its backing file or copied aside, so the worker
+// can move on; only a reply over --max-conn-buffer that has no file behind it keeps the worker waiting.
+int send_reply(struct conn *conn, const int fd, const struct sized_str headers, const struct http_reply *reply, const struct http_req *req) {
+    if (reply->body_source == BODY_UPSTREAM) // relayed as it arrives, the headers included
+        return proxy_relay(reply->proxied, fd, conn->tls) < 0 ? -1 : 1;
+
+    int pushed = out_queue_push_mem(&conn->out, headers.ptr, headers.len, -1, 0);
+
+    if (reply->body_source == BODY_FILE) {
+        if (req->method == HEAD || pushed < 0)
+            close(reply->body_fd);
+        else
+            pushed = out_queue_push_file(&conn->out, reply->body_fd, 0, reply->body.len);
+    } else if (req->method != HEAD && pushed == 0)
+        pushed = out_queue_push_mem(&conn->out, reply->body.ptr, reply->body.len,
+            reply->body_source == BODY_BUNDLE ? reply->body_fd : -1, reply->body_offset);
+
+    if (pushed < 0) // never whole, better no reply than one shorter than its Content-Length
+        return -1;
+
+    while (1) {
+        const int status = out_queue_flush(&conn->out, fd, conn->tls, NULL);
+
+        if (status)
+            return status;
+
+        if (!out_queue_make_durable(&conn->out, g_config.max_conn_buffer))
+            return 0;
+
+        if (wait_fd(fd, POLLOUT) < 0)
+            return -1;
+    }
+}
+
+// A large body is gzipped on the compression pool, which then queues the whole reply on the connection and
+// parks it for writing, so the worker is free for the small requests behind it.
+struct offloaded_reply {
+    struct compress_job job; // first, the completion callback gets it back from the job
+    struct http_reply reply;
+    int fd;
+    int is_head;
+};
+
+// the stages of a request an idle worker may take over, while the connection's coroutine waits
+struct request_stage {
+    struct http_req *req;
+    struct arena *arena;
+    struct http_reply *reply;
+};
+
+void run_process_stage(void *arg) {
+    struct request_stage *stage = arg;
+
+    stage->reply = http_process_req(stage->req, stage->arena);
+
+    return;
+}
+
+void run_compress_stage(void *arg) {
+    struct request_stage *stage = arg;
+
+    http_compress_reply(stage->reply, stage->arena);
+
+    return;
+}
+
+// runs on a compression thread
+void on_reply_compressed(struct compress_job *job) {
+    static __thread struct arena *arena;
+    struct offloaded_reply *offloaded = (struct offloaded_reply *) job;
+    struct http_reply *reply = &offloaded->reply;
+    struct conn *conn = conn_get(offloaded->fd);
+
+    if (!arena && !(arena = arena_new()))
+        error_exit("arena_new()");
+
+    char *body = job->compressed ? job->out.ptr : job->in.ptr;
+    free(job->compressed ? job->in.ptr : job->out.ptr);
+
+    reply->content_encoding = job->compressed;
+    reply->body = (struct sized_str) { .ptr = body, .len = job->compressed ? job->out.len : job->in.len };
+
+    const struct sized_str res_headers = http_prepare_res(reply, arena);
 
+    int pushed = out_queue_push_mem(&conn->out, res_headers.ptr, res_headers.len, -1, 0);
+    if (offloaded->is_head || pushed < 0)
+        free(body);
+    else
+        pushed = out_queue_push_owned(&conn->out, body, reply->body.len);
+
+    if (pushed < 0 || out_queue_make_durable(&conn->out, SIZE_MAX) < 0 || conn_park(offloaded->fd, 1) < 0)
+        conn_close(offloaded->fd);
+
+    arena_clear(arena);
+    free(offloaded);
+
+    return;
+}
+
+// 0: the compression pool owns the connection now, -1: pool saturated, compress inline
+int offload_compression(const int client_fd, const struct http_req *req, const struct http_reply *reply) {
+    struct offloaded_reply *offloaded = malloc(sizeof *offloaded);
+    char *in = malloc(reply->body.len), *out = malloc(reply->body.len);
+
+    if (!offloaded || !in || !out)
+        goto failed;
+
+    memcpy(in, reply->body.ptr, reply->body.len); // the arena is cleared once the worker moves on
+
+    *offloaded = (struct offloaded_reply) {
+        .job = {
+            .in = (struct sized_str) { .ptr = in, .len = reply->body.len },
+            .out = (struct sized_str) { .ptr = out, .len = reply->body.len },
+            .done = on_reply_compressed
+        },
+        .reply = *reply,
+        .fd = client_fd,
+        .is_head = req->method == HEAD
+    };
+    offloaded->reply.compress_offload = 0;
+
+    if (compress_submit(&offloaded->job) < 0)
+        goto failed;
+
+    return 0;
+
+failed:
+    free(offloaded);
+    free(in);
+    free(out);
+    return -1;
+}
+
+// HTTPS: the handshake runs in user space on the connection's coroutine; a client that stalls in it holds
+// the coroutine until --timeout, like one stalling in a request body
+int handshake_connection(struct conn *conn, const int fd) {
+    int wanted;
+
+    if (!(conn->tls = tls_conn_new(fd)))
+        return -1;
+
+    while ((wanted = tls_handshake(conn->tls)) > 0)
+        if (wait_fd(fd, wanted) < 0)
+            return -1;
+
+    return wanted;
+}
+
+// arenas of finished connection turns, reused by the next ones on this worker
+static __thread struct arena *t_arenas[ARENA_POOL_SIZE];
+static __thread int t_arena_count;
+
+// One turn of a connection, as a coroutine on its worker: requests are served until the connection is
+// closed, parked on the poller, or handed to the compression pool.
 // TODO: transfer-encoding, and content-type: multipart
-void *handle_client(void *args) {
-    pthread_detach(pthread_self()); // TODO: this, or join after interrupt during cleanup?
+void serve_connection(void *args) {
+    const int client_fd = (int) (intptr_t) args;
+    struct conn *conn = conn_get(client_fd);
+
+    const size_t max_request = (size_t) g_config.max_request_kb * 1024;
+    struct recv_buffer *input = conn_take_input(conn); // NULL while nothing is left unread
+    char *buffer = input ? input->data : NULL;
+    size_t offset = input ? input->len : 0;
+    struct arena *arena = t_arena_count ? t_arenas[--t_arena_count] : arena_new();
+
+    if (!arena) {
+        perror("\033[1;31merror:\033[0m arena_new() failed, client dropped");
+        recv_buffer_put(&input);
+        conn_close(client_fd);
+        return;
+    }
 
-    char buffer[BUFFERSIZE] = { 0 };
-    size_t offset = 0;
-    struct arena *arena = arena_new();
+    if (conn->secure && !conn->tls && handshake_connection(conn, client_fd) < 0)
+        goto connection_terminated;
 
     while (1) {
-        const int client_fd = dequeue();
-        
-        while (1) {
-            int total_bytes_recvd = offset;
-            const char *tracker;
-
-            while (!(tracker = strstr(buffer, "\r\n\r\n")) && BUFFERSIZE-total_bytes_recvd) {
-                int bytes_recvd;
-                if ((bytes_recvd = recv(client_fd, buffer+total_bytes_recvd, BUFFERSIZE-total_bytes_recvd, 0)) < 0) { // TODO: add timeout
-                    set_err_500("failed to read data from socket", arena);
-                    goto processing_fasttrack;
-                }
+        int total_bytes_recvd = offset;
+        size_t req_len = 0; // bytes of the buffer the request spans, released once the reply is out
+        const char *tracker;
+        struct http_req *req;
+        int close_after = 0;
+        int proxied; // left to the upstream: processed in this coroutine, outside the read section
+
+        trace_begin();
+
+        if (conn->upload) { // back from the poller in the middle of a streamed request body
+            const struct sized_str path = upload_path(conn->upload);
+
+            req = arena_alloc(arena, sizeof *req);
+            *req = (struct http_req) {
+                .method = upload_method(conn->upload),
+                .url_path = (struct sized_str) { .ptr = arena_alloc(arena, path.len), .len = path.len }
+            };
+            memcpy(req->url_path.ptr, path.ptr, path.len); // outlives the upload, for the log line
+
+            goto upload_resume;
+        }
 
-                total_bytes_recvd += bytes_recvd;
-                if (!total_bytes_recvd && !bytes_recvd)
+        if (!total_bytes_recvd) { // between requests: an idle keep-alive connection does not hold a worker
+            const ssize_t bytes_recvd = recv_append(client_fd, conn->tls, &input, max_request);
+
+            if (bytes_recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                if (conn_park(client_fd, 0) < 0)
                     goto connection_terminated;
+                goto next_connection;
             }
 
-            if ((BUFFERSIZE == total_bytes_recvd) && !tracker) {
-                errno = EMSGSIZE;
-                set_err_500("request too long, buffer length 4KiB", arena);
-                goto processing_fasttrack;
+            if (bytes_recvd <= 0)
+                goto connection_terminated;
+
+            buffer = input->data;
+            capture_data(conn->id, buffer, bytes_recvd);
+            total_bytes_recvd = bytes_recvd;
+        }
+
+        while (!(tracker = memmem(buffer, total_bytes_recvd, "\r\n\r\n", 4)) && (size_t) total_bytes_recvd < max_request) {
+            const ssize_t bytes_recvd = recv_append(client_fd, conn->tls, &input, max_request);
+
+            // a short pause is waited out here; a slower client waits on the poller, holding what it sent
+            // so far instead of a coroutine and a full buffer
+            if (bytes_recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (coro_wait_fd(client_fd, POLLIN, PARTIAL_REQUEST_WAIT_MS) < 0)
+                    goto request_incomplete;
+                continue;
             }
-            
-            struct http_req *req = http_parse_req_headers(buffer, total_bytes_recvd, arena);
-
-            const size_t req_len = req->headers_length + req->content_length;
-            if (req->content_length) {
-                while (req_len > total_bytes_recvd) {
-                    int bytes_recvd;
-                    if ((bytes_recvd = recv(client_fd, buffer+total_bytes_recvd, BUFFERSIZE-total_bytes_recvd, 0)) < 0) { // TODO: add timeout
-                        set_err_500("failed to read data from socket", arena);
-                        goto processing_fasttrack;
-                    }
 
-                    total_bytes_recvd += bytes_recvd;
-                }
+            if (bytes_recvd < 0 && errno == EINTR)
+                continue;
+
+            if (bytes_recvd <= 0) // closed or reset
+                goto connection_terminated;
+
+            buffer = input->data; // moved on to a larger buffer
+            capture_data(conn->id, buffer+total_bytes_recvd, bytes_recvd);
+            total_bytes_recvd += bytes_recvd;
+        }
+
+        trace_mark(TRACE_RECV);
+
+        if (!ratelimit_allow(conn->rate_key)) { // over its request rate: precomputed 429, then close
+            tls_send(conn->tls, client_fd, g_res_429.ptr, g_res_429.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+            goto connection_terminated;
+        }
+
+        if (!tracker) {
+            errno = EMSGSIZE;
+            set_err_500("request headers too long, see --max-request-kb", arena);
+            goto request_unreadable;
+        }
+
+        req = http_parse_req_headers(buffer, total_bytes_recvd, arena);
+        trace_mark(TRACE_PARSE);
+
+        const struct upload_route *upload_route;
 
-                req->body = (struct sized_str) { .ptr = arena_alloc(arena, req->content_length), req->content_length };
-                memcpy(req->body.ptr, buffer, req_len);
+        if ((req->method == PUT || req->method == POST) && (upload_route = upload_route_for(req->url_path))) {
+            int upload_status;
+
+            conn->upload = upload_begin(upload_route, req->url_path, req->method,
+                req->has_content_length ? req->content_length : (size_t) -1, req->chunked, &upload_status, arena);
+
+            if (!conn->upload) { // the body is left unread, so the connection cannot carry another request
+                req->body_status = upload_status;
+                close_after = 1;
+                goto processing_fasttrack;
+            }
+
+            if (req->expect_continue && (size_t) total_bytes_recvd == req->headers_length)
+                tls_send(conn->tls, client_fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_NOSIGNAL);
+
+            // the start of the body came in with the headers, whatever follows it is the next request
+            const ssize_t body_in_buffer = upload_feed(conn->upload, buffer + req->headers_length, total_bytes_recvd - req->headers_length);
+            req_len = req->headers_length + (body_in_buffer > 0 ? body_in_buffer : 0);
+
+        upload_resume:
+            switch ((upload_status = upload_pump(conn->upload, client_fd, conn->tls))) {
+                case 0: // the socket ran dry: wait for the rest on the poller, not on a worker
+                    arena_clear(arena);
+                    if (conn_park(client_fd, 0) < 0)
+                        goto connection_terminated;
+                    goto next_connection;
+                case -1:
+                    goto connection_terminated;
+                case 1:
+                    req->body_status = upload_finish(&conn->upload);
+                    break;
+                default: // refused midway, the rest of the body is not read
+                    upload_abort(&conn->upload);
+                    req->body_status = upload_status;
+                    close_after = 1;
             }
 
-            memmove(buffer, buffer+req_len, total_bytes_recvd-req_len);
-            offset = total_bytes_recvd-req_len;
-            memset(buffer+offset, 0, BUFFERSIZE-offset);
+            trace_mark(TRACE_RECV);
+            goto processing_fasttrack;
+        }
 
-        processing_fasttrack:;
-            struct http_reply *reply = http_process_req(req, arena);
+        if (req->chunked) { // only uploads read chunked bodies, the chunks must not pass for the next request
+            req->body_status = 411;
+            close_after = 1;
+            goto processing_fasttrack;
+        }
 
-            log_req(req, reply);
+        req_len = req->headers_length + req->content_length;
+        if (req_len > max_request) {
+            errno = EMSGSIZE;
+            set_err_500("request body too long, see --max-request-kb", arena);
+            close_after = 1;
+            goto processing_fasttrack;
+        }
 
-            const struct sized_str res = http_prepare_res(reply, req, arena);
+        if (req_len > input->cap) { // the body does not fit next to the headers: parse again in a bigger buffer
+            struct recv_buffer *fitted = recv_buffer_fit(input, req_len);
 
-            int total_bytes_sent = 0;
+            if (!fitted) {
+                set_err_500("no memory for the request body", arena);
+                close_after = 1;
+                goto processing_fasttrack;
+            }
+            input = fitted;
+            buffer = input->data;
+            req = http_parse_req_headers(buffer, total_bytes_recvd, arena);
+        }
 
-            while (total_bytes_sent < res.len) {
-                const int bytes_sent = send(client_fd, res.ptr+total_bytes_sent, res.len-total_bytes_sent, 0);
-                if (bytes_sent < 0) {
-                    perror("\033[1;31merror:\033[0m send() failed, cannot respond to client");
+        if (req->content_length) {
+            while (req_len > total_bytes_recvd) {
+                const ssize_t bytes_recvd = recv_wait(client_fd, conn->tls, buffer+total_bytes_recvd, input->cap-total_bytes_recvd);
+                if (bytes_recvd <= 0)
                     goto connection_terminated;
-                }
-                total_bytes_sent += bytes_sent;
+
+                capture_data(conn->id, buffer+total_bytes_recvd, bytes_recvd);
+                total_bytes_recvd += bytes_recvd;
             }
 
-            arena_clear(arena);
+            req->body = (struct sized_str) { .ptr = buffer+req->headers_length, req->content_length };
+            trace_mark(TRACE_RECV);
         }
 
-    connection_terminated:
-        if (shutdown(client_fd, SHUT_WR) < 0)
-            perror("\033[1;31merror:\033[0m shutdown() of socket failed");
+        goto processing_fasttrack;
+
+    request_incomplete: // the client paused mid-headers: it waits on the poller with what it sent so far
+        conn->input = input; // already the smallest class that holds it
+        input = NULL;
+        if (conn_park(client_fd, 0) < 0)
+            goto connection_terminated;
+        goto next_connection;
+
+    request_unreadable: // nothing parseable, answer the error and drop the connection
+        req = arena_alloc(arena, sizeof *req);
+        *req = (struct http_req) { .method = METHOD_COUNT };
+        close_after = 1;
+
+    processing_fasttrack:
+        // Proxied requests wait on the upstream, they stay here where waiting is cheap: a stage taken from
+        // the deque runs outside any coroutine, and upstream connections belong to the worker that opened
+        // them. Their reply never points into the bundle or the 404 page, so the watcher does not wait on them.
+        proxied = http_proxy_route(req, arena) != NULL;
+        struct request_stage stage = { .req = req, .arena = arena };
+
+        if (proxied)
+            run_process_stage(&stage);
+        else {
+            rcu_read_lock(); // reply may point into the bundle until it is sent
+            if (req->method != METHOD_COUNT)
+                worksteal_run(run_process_stage, &stage);
+            else
+                run_process_stage(&stage);
+        }
 
-        close(client_fd);
+        struct http_reply *reply = stage.reply;
+        close_after |= reply->close_after;
+
+        log_req(req, reply);
+        trace_mark(TRACE_LOG);
+
+        if (reply->compress_offload) {
+            conn->close_after = close_after; // set up before the pool can touch the connection
+            if (!close_after)
+                conn_save_input(conn, buffer+req_len, total_bytes_recvd-req_len);
+
+            if (!offload_compression(client_fd, req, reply)) {
+                trace_mark(TRACE_COMPRESS);
+                trace_end(req->method, req->url_path, reply->status, arena_used(arena));
+                if (!proxied)
+                    rcu_read_unlock();
+                arena_clear(arena);
+                goto next_connection;
+            }
+
+            conn->close_after = 0;
+            recv_buffer_put(&conn->input); // still in the buffer, just drop the copy
+            worksteal_run(run_compress_stage, &stage);
+        }
+
+        const struct sized_str res_headers = http_prepare_res(reply, arena);
+        trace_mark(TRACE_HEADERS);
+
+        const int send_retval = send_reply(conn, client_fd, res_headers, reply, req);
+        trace_mark(TRACE_SEND);
+        trace_end(req->method, req->url_path, reply->status, arena_used(arena));
+        if (!proxied)
+            rcu_read_unlock();
+
+        if (send_retval < 0) {
+            perror("\033[1;31merror:\033[0m sending failed, cannot respond to client");
+            goto connection_terminated;
+        }
+
+        arena_clear(arena);
+
+        if (!send_retval) { // slow reader: the poller finishes the reply, then hands the connection back
+            conn->close_after = close_after;
+            if (!close_after)
+                conn_save_input(conn, buffer+req_len, total_bytes_recvd-req_len);
+            if (conn_park(client_fd, 1) < 0)
+                goto connection_terminated;
+            goto next_connection;
+        }
+
+        if (close_after)
+            goto connection_terminated;
+
+        // reply is out, the request's bytes can go; keep what was pipelined behind it
+        if ((offset = total_bytes_recvd-req_len)) {
+            memmove(buffer, buffer+req_len, offset);
+            input->len = offset;
+        } else
+            recv_buffer_put(&input); // nothing unread, the buffer goes back to the pool until data arrives
     }
 
-    arena_free(&arena);
+connection_terminated:
+    arena_clear(arena);
+    g_err_500_msg = NULL;
+    conn_close(client_fd);
+
+next_connection:
+    recv_buffer_put(&input);
+    arena_trim(arena, ARENA_KEEP_BYTES);
+
+    if (t_arena_count < ARENA_POOL_SIZE)
+        t_arenas[t_arena_count++] = arena;
+    else
+        arena_free(&arena);
+
+    return;
+}
+
+// on the worker's loop, when its socket queue has connections: each one starts as a coroutine
+void on_queue_ready(void *ctx) {
+    struct socket_queue *queue = ctx;
+
+    for (int i = 0; i < SPAWN_BATCH && coro_live() < g_config.coro_max; i++) {
+        const int client_fd = dequeue(queue);
+
+        if (client_fd < 0) // taken by another worker
+            break;
+
+        if (coro_spawn(serve_connection, (void *) (intptr_t) client_fd) < 0) {
+            perror("\033[1;31merror:\033[0m coro_spawn() failed, client dropped");
+            conn_close(client_fd);
+        }
+    }
+
+    return;
+}
+
+void *handle_client(void *args) {
+    pthread_detach(pthread_self()); // TODO: this, or join after interrupt during cleanup?
+
+    struct socket_queue *queue = args;
+
+    // already running on our CPU (affinity is set at creation), so coroutine stacks and arenas are first
+    // touched, and therefore placed, on the local NUMA node
+
+    rcu_register_thread();
+    trace_register_thread();
+
+    size_t trace_size;
+    void *trace_state = trace_current(&trace_size);
+
+    // the error message and the trace record belong to the request, not to the worker
+    if (coro_thread_init() < 0 || coro_local(&g_err_500_msg, sizeof g_err_500_msg) < 0
+        || (trace_state && coro_local(trace_state, trace_size) < 0))
+        error_exit("coro_thread_init()");
+
+    if (coro_watch(socket_queue_fd(queue), on_queue_ready, queue, 1) < 0 || worksteal_register(g_config.pin_threads ? sched_getcpu() : -1) < 0)
+        error_exit("worksteal_register()");
+
+    coro_run(worksteal_run_tasks, NULL);
 
     return NULL;
 }
 
-int main(void) {
-    pthread_t threads[THREAD_POOL_SIZE];
-    for (int i = 0; i < THREAD_POOL_SIZE; i++)
-		pthread_create(&threads[i], NULL, handle_client, NULL);
+// publish the new bundle, wait until no worker can still be using the old one, then free it
+void bundle_replace(struct bundle *new_bundle) {
+    struct bundle *old_bundle = atomic_exchange(&g_bundle, new_bundle);
 
-    const int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    rcu_synchronize();
+    bundle_close(&old_bundle);
 
-    const int reuse = 1;
-	if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse) < 0)
-		error_exit("setsockopt(SO_REUSEADDR)");
+    return;
+}
 
-    {
-        const struct sockaddr_in saddr = {
-            .sin_family = AF_INET,
-            .sin_port = htons(DEFAULT_PORT),
-            .sin_addr.s_addr = htonl(INADDR_ANY)
-        };
+struct error_page *error_page_load(const char *path) {
+    struct arena *arena = arena_new();
+    struct error_page *page = NULL;
 
-        if (bind(socket_fd, (const struct sockaddr *) &saddr, sizeof saddr) < 0)
-            error_exit("bind()");
+    if (!arena)
+        return NULL;
+
+    const struct sized_str body = read_file((struct sized_str) { .ptr = (char *) path, .len = strlen(path) }, arena);
+
+    if (body.len && (page = malloc(sizeof *page + 2 * body.len))) {
+        page->body = (struct sized_str) { .ptr = (char *) (page + 1), .len = body.len };
+        memcpy(page->body.ptr, body.ptr, body.len);
+
+        const size_t gzip_len = gzip_compress(page->body.ptr + body.len, body);
+        page->gzip = (struct sized_str) { .ptr = page->body.ptr + body.len, .len = gzip_len < body.len ? gzip_len : 0 };
     }
 
-    const int connection_backlog = 0;
-    if (listen(socket_fd, connection_backlog) < 0)
-        error_exit("listen()");
+    g_err_500_msg = NULL; // unreadable is treated as missing: 404s go out without a body
+    arena_free(&arena);
 
-    printf("Server online, awaiting connections...\n");
+    return page;
+}
+
+void error_page_replace(struct error_page *new_page) {
+    struct error_page *old_page = atomic_exchange(&g_page_404, new_page);
+
+    rcu_synchronize();
+    free(old_page);
+
+    return;
+}
+
+// changed paths fall back to the file system until the bundle is rebuilt
+void on_serve_dir_change(const struct sized_str *paths, size_t count, void *ctx) {
+    struct bundle *bundle = atomic_load(&g_bundle);
+    const struct sized_str everything = { .ptr = "/", .len = 1 };
+
+    metacache_invalidate();
+    error_page_replace(error_page_load("/404.html"));
+
+    if (!bundle)
+        return;
+
+    if (!paths) {
+        paths = &everything;
+        count = 1;
+    }
+
+    bundle_replace(bundle_mark_stale(bundle, paths, count)); // on allocation failure, drop the bundle entirely
+
+    print_to_log("%zu path(s) changed in %s/, serving them from disk until `make bundle`", count, filedir);
+
+    return;
+}
+
+void on_bundle_dir_change(const struct sized_str *paths, size_t count, void *ctx) {
+    int bundle_changed = !paths;
+
+    for (size_t i = 0; i < count && !bundle_changed; i++)
+        bundle_changed = is_same_string(paths[i], BUNDLE_NAME);
+
+    if (!bundle_changed)
+        return;
+
+    struct bundle *bundle = bundle_open(BUNDLE_PATH);
+    bundle_replace(bundle);
 
-    struct sockaddr_in client_addr;
-    int client_length = sizeof client_addr;
+    if (bundle)
+        print_to_log("Reloaded %u entries from %s", bundle_entry_count(bundle), BUNDLE_PATH);
+    else
+        print_to_log("%s missing or invalid, serving from disk", BUNDLE_PATH);
+
+    return;
+}
+
+// workers are spread over the usable CPUs in NUMA node order and pinned from their first instruction
+void start_workers(const struct cpu_topology *topology) {
+    const int thread_count = g_config.threads ? g_config.threads : topology->cpu_count * g_config.threads_per_cpu;
+
+    const int stealing = worksteal_init(thread_count, topology->cpu_count);
+    if (stealing < 0)
+        error_exit("worksteal_init()");
+
+    for (int i = 0; i < thread_count; i++) {
+        const int cpu = topology->cpus[i % topology->cpu_count];
+
+        if (!g_config.incoming_cpu && !g_queue_count)
+            g_queues[g_queue_count++] = socket_queue_new(g_config.queue_depth);
+        else if (g_config.incoming_cpu && !g_cpu_queues[cpu])
+            g_queues[g_queue_count++] = g_cpu_queues[cpu] = socket_queue_new(g_config.queue_depth);
+
+        struct socket_queue *queue = g_config.incoming_cpu ? g_cpu_queues[cpu] : g_queues[0];
+        if (!queue)
+            error_exit("socket_queue_new()");
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+
+        if (g_config.pin_threads) {
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(cpu, &cpu_set);
+            pthread_attr_setaffinity_np(&attr, sizeof cpu_set, &cpu_set);
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, handle_client, queue))
+            error_exit("pthread_create()");
+
+        pthread_attr_destroy(&attr);
+    }
+
+    printf("%d workers on %d CPUs (%d NUMA node%s)%s%s%s\n", thread_count, topology->cpu_count, topology->node_count,
+        topology->node_count == 1 ? "" : "s", g_config.pin_threads ? ", pinned" : "",
+        g_config.incoming_cpu ? ", steered by SO_INCOMING_CPU" : "", stealing ? ", work stealing" : "");
+
+    return;
+}
+
+struct socket_queue *queue_for(const int client_fd) {
+    static atomic_uint next_queue;
+
+    if (!g_config.incoming_cpu)
+        return g_queues[0];
+
+    int cpu;
+    socklen_t length = sizeof cpu;
+
+    if (!getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) && cpu >= 0 && cpu < TOPOLOGY_MAX_CPUS && g_cpu_queues[cpu])
+        return g_cpu_queues[cpu];
+
+    return g_queues[atomic_fetch_add_explicit(&next_queue, 1, memory_order_relaxed) % g_queue_count]; // no worker on that CPU
+}
+
+// called by the poller thread once a parked connection has a request (or its pipelined one) ready
+int resume_connection(const int client_fd) {
+    return try_enqueue(queue_for(client_fd), client_fd);
+}
+
+struct sized_str prepare_res_close(const int status) {
+    static const char rest[] = "Retry-After: " RETRY_AFTER_SECONDS "\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    const struct sized_str status_line = header_template(status, HEADER_NO_CONTENT_TYPE, 0);
+    const struct sized_str res = { .ptr = malloc(status_line.len + sizeof rest - 1), .len = status_line.len + sizeof rest - 1 };
+
+    if (!res.ptr)
+        error_exit("malloc()");
+
+    memcpy(res.ptr, status_line.ptr, status_line.len);
+    memcpy(res.ptr + status_line.len, rest, sizeof rest - 1);
+
+    return res;
+}
+
+// load shedding from the accept thread: never blocks, one send attempt, then close (a TLS client could not
+// read the 503 before a handshake, it just sees the close)
+void shed_connection(const int client_fd, const int secure) {
+    static unsigned long shed_count;
+    static time_t last_report;
+
+    if (!secure)
+        send(client_fd, g_res_503.ptr, g_res_503.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_fd);
+
+    shed_count++;
+    if (time(NULL) != last_report) {
+        last_report = time(NULL);
+        print_to_log("\033[1;31m503\033[0m overloaded, %lu connection(s) shed so far", shed_count);
+    }
+
+    return;
+}
+
+// hands a freshly accepted connection to a worker queue, or turns it away (accept thread)
+void admit_connection(const int client_fd, const struct sockaddr *client_addr, const int secure) {
+    const uint64_t rate_key = ratelimit_key(client_addr); // 0 for Unix peers
+
+    if (ratelimit_conn_open(rate_key) < 0) { // over its connection limit, not worth an answer
+        close(client_fd);
+        return;
+    }
+
+    struct socket_queue *queue = queue_for(client_fd);
+    struct conn *conn = conn_open(client_fd);
+
+    if (conn) { // before a worker can close it
+        conn->rate_key = rate_key;
+        conn->secure = secure;
+    }
+
+    if (!conn || socket_queue_wait_ms(queue) > g_config.max_queue_wait_ms || try_enqueue(queue, client_fd) < 0) {
+        ratelimit_conn_close(rate_key);
+        shed_connection(client_fd, secure);
+    }
+
+    return;
+}
+
+int main(int argc, char **argv) {
+    config_parse(argc, argv);
+
+    if (trace_init(BUNDLE_DIR) < 0) // before any thread is started
+        error_exit("trace_init()");
+
+    if (g_config.capture_path && capture_init(g_config.capture_path) < 0)
+        error_exit("capture_init()");
+
+    if (header_templates_init() < 0)
+        error_exit("header_templates_init()");
+
+    if (metacache_init() < 0)
+        error_exit("metacache_init()");
+
+    atomic_store(&g_page_404, error_page_load("/404.html"));
+
+    struct bundle *bundle = bundle_open(BUNDLE_PATH);
+    if (bundle)
+        printf("Serving %u entries from %s\n", bundle_entry_count(bundle), BUNDLE_PATH);
+    atomic_store(&g_bundle, bundle);
+
+    if (watcher_watch(filedir, 1, on_serve_dir_change, NULL) < 0 || watcher_watch(BUNDLE_DIR, 0, on_bundle_dir_change, NULL) < 0
+        || watcher_start() < 0)
+        perror("\033[1;31merror:\033[0m file watcher not started, changes need a restart");
+
+    struct cpu_topology topology;
+    if (topology_read(&topology) < 0)
+        error_exit("topology_read()");
+
+    if (conn_table_init() < 0)
+        error_exit("conn_table_init()");
+
+    signal(SIGPIPE, SIG_IGN); // splice() into a client that went away would raise it
+
+    if (tls_init() < 0)
+        error_exit("tls_init()");
+
+    if (proxy_init() < 0)
+        error_exit("proxy_init()");
+
+    if (upload_init() < 0)
+        error_exit("upload_init()");
+
+    if (ratelimit_init() < 0)
+        error_exit("ratelimit_init()");
+
+    start_workers(&topology);
+
+    if (compress_pool_start(g_config.compress_threads) < 0)
+        error_exit("compress_pool_start()");
+
+    if (conn_poller_start(resume_connection) < 0)
+        error_exit("conn_poller_start()");
+
+    struct listener listeners[CONFIG_MAX_LISTENERS];
+    const int listen_count = g_config.listen_count ? g_config.listen_count : 1;
+
+    const int accept_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (accept_epoll < 0)
+        error_exit("epoll_create1()");
+
+    for (int i = 0; i < listen_count; i++) {
+        if (listener_open(&listeners[i], g_config.listen_count ? g_config.listen_specs[i] : DEFAULT_LISTEN) < 0)
+            error_exit("listener_open()");
+
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = i };
+        if (epoll_ctl(accept_epoll, EPOLL_CTL_ADD, listeners[i].fd, &event) < 0)
+            error_exit("epoll_ctl()");
+
+        printf("Listening on %s%s\n", listeners[i].spec, g_config.listen_tls[i] ? " (TLS)" : "");
+    }
+
+    g_res_503 = prepare_res_close(503);
+    g_res_429 = prepare_res_close(429);
+
+    // reserved so that running out of descriptors does not leave connections stuck in the backlog
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    printf("Server online, awaiting connections...\n");
 
     while (1) {
-        int client_fd;
+        struct epoll_event events[CONFIG_MAX_LISTENERS];
+        const int ready = epoll_wait(accept_epoll, events, CONFIG_MAX_LISTENERS, -1);
 
-        if ((client_fd = accept(socket_fd, (struct sockaddr *) &client_addr, (socklen_t *) &client_length)) < 0)
-            perror("\033[1;31merror:\033[0m accept() failed, client dropped");
+        for (int e = 0; e < ready; e++) {
+            const int listen_fd = listeners[events[e].data.u32].fd;
+            const int secure = g_config.listen_tls[events[e].data.u32];
 
-        enqueue(client_fd);
+            // bounded, so a flooded listener cannot starve the others (level-triggered, the rest waits)
+            for (int n = 0; n < ACCEPT_BATCH; n++) {
+                struct sockaddr_storage client_addr;
+                socklen_t client_length = sizeof client_addr;
+
+                const int client_fd = accept4(listen_fd, (struct sockaddr *) &client_addr, &client_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+                if (client_fd < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        break;
+
+                    if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+                        close(spare_fd);
+
+                        const int dropped_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                        if (dropped_fd >= 0)
+                            shed_connection(dropped_fd, secure);
+
+                        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    } else if (errno != EINTR && errno != ECONNABORTED) {
+                        perror("\033[1;31merror:\033[0m accept4() failed, client dropped");
+                        break;
+                    }
+
+                    continue;
+                }
+
+                admit_connection(client_fd, (const struct sockaddr *) &client_addr, secure);
+            }
+        }
     }
 
-    close(socket_fd);
+    for (int i = 0; i < listen_count; i++)
+        close(listeners[i].fd);
 
     return 0;
 }
@@ -0,0 +1,702 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "lib.h"
+
+// Re-drives a capture made with `http_server --capture FILE` against a server, with the original timing
+// (scaled by --speed) or as fast as possible, optionally opening every connection N times (--amplify).
+// Reports throughput and latency percentiles, and compares responses against a baseline saved by an
+// earlier run (Date lines excluded).
+// Usage: replay [options] <capture file>
+
+#define IDLE_GIVE_UP_MS 5000
+#define MAX_EVENTS 256
+#define MAX_REPORTED_DIFFS 10
+
+struct pending_req {
+    size_t stream_end; // offset just past the request in the connection's outgoing bytes
+    uint64_t sent_ns; // 0 until its last byte has been written
+    int is_head;
+};
+
+struct replay_conn {
+    uint32_t capture_id;
+    int copy;
+    int fd;
+    int connected;
+    int close_requested;
+    int done;
+    uint32_t response_count;
+
+    char *out; // everything the capture sent on this connection so far
+    size_t out_len, out_cap, out_sent, framed;
+
+    struct pending_req *reqs;
+    size_t req_head, req_count, req_cap;
+
+    char *in;
+    size_t in_len, in_cap;
+};
+
+struct response {
+    uint32_t capture_id;
+    uint32_t seq;
+    uint32_t status;
+    uint64_t hash;
+};
+
+static struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    double speed; // 0: as fast as possible
+    int amplify;
+    const char *save_baseline;
+    const char *baseline;
+} g_opts = { .speed = 1.0, .amplify = 1 };
+
+static int g_epoll_fd;
+static int g_active_conns;
+
+static uint64_t *g_latencies;
+static size_t g_latency_count, g_latency_cap;
+static struct response *g_responses;
+static size_t g_response_count, g_response_cap;
+static unsigned long g_failed_conns, g_unanswered;
+
+#define GROW(array, count, cap) \
+    do { \
+        if ((count) == (cap)) { \
+            (cap) = (cap) ? 2 * (cap) : 64; \
+            if (!((array) = realloc((array), (cap) * sizeof *(array)))) \
+                error_exit("realloc()"); \
+        } \
+    } while (0)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t fnv1a(uint64_t h, const char *data, const size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+// value of a header in a header block, -1 when absent
+static long header_value(const char *headers, const size_t len, const char *name) {
+    const size_t name_len = strlen(name);
+
+    for (const char *line = headers; line && line < headers + len; ) {
+        const char *end = memmem(line, headers + len - line, "\r\n", 2);
+
+        if (end && (size_t) (end - line) > name_len && !strncasecmp(line, name, name_len) && line[name_len] == ':')
+            return strtol(line + name_len + 1, NULL, 10);
+
+        line = end ? end + 2 : NULL;
+    }
+
+    return -1;
+}
+
+static void conn_close_fd(struct replay_conn *conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd); // also leaves the epoll set
+        conn->fd = -1;
+        g_active_conns--;
+    }
+
+    conn->done = 1;
+    g_unanswered += conn->req_count;
+    conn->req_count = 0;
+
+    return;
+}
+
+static int conn_connect(struct replay_conn *conn) {
+    const int fd = socket(g_opts.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    const int one = 1;
+    if (g_opts.addr.ss_family != AF_UNIX)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if (connect(fd, (const struct sockaddr *) &g_opts.addr, g_opts.addr_len) < 0 && errno != EINPROGRESS && errno != EAGAIN) {
+        close(fd);
+        return -1;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    conn->fd = fd;
+    g_active_conns++;
+
+    return 0;
+}
+
+// split newly captured bytes into requests (headers up to the blank line, then Content-Length bytes)
+static void conn_frame_requests(struct replay_conn *conn) {
+    while (1) {
+        const char *start = conn->out + conn->framed;
+        const char *blank = memmem(start, conn->out_len - conn->framed, "\r\n\r\n", 4);
+        if (!blank)
+            return;
+
+        const long content_length = header_value(start, blank + 2 - start, "content-length");
+        const size_t end = blank + 4 - conn->out + (content_length > 0 ? content_length : 0);
+        if (end > conn->out_len)
+            return;
+
+        GROW(conn->reqs, conn->req_head + conn->req_count, conn->req_cap);
+        conn->reqs[conn->req_head + conn->req_count++] = (struct pending_req) {
+            .stream_end = end,
+            .is_head = !strncmp(start, "HEAD ", 5)
+        };
+        conn->framed = end;
+    }
+}
+
+static void conn_maybe_finish(struct replay_conn *conn) {
+    if (conn->close_requested && !conn->req_count && conn->out_sent == conn->out_len && conn->fd >= 0)
+        conn_close_fd(conn);
+
+    return;
+}
+
+static void conn_flush(struct replay_conn *conn) {
+    while (conn->connected && conn->out_sent < conn->out_len) {
+        const ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                conn_close_fd(conn);
+            break;
+        }
+
+        conn->out_sent += sent;
+    }
+
+    const uint64_t now = now_ns();
+
+    for (size_t i = conn->req_head; i < conn->req_head + conn->req_count && conn->reqs[i].stream_end <= conn->out_sent; i++)
+        if (!conn->reqs[i].sent_ns)
+            conn->reqs[i].sent_ns = now;
+
+    conn_maybe_finish(conn);
+
+    return;
+}
+
+// the whole response except its Date line, which changes from run to run
+static uint64_t response_hash(const char *res, const size_t header_len, const size_t len) {
+    const char *date = memmem(res, header_len, "\r\nDate:", 7);
+
+    if (!date)
+        return fnv1a(0xcbf29ce484222325ULL, res, len);
+
+    const char *date_end = memmem(date + 2, res + header_len - date - 2, "\r\n", 2);
+    const uint64_t h = fnv1a(0xcbf29ce484222325ULL, res, date - res);
+
+    return fnv1a(h, date_end, res + len - date_end);
+}
+
+static void conn_read(struct replay_conn *conn) {
+    while (conn->fd >= 0) {
+        if (conn->in_cap - conn->in_len < 4096) {
+            conn->in_cap = conn->in_cap ? 2 * conn->in_cap : 16384;
+            if (!(conn->in = realloc(conn->in, conn->in_cap)))
+                error_exit("realloc()");
+        }
+
+        const ssize_t received = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
+
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (received <= 0) { // closed by the server, whatever is still outstanding was not answered
+            conn_close_fd(conn);
+            return;
+        }
+
+        conn->in_len += received;
+
+        while (1) {
+            const char *blank = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+            if (!blank)
+                break;
+
+            const size_t header_len = blank + 4 - conn->in;
+            const int status = conn->in_len > 12 ? atoi(conn->in + 9) : 0;
+            const int is_head = conn->req_count && conn->reqs[conn->req_head].is_head;
+            const long content_length = header_value(conn->in, header_len, "content-length");
+            const size_t body_len = is_head || status / 100 == 1 || status == 204 || status == 304 || content_length < 0 ? 0 : content_length;
+
+            if (conn->in_len < header_len + body_len)
+                break;
+
+            if (conn->req_count) {
+                const struct pending_req *req = &conn->reqs[conn->req_head];
+                const uint64_t now = now_ns();
+
+                GROW(g_latencies, g_latency_count, g_latency_cap);
+                g_latencies[g_latency_count++] = req->sent_ns ? now - req->sent_ns : 0; // answered before fully sent
+
+                conn->req_head++;
+                conn->req_count--;
+            }
+
+            if (!conn->copy) {
+                GROW(g_responses, g_response_count, g_response_cap);
+                g_responses[g_response_count++] = (struct response) {
+                    .capture_id = conn->capture_id,
+                    .seq = conn->response_count,
+                    .status = status,
+                    .hash = response_hash(conn->in, header_len, header_len + body_len)
+                };
+            }
+
+            conn->response_count++;
+
+            memmove(conn->in, conn->in + header_len + body_len, conn->in_len - header_len - body_len);
+            conn->in_len -= header_len + body_len;
+        }
+    }
+
+    conn_maybe_finish(conn);
+
+    return;
+}
+
+static void conn_on_event(struct replay_conn *conn, const uint32_t events) {
+    if (conn->fd < 0) // closed earlier in the same batch of events
+        return;
+
+    if (!conn->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t length = sizeof error;
+
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+            g_failed_conns++;
+            conn_close_fd(conn);
+            return;
+        }
+
+        conn->connected = 1;
+    }
+
+    if (events & EPOLLOUT)
+        conn_flush(conn);
+    if (conn->fd >= 0 && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        conn_read(conn);
+
+    return;
+}
+
+static void conn_issue(struct replay_conn *conn, const struct capture_record *record, const char *payload) {
+    if (conn->done)
+        return;
+
+    if (record->type == CAPTURE_CLOSE) {
+        conn->close_requested = 1;
+        conn_maybe_finish(conn);
+        return;
+    }
+
+    if (conn->fd < 0 && conn_connect(conn) < 0) {
+        g_failed_conns++;
+        conn->done = 1;
+        return;
+    }
+
+    while (conn->out_len + record->len > conn->out_cap) {
+        conn->out_cap = conn->out_cap ? 2 * conn->out_cap : 4096;
+        if (!(conn->out = realloc(conn->out, conn->out_cap)))
+            error_exit("realloc()");
+    }
+
+    memcpy(conn->out + conn->out_len, payload, record->len);
+    conn->out_len += record->len;
+
+    conn_frame_requests(conn);
+    conn_flush(conn); // edge triggered, EPOLLOUT will not fire again while the socket stays writable
+
+    return;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    const uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_response(const void *a, const void *b) {
+    const struct response *x = a, *y = b;
+
+    if (x->capture_id != y->capture_id)
+        return (x->capture_id > y->capture_id) - (x->capture_id < y->capture_id);
+
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static char *load_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        error_exit(path);
+
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *data = malloc(*len + 1);
+    if (!data || fread(data, 1, *len, f) != *len)
+        error_exit(path);
+
+    data[*len] = '\0';
+    fclose(f);
+
+    return data;
+}
+
+static void save_baseline(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+        error_exit(path);
+
+    for (size_t i = 0; i < g_response_count; i++)
+        fprintf(f, "%u %u %u %016llx\n", g_responses[i].capture_id, g_responses[i].seq, g_responses[i].status,
+            (unsigned long long) g_responses[i].hash);
+
+    if (fclose(f))
+        error_exit(path);
+
+    printf("baseline: %zu responses saved to %s\n", g_response_count, path);
+
+    return;
+}
+
+static void compare_baseline(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        error_exit(path);
+
+    struct response *expected = NULL;
+    size_t expected_count = 0, expected_cap = 0;
+    struct response r;
+    unsigned long long hash;
+
+    while (fscanf(f, "%u %u %u %llx", &r.capture_id, &r.seq, &r.status, &hash) == 4) {
+        r.hash = hash;
+        GROW(expected, expected_count, expected_cap);
+        expected[expected_count++] = r;
+    }
+
+    fclose(f);
+
+    qsort(expected, expected_count, sizeof *expected, compare_response);
+
+    size_t i = 0, j = 0;
+    unsigned long differ = 0, missing = 0, extra = 0;
+
+    while (i < expected_count || j < g_response_count) {
+        const int order = i == expected_count ? 1 : j == g_response_count ? -1 : compare_response(&expected[i], &g_responses[j]);
+
+        if (order < 0) {
+            if (missing++ < MAX_REPORTED_DIFFS)
+                printf("  missing: connection %u response %u (baseline status %u)\n", expected[i].capture_id, expected[i].seq, expected[i].status);
+            i++;
+        } else if (order > 0) {
+            extra++;
+            j++;
+        } else {
+            if (expected[i].hash != g_responses[j].hash && differ++ < MAX_REPORTED_DIFFS)
+                printf("  differs: connection %u response %u (status %u, baseline %u)\n", g_responses[j].capture_id,
+                    g_responses[j].seq, g_responses[j].status, expected[i].status);
+            i++;
+            j++;
+        }
+    }
+
+    printf("baseline: %zu responses compared, %lu differ, %lu missing, %lu not in baseline\n", expected_count, differ, missing, extra);
+    free(expected);
+
+    return;
+}
+
+static void print_usage(const char *prog) {
+    printf("usage: %s [options] <capture file>\n"
+        "  --host ADDR           IPv4 or IPv6 address of the server (default 127.0.0.1)\n"
+        "  --port N              (default 80)\n"
+        "  --unix PATH           connect to a Unix socket instead, @name for the abstract namespace\n"
+        "  --speed X             replay at X times the captured pace (default 1)\n"
+        "  --fast                ignore the captured timing, send as fast as possible\n"
+        "  --amplify N           open every captured connection N times\n"
+        "  --save-baseline FILE  store response hashes for later comparison\n"
+        "  --baseline FILE       compare responses against a saved baseline\n",
+        prog
+    );
+
+    return;
+}
+
+static void parse_args(int argc, char **argv) {
+    static const struct option options[] = {
+        { "host", required_argument, NULL, 'h' },
+        { "port", required_argument, NULL, 'p' },
+        { "unix", required_argument, NULL, 'u' },
+        { "speed", required_argument, NULL, 's' },
+        { "fast", no_argument, NULL, 'f' },
+        { "amplify", required_argument, NULL, 'a' },
+        { "save-baseline", required_argument, NULL, 'S' },
+        { "baseline", required_argument, NULL, 'b' },
+        { 0 }
+    };
+
+    struct sockaddr_in *in = (struct sockaddr_in *) &g_opts.addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &g_opts.addr;
+    struct sockaddr_un *un = (struct sockaddr_un *) &g_opts.addr;
+    int port = 80;
+
+    *in = (struct sockaddr_in) { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    g_opts.addr_len = sizeof *in;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                if (inet_pton(AF_INET, optarg, &in->sin_addr) == 1) {
+                    *in = (struct sockaddr_in) { .sin_family = AF_INET, .sin_addr = in->sin_addr };
+                    g_opts.addr_len = sizeof *in;
+                } else if (inet_pton(AF_INET6, optarg, &in6->sin6_addr) == 1) {
+                    *in6 = (struct sockaddr_in6) { .sin6_family = AF_INET6, .sin6_addr = in6->sin6_addr };
+                    g_opts.addr_len = sizeof *in6;
+                } else {
+                    fprintf(stderr, "%s: invalid address: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'u': {
+                const size_t len = strlen(optarg);
+
+                if (len < 2 || len >= sizeof un->sun_path) {
+                    fprintf(stderr, "%s: invalid socket path: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                *un = (struct sockaddr_un) { .sun_family = AF_UNIX };
+                memcpy(un->sun_path, optarg, len);
+                if (optarg[0] == '@') // abstract namespace
+                    un->sun_path[0] = '\0';
+                g_opts.addr_len = offsetof(struct sockaddr_un, sun_path) + len + (optarg[0] != '@');
+                break;
+            }
+            case 's':
+                if ((g_opts.speed = atof(optarg)) <= 0) {
+                    fprintf(stderr, "%s: invalid speed: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                g_opts.speed = 0;
+                break;
+            case 'a':
+                if ((g_opts.amplify = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "%s: invalid amplification: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                g_opts.save_baseline = optarg;
+                break;
+            case 'b':
+                g_opts.baseline = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (g_opts.addr.ss_family == AF_INET)
+        in->sin_port = htons(port);
+    else if (g_opts.addr.ss_family == AF_INET6)
+        in6->sin6_port = htons(port);
+
+    return;
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+
+    size_t capture_len;
+    char *capture = load_file(argv[optind], &capture_len);
+
+    if (capture_len < sizeof(struct capture_header) || memcmp(capture, CAPTURE_MAGIC, 8)) {
+        fprintf(stderr, "%s: not a capture file\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    // index the records, and map capture connection ids to dense indices
+    const struct capture_record **records = NULL;
+    size_t record_count = 0, record_cap = 0;
+    uint32_t *ids = NULL;
+    size_t id_count = 0, id_cap = 0;
+
+    for (size_t offset = sizeof(struct capture_header); offset + sizeof(struct capture_record) <= capture_len; ) {
+        const struct capture_record *record = (const struct capture_record *) (capture + offset);
+
+        if (offset + sizeof *record + record->len > capture_len) // truncated by a server that was killed
+            break;
+
+        GROW(records, record_count, record_cap);
+        records[record_count++] = record;
+        GROW(ids, id_count, id_cap);
+        ids[id_count++] = record->conn_id;
+
+        offset += sizeof *record + record->len;
+    }
+
+    qsort(ids, id_count, sizeof *ids, compare_u32);
+
+    size_t unique_count = 0;
+    for (size_t i = 0; i < id_count; i++)
+        if (!unique_count || ids[unique_count-1] != ids[i])
+            ids[unique_count++] = ids[i];
+
+    struct replay_conn *conns = calloc(unique_count * g_opts.amplify + 1, sizeof *conns);
+    if (!conns)
+        error_exit("calloc()");
+
+    for (size_t i = 0; i < unique_count * g_opts.amplify; i++)
+        conns[i] = (struct replay_conn) { .capture_id = ids[i / g_opts.amplify], .copy = i % g_opts.amplify, .fd = -1 };
+
+    if ((g_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        error_exit("epoll_create1()");
+
+    printf("replaying %zu records on %zu connection(s) x%d%s\n", record_count, unique_count, g_opts.amplify,
+        g_opts.speed ? "" : ", as fast as possible");
+
+    const uint64_t start = now_ns();
+    size_t next = 0;
+
+    while (next < record_count || g_active_conns) {
+        const uint64_t elapsed = now_ns() - start;
+
+        if (next == record_count) { // connections the capture never saw closed are done once answered
+            int outstanding = 0;
+
+            for (size_t i = 0; i < unique_count * g_opts.amplify && !outstanding; i++)
+                outstanding = conns[i].fd >= 0 && (conns[i].req_count || conns[i].out_sent < conns[i].out_len);
+
+            if (!outstanding)
+                break;
+        }
+
+        for (; next < record_count && (!g_opts.speed || records[next]->time_ns / g_opts.speed <= elapsed); next++) {
+            const uint32_t *id = bsearch(&records[next]->conn_id, ids, unique_count, sizeof *ids, compare_u32);
+            struct replay_conn *first = &conns[(id - ids) * g_opts.amplify];
+
+            for (int copy = 0; copy < g_opts.amplify; copy++)
+                conn_issue(&first[copy], records[next], (const char *) (records[next] + 1));
+        }
+
+        int timeout = IDLE_GIVE_UP_MS;
+        if (next < record_count) {
+            const uint64_t due = records[next]->time_ns / g_opts.speed;
+            timeout = due > elapsed ? (due - elapsed + 999999) / 1000000 : 0;
+            if (timeout > IDLE_GIVE_UP_MS)
+                timeout = IDLE_GIVE_UP_MS;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        const int event_count = epoll_wait(g_epoll_fd, events, MAX_EVENTS, timeout);
+
+        if (event_count < 0 && errno != EINTR)
+            error_exit("epoll_wait()");
+
+        if (!event_count && next == record_count) { // server stopped answering
+            for (size_t i = 0; i < unique_count * g_opts.amplify; i++)
+                if (conns[i].fd >= 0)
+                    conn_close_fd(&conns[i]);
+            printf("gave up on connections idle for %d ms\n", IDLE_GIVE_UP_MS);
+            break;
+        }
+
+        for (int i = 0; i < event_count; i++)
+            conn_on_event(events[i].data.ptr, events[i].events);
+    }
+
+    const double seconds = (now_ns() - start) / 1e9;
+
+    qsort(g_latencies, g_latency_count, sizeof *g_latencies, compare_u64);
+
+    printf("%zu responses in %.3f s: %.0f req/s\n", g_latency_count, seconds, g_latency_count / seconds);
+
+    struct rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage)) // the client's share, to tell it apart from the server's
+        printf("client cpu: %.3f s user, %.3f s system\n", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+
+    if (g_latency_count) {
+        static const double percentiles[] = { 50, 90, 99, 99.9 };
+
+        printf("latency (us):");
+        for (size_t i = 0; i < sizeof percentiles / sizeof *percentiles; i++)
+            printf(" p%g %.1f", percentiles[i], g_latencies[(size_t) (percentiles[i] / 100 * (g_latency_count - 1))] / 1e3);
+        printf(" max %.1f\n", g_latencies[g_latency_count - 1] / 1e3);
+    }
+
+    if (g_failed_conns || g_unanswered)
+        printf("errors: %lu connection(s) failed, %lu request(s) unanswered\n", g_failed_conns, g_unanswered);
+
+    qsort(g_responses, g_response_count, sizeof *g_responses, compare_response);
+
+    if (g_opts.save_baseline)
+        save_baseline(g_opts.save_baseline);
+    if (g_opts.baseline)
+        compare_baseline(g_opts.baseline);
+
+    return g_failed_conns || g_unanswered ? EXIT_FAILURE : EXIT_SUCCESS;
+}